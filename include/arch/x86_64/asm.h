@@ -8,5 +8,15 @@ extern void lgdt();
 extern void ltr();
 extern void lidt(uint64_t idtp);
 extern void invlpg(uintptr_t ptr);
+extern void reload_cr3();
 extern uintptr_t get_current_pml4();
+extern void write_cr3(uintptr_t cr3);
+extern uint64_t read_cr4();
+extern void write_cr4(uint64_t cr4);
 extern uintptr_t get_faulting_address();
+extern void cpuid(uint32_t leaf, uint32_t regs[4]);
+
+// Non-local jumps, e.g. out of a fault handler back into the code that set them up
+typedef uint64_t jmp_buf[8];
+extern int setjmp(jmp_buf env) __attribute__((returns_twice));
+extern void longjmp(jmp_buf env, int value) __attribute__((noreturn));
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "stdint.h"
+#include "stdbool.h"
 
 struct InterruptStackFrame {
 	uint64_t rip, cs, rflags, rsp, ss;
@@ -49,3 +50,31 @@ declare_exception_no_code(isr_reserved7);
 declare_exception(isr_hypervisor_injection_exception)
 declare_exception(isr_vmm_communication_exception)
 declare_exception_no_code(isr_security_exception)
+
+// Offered every not-present page fault before demand paging. Returns true
+// if it dealt with the fault, possibly by pointing frame->rip at recovery
+// code.
+typedef bool (*page_fault_hook_t)(struct InterruptStackFrame* frame, uintptr_t address);
+
+void register_page_fault_hook(page_fault_hook_t hook);
+
+// Address regions page faults are counted by
+enum fault_region {
+    FAULT_REGION_LOW,      // Below the private window: identity map and kernel image
+    FAULT_REGION_PRIVATE,  // An address space's private half
+    FAULT_REGION_VMALLOC,  // The vmalloc window
+    FAULT_REGION_OTHER,    // The rest of the kernel half
+    FAULT_REGIONS,
+};
+
+// Page faults since boot. Minor faults were resolved from memory, major
+// ones needed I/O, and fatal ones were trapped by a hook or reported as
+// unhandled.
+struct fault_stats {
+    uint64_t minor[FAULT_REGIONS];
+    uint64_t major[FAULT_REGIONS];
+    uint64_t fatal[FAULT_REGIONS];
+};
+
+void get_fault_stats(struct fault_stats* stats);
+const char* fault_region_name(enum fault_region region);
@@ -90,4 +90,6 @@ void fat32_vfs_close(struct vfs_node* node);
 uint32_t fat32_vfs_read(struct vfs_node* node, uint32_t offset, uint32_t size, uint8_t* buffer);
 uint32_t fat32_vfs_write(struct vfs_node* node, uint32_t offset, uint32_t size, uint8_t* buffer);
 struct vfs_node* fat32_vfs_readdir(struct vfs_node* node, uint32_t index);
-struct vfs_node* fat32_vfs_finddir(struct vfs_node* node, const char* name); 
\ No newline at end of file
+struct vfs_node* fat32_vfs_finddir(struct vfs_node* node, const char* name);
+struct file_source* fat32_vfs_mmap(struct vfs_node* node);
+struct swap_device* fat32_vfs_swap(struct vfs_node* node); 
\ No newline at end of file
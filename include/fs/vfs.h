@@ -19,6 +19,9 @@
 #define FS_APPEND      0x04
 #define FS_CREATE      0x08
 
+struct file_source;
+struct swap_device;
+
 // File descriptor structure
 struct file_descriptor {
     uint32_t inode;        // Inode number
@@ -45,6 +48,8 @@ struct vfs_node {
     void (*close)(struct vfs_node*);
     struct vfs_node* (*readdir)(struct vfs_node*, uint32_t);
     struct vfs_node* (*finddir)(struct vfs_node*, const char* name);
+    struct file_source* (*mmap)(struct vfs_node*);  // Page source for vfs_mmap
+    struct swap_device* (*swap)(struct vfs_node*);  // Swap area for vfs_swapon
     
     struct vfs_node* parent;    // Parent directory
     struct vfs_node* children;  // Child nodes
@@ -54,6 +59,8 @@ struct vfs_node {
 // Filesystem operations
 void vfs_init(void);
 void vfs_shutdown(void);
+struct vfs_node* vfs_alloc_node(void);
+void vfs_free_node(struct vfs_node* node);
 struct vfs_node* vfs_create_node(const char* name, uint32_t flags);
 void vfs_destroy_node(struct vfs_node* node);
 struct vfs_node* vfs_mount(const char* path, struct vfs_node* node);
@@ -61,6 +68,20 @@ struct vfs_node* vfs_open(const char* path, uint32_t flags);
 void vfs_close(struct vfs_node* node);
 uint32_t vfs_read(struct vfs_node* node, uint32_t offset, uint32_t size, uint8_t* buffer);
 uint32_t vfs_write(struct vfs_node* node, uint32_t offset, uint32_t size, uint8_t* buffer);
+// Map [offset, offset + size) of a file read-only into kernel memory, with
+// offset page-aligned. Pages come from the page cache and are read from the
+// device only when first touched. The mapping stays valid after the node is
+// closed, until vfs_munmap.
+void* vfs_mmap(struct vfs_node* node, uint32_t offset, uint32_t size);
+void vfs_munmap(void* addr);
+// Read in [addr, addr + size) of a mapping up front. Faults can only draw on
+// a small frame reserve, so do this before walking more than a few hundred
+// KB of a mapping.
+bool vfs_mmap_populate(void* addr, uint32_t size);
+// Swap to a file (see swap.h). Its location on disk is looked up once, so
+// writing to or deleting it is refused while it is in use; pages of it
+// that are not on consecutive sectors are left out.
+bool vfs_swapon(struct vfs_node* node);
 struct vfs_node* vfs_readdir(struct vfs_node* node, uint32_t index);
 struct vfs_node* vfs_finddir(struct vfs_node* node, const char* name);
 bool vfs_chdir(const char* path);
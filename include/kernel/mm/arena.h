@@ -0,0 +1,26 @@
+#pragma once
+
+#include "stdint.h"
+#include "stddef.h"
+
+// Bump allocator for objects that share one lifetime; freed all at once
+struct arena_chunk;
+
+typedef struct arena {
+    struct arena_chunk* chunks;  // Newest chunk first; allocations bump from it
+    size_t chunk_size;           // Payload size of the next regular chunk
+    size_t allocated;            // Bytes handed out, for statistics
+} arena_t;
+
+// Prepare an empty arena; size_hint sizes the first chunk
+void arena_init(arena_t* arena, size_t size_hint);
+
+// 16-byte aligned memory that lives until arena_release
+void* arena_alloc(arena_t* arena, size_t size);
+void* arena_zalloc(arena_t* arena, size_t size);
+
+// Copy len bytes into the arena and NUL-terminate them
+char* arena_strndup(arena_t* arena, const void* src, size_t len);
+
+// Free every chunk at once and leave the arena empty and reusable
+void arena_release(arena_t* arena);
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "stdint.h"
+#include "stddef.h"
+#include "stdbool.h"
+#include "kernel/mm/pmm.h"
+
+// Where a mapped file's pages come from. read_page fills page `index` of
+// the file into a zeroed frame, leaving everything past `size` zero. It runs
+// in the page fault handler with interrupts off, so it must not sleep, take
+// locks or allocate. release frees the source once its mapping is gone.
+struct file_source {
+    uint64_t id;    // Names the file's pages in the page cache
+    uint32_t size;  // File size in bytes
+    bool (*read_page)(struct file_source* source, uint32_t index, void* buffer);
+    void (*release)(struct file_source* source);
+};
+
+// Page cache counters
+struct page_cache_stats {
+    uint64_t pages;     // Frames holding file data
+    uint64_t mappings;  // Live filemap_map ranges
+    uint64_t hits;      // Faults served from the cache
+    uint64_t misses;    // Faults that read the device
+    uint64_t evicted;   // Frames given back by the shrinker or invalidation
+};
+
+void filemap_init(void);
+
+// Map pages [first, first + count) of a file read-only into the vmalloc
+// window. Nothing is read up front: each page comes from the page cache, or
+// the device, when it is first touched. The mapping takes over `source` and
+// releases it on failure.
+void* filemap_map(struct file_source* source, uint32_t first, size_t count);
+void filemap_unmap(void* addr);
+
+// Read in and map the pages of a mapping covering [addr, addr + size)
+// ahead of use, with frames from the allocator rather than the small fault
+// reserve. Returns false if memory ran out or the device failed; the pages
+// done so far stay mapped.
+bool filemap_populate(void* addr, size_t size);
+
+// Resolve a fault in a file mapping. Returns false if the address is not in
+// one. Otherwise *page is the cache frame with a mapping reference taken
+// for the caller, or NULL if it could not be read, and *major says whether
+// the device was read.
+bool filemap_fault(uintptr_t address, struct page** page, bool* major);
+
+// Drop a file's cached pages after it changed on disk. Mappings made before
+// keep the frames they have, which are freed with the last of them; the
+// next fault or mapping reads the file again.
+void filemap_invalidate(uint64_t id);
+
+// Take one unmapped frame out of the cache for the caller to reuse, with
+// its old contents; NULL if there is none. Safe with interrupts off.
+struct page* filemap_reclaim_page(void);
+
+void get_page_cache_stats(struct page_cache_stats* stats);
+
+// Testing
+void filemap_test(void);
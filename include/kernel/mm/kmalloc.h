@@ -1,8 +1,60 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
+
+// Heap usage counters
+struct kmalloc_stats {
+    uint64_t slabs;        // Slabs backing the size classes
+    uint64_t slab_pages;   // Frames held by those slabs
+    uint64_t active;       // Blocks handed out from the size classes
+    uint64_t large_pages;  // Frames behind blocks too big for a size class
+};
+
+// Allocation counters for one kmalloc call site
+struct kmalloc_site {
+    uintptr_t caller;     // Return address of the call, 0 for sites that did not fit
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t bytes;       // Bytes requested over all allocations
+    uint64_t live_bytes;  // Heap footprint of blocks not freed yet
+};
 
 void kmalloc_init(void);
+
+// kmalloc and kzalloc return zeroed memory; kmalloc_uninit skips the clear
+// for callers that overwrite the whole buffer anyway
 void *kmalloc(size_t size);
+void *kzalloc(size_t size);
+void *kmalloc_uninit(size_t size);
+void *krealloc(void *ptr, size_t size);
 void kfree(void *ptr);
+void kmalloc_get_stats(struct kmalloc_stats* stats);
+
+// Typed object caches: fixed-size objects from dedicated slabs. The
+// constructor, if any, runs on every object handed out. kfree also
+// accepts cache objects.
+struct kmem_cache;
+
+struct kmem_cache_stats {
+    const char* name;
+    uint32_t object_size;
+    uint32_t objects_per_slab;
+    uint64_t active;      // Objects handed out
+    uint64_t allocs;      // Allocations over the cache's lifetime
+    uint64_t slabs;
+    uint64_t slab_pages;
+};
+
+struct kmem_cache* kmem_cache_create(const char* name, size_t size, void (*ctor)(void*));
+void* kmem_cache_alloc(struct kmem_cache* cache);
+void kmem_cache_free(struct kmem_cache* cache, void* ptr);
+// Release an unused cache and its slabs; refused while objects are out
+void kmem_cache_destroy(struct kmem_cache* cache);
+
+// Copy out statistics for up to max caches, kmalloc size classes included
+size_t kmem_cache_get_stats(struct kmem_cache_stats* stats, size_t max);
+
+// Copy out up to max call sites with allocations; empty unless built with KMALLOC_PROFILE
+size_t kmalloc_get_sites(struct kmalloc_site* sites, size_t max);
 void heap_test();
\ No newline at end of file
@@ -2,9 +2,119 @@
 
 #include "stdint.h"
 #include "stddef.h"
+#include "stdbool.h"
 
-void buddy_init(uintptr_t mem_start, uint64_t mem_size);
+#define PAGE_SHIFT 12
+#define PAGE_SIZE 4096
+
+#define MAX_ORDER 18  // 2^18 pages = 1GB maximum block size
+
+// Page flags
+#define PG_FREE      0x01  // Head of a block sitting in a buddy free list
+#define PG_ALLOCATED 0x02  // Head of a block handed out by the allocator
+#define PG_RESERVED  0x04  // Frame is not managed by the allocator
+#define PG_PCP       0x08  // Order-0 frame parked in a per-CPU cache
+#define PG_ZEROED    0x10  // Order-0 frame waiting in the zero pool or fault reserve
+#define PG_SLAB      0x20  // Frame belongs to a kmalloc slab
+#define PG_PGTABLE   0x40  // Frame holds a page table owned by the VMM
+#define PG_SHARED    0x80  // Frame mapped copy-on-write; inuse counts the mappings
+#define PG_CACHE     0x100 // Frame holds file data in the page cache
+
+// Out-of-band metadata for every physical frame, indexed by PFN
+struct page {
+    struct page* next;  // Free list or slab partial list links
+    struct page* prev;
+    uint32_t flags;     // PG_* bits
+    uint16_t order;     // Block order, valid on the head page
+    uint16_t inuse;     // Slab: objects handed out; page table: present entries;
+                        // PG_SHARED frame: mappings
+    void* freelist;     // Slab: first free object
+    void* private;      // Owner data, e.g. the slab's cache
+};
+
+// Seed the allocator with every available multiboot2 memory map region
+void buddy_init(uintptr_t kernel_end);
+
+// Page-level interface
+struct page* alloc_pages(uint32_t order);
+// Like alloc_pages, but without running shrinkers or logging a failure
+struct page* try_alloc_pages(uint32_t order);
+void free_pages(struct page* page);
+
+// Copy-on-write sharing. get_page adds a mapping to a frame; put_page_testzero
+// drops one and returns true if it was the last, so the frame can be freed.
+void get_page(struct page* page);
+bool put_page_testzero(struct page* page);
+struct page* phys_to_page(uintptr_t phys);
+uintptr_t page_to_phys(struct page* page);
+
+// All physical memory is mapped at DIRECT_MAP_BASE once buddy_init has
+// built the direct map (see direct_map_range)
+#define DIRECT_MAP_BASE 0xFFFF888000000000ull
+#define DIRECT_MAP_SIZE (1ull << 42)  // Frames past 4 TB are not used
+
+static inline void* phys_to_virt(uintptr_t phys) {
+    return (void*)(phys + DIRECT_MAP_BASE);
+}
+
+// The kernel image, and with it loader.asm's tables, still runs from the
+// identity map of the first 1 GB, so its addresses translate unchanged
+static inline uintptr_t virt_to_phys(const void* virt) {
+    uintptr_t addr = (uintptr_t)virt;
+    return addr - DIRECT_MAP_BASE < DIRECT_MAP_SIZE ? addr - DIRECT_MAP_BASE : addr;
+}
+
+static inline void* page_address(struct page* page) {
+    return phys_to_virt(page_to_phys(page));
+}
+
+static inline struct page* virt_to_page(const void* virt) {
+    return phys_to_page(virt_to_phys(virt));
+}
+
+// Per-CPU order-0 frame cache counters, summed over all CPUs
+struct pcp_stats {
+    uint64_t hits;     // Allocations served without touching the buddy lock
+    uint64_t misses;   // Allocations that had to refill first
+    uint64_t refills;  // Batches pulled from the buddy core
+    uint64_t drains;   // Batches returned to the buddy core
+    uint64_t count;    // Frames currently cached
+};
+
+void get_pcp_stats(struct pcp_stats* stats);
+
+// Return every cached order-0 frame to the buddy core
+void drain_page_caches(void);
+
+// Pre-zeroed frame pool counters
+struct zero_pool_stats {
+    uint64_t hits;           // Zeroed allocations served from the pool
+    uint64_t misses;         // Zeroed allocations that had to clear memory inline
+    uint64_t zeroed;         // Frames cleared in the background
+    uint64_t count;          // Frames currently in the pool
+    uint64_t reserve;        // Frames held back for alloc_atomic_page
+    uint64_t reserve_empty;  // alloc_atomic_page calls that found nothing
+};
+
+void get_zero_pool_stats(struct zero_pool_stats* stats);
+
+// Clear a few frames into the fault reserve and the zeroed pool; called
+// from idle loops
+void refill_zero_pool(void);
+
+// Allocate one zero-filled frame, preferring the pre-zeroed pool
+struct page* alloc_zeroed_page(void);
+
+// Take a zeroed frame from the fault reserve, or failing that the zeroed
+// pool, without locks or reclaim; safe with interrupts off, e.g. in the
+// page fault handler. Returns NULL when both are empty. free_atomic_page
+// puts back a frame that is still all zeroes.
+struct page* alloc_atomic_page(void);
+void free_atomic_page(struct page* page);
+
+// Byte-sized interface returning page-aligned kernel pointers
 void* buddy_alloc(size_t size);
+void* buddy_alloc_zeroed(size_t size);
 void buddy_free(void* ptr);
 uint64_t get_used_ram(void);
 
@@ -12,5 +122,25 @@ uint64_t get_used_ram(void);
 uint64_t get_free_ram(void);
 uint64_t get_fragmented_ram(void);
 
+// Compaction counters
+struct compact_stats {
+    uint64_t runs;      // compact_memory passes
+    uint64_t blocks;    // Free 2 MB blocks rebuilt
+    uint64_t migrated;  // Frames moved to empty them
+    uint64_t failed;    // Candidate blocks that held a frame that could not move
+    uint64_t deferred;  // Idle calls skipped after fruitless passes
+};
+
+// Rebuild up to `blocks` free 2 MB blocks by moving the frames of nearly
+// free ones elsewhere (see migrate_range). Returns how many were rebuilt.
+size_t compact_memory(size_t blocks);
+
+// Compact from idle loops while no 2 MB block is free, backing off after
+// passes that recover nothing
+void compact_idle(void);
+
+void get_compact_stats(struct compact_stats* stats);
+
 // Testing
-void test_buddy_allocator(void);
\ No newline at end of file
+void test_buddy_allocator(void);
+void compaction_test(void);
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "stdint.h"
+#include "stddef.h"
+
+// A kernel cache that can give pages back when an allocation would fail
+struct shrinker {
+    const char* name;
+
+    // Pages the cache could release right now
+    size_t (*count)(void);
+
+    // Release up to nr_pages pages, returning how many were freed
+    size_t (*scan)(size_t nr_pages);
+
+    // Statistics
+    uint64_t invocations;
+    uint64_t pages_freed;
+
+    struct shrinker* next;
+};
+
+void register_shrinker(struct shrinker* shrinker);
+void unregister_shrinker(struct shrinker* shrinker);
+
+// Ask registered caches to release at least nr_pages, returning pages freed
+size_t shrink_caches(size_t nr_pages);
+
+// Walk the registry for statistics
+const struct shrinker* shrinker_first(void);
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "stdint.h"
+#include "stddef.h"
+#include "stdbool.h"
+
+// Where swapped-out pages go: `pages` page-sized slots. read_page and
+// write_page move one page between memory and a slot. Both run with
+// interrupts off, and may run in the page fault handler, so they must not
+// sleep, take locks or allocate. release frees a device swapon turned down.
+struct swap_device {
+    const char* name;
+    uint32_t pages;
+    bool (*read_page)(struct swap_device* device, uint32_t slot, void* buffer);
+    bool (*write_page)(struct swap_device* device, uint32_t slot, const void* buffer);
+    void (*release)(struct swap_device* device);
+};
+
+// Swap counters
+struct swap_stats {
+    uint64_t slots;        // Pages the device holds
+    uint64_t used;         // Slots holding a swapped-out page
+    uint64_t swapped_out;  // Pages written to the device
+    uint64_t swapped_in;   // Pages read back by page faults
+    uint64_t errors;       // Device reads and writes that failed
+};
+
+#define SWAP_NONE 0xFFFFFFFFu
+
+// Register the swap shrinker; before any other, so memory pressure only
+// turns to swap once the caches have given up what they can
+void swap_init(void);
+
+// Start swapping private pages of address spaces to `device`. Only one
+// device is used at a time; swapon takes over `device` and releases it on
+// failure.
+bool swapon(struct swap_device* device);
+
+// Slots for the VMM, which keeps them in the page tables. swap_write_page
+// stores a page in a free slot and returns it, or SWAP_NONE if the device
+// is full or failed. A slot is freed once every swap_dup of it has had its
+// swap_free. Safe with interrupts off.
+uint32_t swap_write_page(const void* data);
+bool swap_read_page(uint32_t slot, void* buffer);
+bool swap_dup(uint32_t slot);
+void swap_free(uint32_t slot);
+
+void get_swap_stats(struct swap_stats* stats);
+
+// Testing
+void swap_test(void);
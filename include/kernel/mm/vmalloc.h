@@ -0,0 +1,55 @@
+#pragma once
+
+#include "stdint.h"
+#include "stddef.h"
+#include "stdbool.h"
+
+// Kernel virtual window for page-granular areas built from scattered frames
+#define VMALLOC_START 0xFFFF900000000000ull
+#define VMALLOC_SIZE (64ull << 30)
+
+// vmalloc usage counters
+struct vmalloc_stats {
+    uint64_t areas;         // Areas handed out
+    uint64_t pages;         // Frames mapped behind them
+    uint64_t free_ranges;   // Holes tracked in the free-range tree
+    uint64_t largest_free;  // Pages in the biggest hole
+};
+
+void vmalloc_init(void);
+
+// Page-aligned memory that needs no physically contiguous frames. vmalloc
+// returns zeroed memory; vmalloc_uninit skips the clear.
+void* vmalloc(size_t size);
+void* vmalloc_uninit(size_t size);
+void vfree(void* addr);
+
+// Grow an area over the free pages right after it; the new tail is not
+// cleared. Returns false, leaving the area untouched, if they are taken.
+bool vmalloc_extend(void* addr, size_t size);
+
+// Bytes mapped for the area starting at addr
+size_t vmalloc_size(const void* addr);
+
+// Reserve a hole in the window without backing it, for owners that map
+// pages into it themselves. vunreserve drops whatever is mapped there the
+// way unmap_anonymous does and gives the hole back.
+void* vmalloc_reserve(size_t size);
+void vunreserve(void* addr, size_t size);
+
+// Back a page-aligned range outside the window, e.g. in an address space's
+// private half, with fresh frames; on failure nothing stays mapped.
+// unmap_anonymous drops whatever backs a range, skipping holes, and frees
+// the frames no other space shares copy-on-write and the swap slots of
+// pages swapped out; it returns the frames freed.
+bool map_anonymous(uintptr_t start, size_t size, bool zero);
+size_t unmap_anonymous(uintptr_t start, size_t size);
+
+static inline bool is_vmalloc_addr(const void* addr) {
+    return (uintptr_t)addr >= VMALLOC_START && (uintptr_t)addr - VMALLOC_START < VMALLOC_SIZE;
+}
+
+void vmalloc_get_stats(struct vmalloc_stats* stats);
+
+// Testing
+void vmalloc_test(void);
@@ -10,7 +10,161 @@
 #define PAGE_USER       0x04
 #define PAGE_NOCACHE    0x08
 #define PAGE_WASM       0x10  // Special flag for WASM pages
+#define PAGE_HUGE       0x80  // 2 MB or 1 GB leaf in a PD or PDPT entry
 
-void map_virtual_to_physical(uintptr_t virtual_address, uintptr_t physical_address, uint8_t flags);
+#define PTE_ADDR_MASK   0x000FFFFFFFFFF000ull
 
+// Lower-half window private to each address space; PML4 slot 0 keeps the
+// kernel's identity map and the upper half is shared by every space
+#define USER_SPACE_START 0x0000008000000000ull
+#define USER_SPACE_END   0x0000800000000000ull
+
+#define TLB_BATCH_MAX   32  // Queued flushes beyond which a CR3 reload is cheaper
+
+// TLB invalidations gathered over a run of page table updates and issued
+// together by tlb_batch_finish
+struct tlb_batch {
+    uintptr_t addresses[TLB_BATCH_MAX];
+    size_t count;          // Live translations changed; past TLB_BATCH_MAX only counted
+    size_t invalidations;  // invlpgs the updates would have cost one at a time
+    bool shared;           // Some address was in the kernel half
+    struct page* tables;   // Emptied page tables, freed after the flush
+};
+
+void tlb_batch_init(struct tlb_batch* batch);
+
+// Flush everything queued, then free the page tables the batch holds
+void tlb_batch_finish(struct tlb_batch* batch);
+
+// The functions below work on the current address space for addresses in
+// the private window and on the shared kernel half otherwise.
+
+// Map one 4 KB page, allocating page tables and splitting a large page in
+// the way as needed. Returns false if a page table could not be allocated.
+bool map_virtual_to_physical(uintptr_t virtual_address, uintptr_t physical_address, uint8_t flags);
+
+// Map `count` consecutive 4 KB pages to arbitrary frames, filling each page
+// table in one pass. On failure nothing stays mapped.
+bool map_frames(uintptr_t virtual_address, const uintptr_t* frames, size_t count, uint8_t flags);
+
+// Map a physically contiguous range with the largest leaves (1 GB, 2 MB or
+// 4 KB) that alignment and size allow. On failure nothing stays mapped.
+bool map_range(uintptr_t virtual_address, uintptr_t physical_address, size_t size, uint8_t flags);
+
+// Translate an address through 4 KB, 2 MB and 1 GB mappings (0 if unmapped)
 uintptr_t virtual_to_physical(uintptr_t virtual_address);
+
+// Remove a 4 KB mapping, returning the frame it pointed to (0 if none). A
+// large page covering the address is split first.
+uintptr_t unmap_virtual(uintptr_t virtual_address);
+
+// Remove whatever leaf maps an address, returning its first frame (0 if
+// none). *size is the span of the leaf or of the unmapped hole around the
+// address; both are aligned to it. The flush is queued in `batch`, so the
+// frame must not be reused before tlb_batch_finish.
+uintptr_t unmap_leaf(uintptr_t virtual_address, size_t* size, struct tlb_batch* batch);
+
+// Remove every mapping in [start, start + size) and free the page tables
+// left empty, splitting large pages that straddle either end. The mapped
+// frames themselves are left to the caller.
+void unmap_range(uintptr_t start, size_t size);
+
+// A set of page tables: the kernel half shared with every other space plus
+// a private [USER_SPACE_START, USER_SPACE_END)
+struct address_space {
+    uintptr_t pml4;    // Physical address of the top-level table
+    uint16_t pcid;     // TLB tag when PCID is available; 0 is the kernel's
+    uint64_t tlb_gen;  // Kernel TLB generation this space's PCID has seen
+    struct address_space* next;
+    struct address_space* prev;
+};
+
+// The boot page tables, current until something else is switched in
+extern struct address_space kernel_space;
+
+// Build the direct map of physical memory. Runs from buddy_init before any
+// frame can be allocated: direct_map_tables_needed sizes a pool of boot
+// memory below 1 GB for `ranges` RAM ranges ending at or below `max_phys`,
+// then direct_map_range maps each range with 1 GB leaves where the CPU has
+// them and 2 MB leaves otherwise, taking its page tables from
+// [*pool, pool_end) and advancing *pool. Range ends are rounded out to
+// 2 MB. Returns false if the pool ran dry.
+size_t direct_map_tables_needed(uint64_t max_phys, uint32_t ranges);
+bool direct_map_range(uint64_t start, uint64_t end, uintptr_t* pool, uintptr_t pool_end);
+
+void vmm_init(void);
+
+// A new space with nothing mapped in its private half
+struct address_space* address_space_create(void);
+
+// Free a space's page tables. The frames it still maps belong to the
+// caller; the swap slots of pages it swapped out are released.
+void address_space_destroy(struct address_space* space);
+
+// Load a space, returning the one it replaces. With PCID the TLB entries of
+// the spaces involved survive the switch.
+struct address_space* address_space_switch(struct address_space* space);
+struct address_space* current_address_space(void);
+
+// Map the private frames of [start, start + size) in `source` into the
+// current space at the same addresses, copy-on-write: both sides lose write
+// access until a write fault hands the writer its own frame. Large leaves
+// are copied up front. On failure the current space may hold part of the
+// range; unmap it with unmap_anonymous.
+bool share_range_cow(struct address_space* source, uintptr_t start, size_t size);
+
+// Move the frames in [start, end) that back 4 KB pages of the vmalloc
+// window or of any space's private half onto frames from `alloc`, which
+// must lie outside the range. Frames shared copy-on-write or cached stay.
+// Returns the frames moved away from, linked through page->next, and
+// counts them in *moved.
+struct page* migrate_range(uintptr_t start, uintptr_t end, struct page* (*alloc)(void), size_t* moved);
+
+// Move up to nr_pages private pages of any space that have not been
+// accessed for a lap of the swap clock out to swap (swap_write_page) and
+// free their frames. Returns the number of frames freed.
+size_t swap_out_anonymous(size_t nr_pages);
+
+// Resident private pages of all spaces that swap_out_anonymous could move
+// out, whether or not they are cold yet, counted up to `limit`
+size_t count_anonymous_pages(size_t limit);
+
+// Page fault error code bits
+#define PF_PRESENT 0x01  // The page was present: a protection fault
+#define PF_WRITE   0x02
+
+enum fault_result {
+    FAULT_FATAL,  // Not resolvable here; the access is a bug or a trap
+    FAULT_MINOR,  // Resolved from memory: demand zero, copy-on-write or a page cache hit
+    FAULT_MAJOR,  // Resolved after waiting for I/O
+};
+
+// Resolve a page fault in the current space: swapped-out pages read back,
+// page cache frames for file mappings (see filemap.h), zero-filled frames
+// for other not-present pages in the private half, copies for writes to
+// copy-on-write pages. Not-present kernel addresses are FAULT_FATAL. Frames
+// and page tables come from alloc_atomic_page, so this takes no locks and
+// logs nothing.
+enum fault_result vmm_handle_fault(uintptr_t address, uint64_t error_code);
+
+struct vmm_stats {
+    uint64_t page_tables;          // Table frames allocated from the PMM
+    uint64_t huge_mappings;        // 2 MB and 1 GB leaves installed by map_range so far
+    uint64_t splits;               // Large pages broken up into smaller leaves
+    uint64_t tlb_page_flushes;     // invlpg instructions issued by batches
+    uint64_t tlb_full_flushes;     // CR3 reloads standing in for larger batches
+    uint64_t tlb_flushes_avoided;  // invlpgs saved versus flushing every update
+    uint64_t address_spaces;       // Spaces alive besides the kernel's
+    uint64_t space_switches;       // CR3 loads by address_space_switch
+    uint64_t switch_flushes;       // Switches that could not keep the TLB
+    uint64_t cow_faults;           // Copy-on-write faults resolved
+    uint64_t cow_copies;           // Of those, frames actually copied
+    uint64_t direct_map;           // Bytes of physical memory in the direct map
+    uint64_t direct_gb_pages;      // 1 GB leaves among them
+    uint64_t direct_2mb_pages;     // 2 MB leaves among them
+};
+
+void vmm_get_stats(struct vmm_stats* stats);
+
+// Testing
+void address_space_test(void);
@@ -60,4 +60,10 @@ void semaphore_signal(semaphore_t* sem);
 // Try to wait (non-blocking) - returns true if successful
 bool semaphore_try_wait(semaphore_t* sem);
 
+// Disable interrupts on this CPU, returning the previous RFLAGS
+uint64_t irq_save(void);
+
+// Restore the interrupt flag saved by irq_save
+void irq_restore(uint64_t flags);
+
 #endif // _KERNEL_SYNC_H 
\ No newline at end of file
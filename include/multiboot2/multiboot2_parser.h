@@ -1,6 +1,21 @@
 #include "multiboot2.h"
 #include "stdint.h"
 
+#define MAX_MEMORY_REGIONS 32
+
+// A physical memory range reported by the bootloader
+struct memory_region {
+    uint64_t base;
+    uint64_t length;
+    uint32_t type;  // MULTIBOOT_MEMORY_* value
+};
+
 uint64_t get_total_ram();
 
+// Memory map copied out of the MULTIBOOT_TAG_TYPE_MMAP tag
+const struct memory_region* multiboot2_get_memory_map(uint32_t* count);
+
+// Physical range occupied by the multiboot information structure
+void multiboot2_get_info_range(uintptr_t* start, uintptr_t* end);
+
 void multiboot2_parse();
@@ -2,6 +2,8 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include "kernel/mm/arena.h"
+#include "kernel/mm/vmm.h"
 
 // Forward declarations
 typedef struct wasm_instance wasm_instance_t;
@@ -87,6 +89,7 @@ struct wasm_import_object {
 typedef struct {
     uint8_t* bytes;
     size_t size;
+    bool mapped;    // bytes is a vfs_mmap mapping rather than a kmalloc copy
     wasm_functype_t* types;
     uint32_t type_count;
     wasm_import_t* imports;
@@ -99,13 +102,26 @@ typedef struct {
     uint32_t memory_max;
     wasm_global_t* globals;
     uint32_t global_count;
+    arena_t arena;  // Owns everything the parser allocates for this module
 } wasm_module_t;
 
+#define WASM_PAGE_SIZE 65536
+
+// Address space reserved for each instance's linear memory. Only the first
+// memory_size bytes are mapped, though cold pages of them may be out in
+// swap; any i32 address plus any u32 offset lands inside the reservation,
+// so out-of-bounds accesses fault instead of being checked one by one.
+#define WASM_MEMORY_RESERVE ((8ull << 30) + WASM_PAGE_SIZE)
+
+// Every instance has its own address space with the memory at this address
+#define WASM_MEMORY_BASE USER_SPACE_START
+
 // WebAssembly instance
 struct wasm_instance {
     wasm_module_t* module;
-    void* memory;
-    size_t memory_size;
+    struct address_space* space;  // Private half holding the linear memory
+    void* memory;        // WASM_MEMORY_BASE, valid while space is current
+    size_t memory_size;  // Bytes of it that are mapped
     wasm_function_t* functions;
     uint32_t function_count;
     wasm_global_t* globals;
@@ -117,9 +133,15 @@ struct wasm_instance {
 
 // Function declarations
 wasm_module_t* wasm_module_new(const uint8_t* bytes, size_t size);
+// Parse a module in place from a read-only vfs_mmap mapping, which the
+// module takes over and unmaps when deleted
+wasm_module_t* wasm_module_new_mapped(uint8_t* bytes, size_t size);
 void wasm_module_delete(wasm_module_t* module);
 wasm_instance_t* wasm_instance_new(wasm_module_t* module);
 void wasm_instance_delete(wasm_instance_t* instance);
+// Start a new instance from a template's current memory and globals, e.g.
+// after running its initialisation once; memory is shared copy-on-write
+wasm_instance_t* wasm_instance_clone(wasm_instance_t* template);
 bool wasm_function_call(wasm_function_t* function, wasm_value_t* args, uint32_t arg_count, wasm_value_t* result);
 
 // Import object functions
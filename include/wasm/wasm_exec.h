@@ -96,4 +96,11 @@ typedef struct {
 bool wasm_execute_function(wasm_function_t* function, wasm_value_t* args, uint32_t arg_count, wasm_value_t* result);
 bool wasm_execute_instruction(wasm_exec_context_t* ctx);
 void wasm_exec_context_init(wasm_exec_context_t* ctx, wasm_instance_t* instance, uint32_t local_count);
-void wasm_exec_context_cleanup(wasm_exec_context_t* ctx); 
\ No newline at end of file
+void wasm_exec_context_cleanup(wasm_exec_context_t* ctx);
+
+// Turn faults in an executing instance's memory reservation into traps
+void wasm_exec_install_trap_handler(void);
+
+// Testing
+void wasm_trap_test(void);
+void wasm_clone_test(void); 
\ No newline at end of file
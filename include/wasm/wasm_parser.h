@@ -42,6 +42,6 @@ wasm_module_t* wasm_module_new(const uint8_t* bytes, size_t size);
 void wasm_module_delete(wasm_module_t* module);
 
 // Parse a function type
-bool parse_functype(const uint8_t* bytes, size_t size, size_t* offset, wasm_functype_t* type);
+bool parse_functype(arena_t* arena, const uint8_t* bytes, size_t size, size_t* offset, wasm_functype_t* type);
 
 void wasm_parser_test(const uint8_t* wasm_bytes, size_t wasm_size); 
\ No newline at end of file
@@ -48,16 +48,85 @@ invlpg:
     invlpg [rdi]
     ret
 
+; Drop every non-global TLB entry
+global reload_cr3
+reload_cr3:
+    mov rax, cr3
+    mov cr3, rax
+    ret
+
 global get_current_pml4
 get_current_pml4:
     mov rax, cr3
     ret
 
+global write_cr3
+write_cr3:
+    mov cr3, rdi
+    ret
+
+global read_cr4
+read_cr4:
+    mov rax, cr4
+    ret
+
+global write_cr4
+write_cr4:
+    mov cr4, rdi
+    ret
+
 global get_faulting_address
 get_faulting_address:
     mov rax, cr2
     ret
 
+; void cpuid(uint32_t leaf, uint32_t regs[4]) - eax, ebx, ecx, edx
+global cpuid
+cpuid:
+    push rbx
+    mov eax, edi
+    xor ecx, ecx
+    cpuid
+    mov [rsi], eax
+    mov [rsi + 4], ebx
+    mov [rsi + 8], ecx
+    mov [rsi + 12], edx
+    pop rbx
+    ret
+
+; int setjmp(jmp_buf env) - callee-saved registers, stack pointer and return address
+global setjmp
+setjmp:
+    mov [rdi], rbx
+    mov [rdi + 8], rbp
+    mov [rdi + 16], r12
+    mov [rdi + 24], r13
+    mov [rdi + 32], r14
+    mov [rdi + 40], r15
+    lea rdx, [rsp + 8]
+    mov [rdi + 48], rdx
+    mov rdx, [rsp]
+    mov [rdi + 56], rdx
+    xor eax, eax
+    ret
+
+; void longjmp(jmp_buf env, int value) - setjmp returns again with value (1 if 0)
+global longjmp
+longjmp:
+    mov eax, esi
+    test eax, eax
+    jnz .restore
+    inc eax
+.restore:
+    mov rbx, [rdi]
+    mov rbp, [rdi + 8]
+    mov r12, [rdi + 16]
+    mov r13, [rdi + 24]
+    mov r14, [rdi + 32]
+    mov r15, [rdi + 40]
+    mov rsp, [rdi + 48]
+    jmp [rdi + 56]
+
 section .text
 bits 32
 loader:
@@ -109,9 +178,10 @@ setup_page_tables:
     or eax, 1 << 8
     wrmsr ; write model-specific register
 
-    ; enable paging
+    ; enable paging, with read-only pages binding ring 0 too (CR0.WP)
     mov eax, cr0
     or eax, 1 << 31
+    or eax, 1 << 16
     mov cr0, eax
 
     ret
@@ -5,6 +5,7 @@
 #include "stdbool.h"
 #include "stddef.h"
 #include "drivers/keyboard.h"
+#include "kernel/mm/pmm.h"
 
 // Keyboard ports
 #define KEYBOARD_DATA_PORT    0x60
@@ -162,6 +163,9 @@ void irq_keyboard_handler(struct InterruptStackFrame* frame) {
 // Blocking read function that waits for keyboard input
 char keyboard_read_blocking(void) {
     while (keyboard_buffer_empty()) {
+        // Use the wait to zero frames ahead of time and regroup free memory
+        refill_zero_pool();
+        compact_idle();
         // Enable interrupts while waiting
         asm volatile("sti");
         // Halt CPU to save power while waiting
@@ -1,6 +1,8 @@
 #include "arch/x86_64/interrupt/isr.h"
 #include "kernel/kprintf.h"
 #include "kernel/mm/vmm.h"
+#include "kernel/mm/vmalloc.h"
+#include "kernel/sync.h"
 #include "arch/x86_64/asm.h"
 
 void print_interrupt_stack_frame(struct InterruptStackFrame* frame) {
@@ -79,27 +81,82 @@ define_exception(isr_hypervisor_injection_exception)
 define_exception(isr_vmm_communication_exception)
 define_exception_no_code(isr_security_exception)
 
-__attribute__((interrupt))
-void isr_page_fault(struct InterruptStackFrame* frame, uint64_t error_code) {
+#define MAX_PAGE_FAULT_HOOKS 4
 
-    if (error_code & 0x1) {
-        kprintf(ERROR, "Page fault caused by protection violation!\n");
-        default_handler(frame, error_code);
+static page_fault_hook_t page_fault_hooks[MAX_PAGE_FAULT_HOOKS];
+static uint32_t page_fault_hook_count = 0;
+
+void register_page_fault_hook(page_fault_hook_t hook) {
+    for (uint32_t i = 0; i < page_fault_hook_count; i++) {
+        if (page_fault_hooks[i] == hook) return;
+    }
+    if (page_fault_hook_count >= MAX_PAGE_FAULT_HOOKS) {
+        kprintf(ERROR, "Too many page fault hooks\n");
         return;
     }
+    page_fault_hooks[page_fault_hook_count++] = hook;
+}
+
+static struct fault_stats fault_stats;
+
+static const char* const fault_region_names[FAULT_REGIONS] = {
+    [FAULT_REGION_LOW] = "low",
+    [FAULT_REGION_PRIVATE] = "private",
+    [FAULT_REGION_VMALLOC] = "vmalloc",
+    [FAULT_REGION_OTHER] = "other",
+};
+
+static enum fault_region fault_region(uintptr_t address) {
+    if (address < USER_SPACE_START) return FAULT_REGION_LOW;
+    if (address < USER_SPACE_END) return FAULT_REGION_PRIVATE;
+    if (is_vmalloc_addr((void*)address)) return FAULT_REGION_VMALLOC;
+    return FAULT_REGION_OTHER;
+}
+
+const char* fault_region_name(enum fault_region region) {
+    return region < FAULT_REGIONS ? fault_region_names[region] : "?";
+}
+
+void get_fault_stats(struct fault_stats* stats) {
+    uint64_t irq_flags = irq_save();
+    *stats = fault_stats;
+    irq_restore(irq_flags);
+}
+
+// Nothing on the resolved paths may log, take a lock or call the allocator
+// proper: the fault may have hit code holding buddy_mutex.
+__attribute__((interrupt))
+void isr_page_fault(struct InterruptStackFrame* frame, uint64_t error_code) {
 
     uintptr_t faulting_address = get_faulting_address();
-    
-    kprintf(ERROR, "Faulting Address: %p\n", faulting_address);
-    
-    uintptr_t virtual_address = faulting_address & ~(PAGE_SIZE - 1);
-    
-    uintptr_t new_frame = (uintptr_t) buddy_alloc(PAGE_SIZE);
-
-    if (!new_frame) {
-        default_handler(frame, error_code);
-        return;
+    enum fault_region region = fault_region(faulting_address);
+
+    // Hooks see not-present faults before demand paging, so the guard
+    // regions they own are never backed
+    if (!(error_code & PF_PRESENT)) {
+        for (uint32_t i = 0; i < page_fault_hook_count; i++) {
+            if (page_fault_hooks[i](frame, faulting_address)) {
+                fault_stats.fatal[region]++;
+                return;
+            }
+        }
+    }
+
+    switch (vmm_handle_fault(faulting_address, error_code)) {
+        case FAULT_MINOR:
+            fault_stats.minor[region]++;
+            return;
+        case FAULT_MAJOR:
+            fault_stats.major[region]++;
+            return;
+        case FAULT_FATAL:
+            break;
+    }
+
+    fault_stats.fatal[region]++;
+    if (error_code & PF_PRESENT) {
+        kprintf(ERROR, "Page fault caused by protection violation!\n");
     }
-    
-    map_virtual_to_physical(virtual_address, new_frame, PAGE_PRESENT | PAGE_WRITABLE);
+    kprintf(ERROR, "Faulting Address: %p (%s)\n", faulting_address, fault_region_name(region));
+    default_handler(frame, error_code);
 }
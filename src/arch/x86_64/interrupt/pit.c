@@ -3,6 +3,7 @@
 #include "arch/x86_64/interrupt/idt.h"
 #include "arch/x86_64/io.h"
 #include "kernel/kprintf.h"
+#include "kernel/mm/pmm.h"
 
 #define PIT_FREQUENCY 1193182
 #define PIT_MIN_FREQ 18      // ~55ms period
@@ -45,6 +46,9 @@ void pit_sleep_ms(uint32_t milliseconds) {
 
     // Wait until we reach the target tick count
     while (pit_get_ticks() < target_ticks) {
+        // Use the wait to zero frames ahead of time and regroup free memory
+        refill_zero_pool();
+        compact_idle();
         // Enable interrupts while waiting
         asm volatile("sti");
         // Halt the CPU to save power
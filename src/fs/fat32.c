@@ -3,6 +3,9 @@
 #include "drivers/block.h"
 #include "string.h"
 #include "kernel/mm/kmalloc.h"
+#include "kernel/mm/vmalloc.h"
+#include "kernel/mm/filemap.h"
+#include "kernel/mm/swap.h"
 #include "kernel/kprintf.h"
 
 char toupper(char c) {
@@ -27,6 +30,17 @@ struct fat32_private {
 // Global filesystem data
 static struct fat32_private* fs_private = NULL;
 static struct vfs_node* fat32_root_node = NULL;
+static struct kmem_cache* fat32_file_cache = NULL;
+static uint32_t swap_cluster = 0;  // First cluster of the swap file, 0 if none
+
+static void fat32_file_ctor(void* obj) {
+    memset(obj, 0, sizeof(struct fat32_file));
+}
+
+// Zeroed file structure from the fat32_file cache
+static struct fat32_file* fat32_alloc_file(void) {
+    return kmem_cache_alloc(fat32_file_cache);
+}
 
 // Helper functions
 static uint32_t cluster_to_lba(struct fat32_private* priv, uint32_t cluster) {
@@ -123,6 +137,13 @@ bool fat32_init(struct block_device* dev) {
         return false;
     }
 
+    if (!fat32_file_cache) {
+        fat32_file_cache = kmem_cache_create("fat32_file", sizeof(struct fat32_file), fat32_file_ctor);
+        if (!fat32_file_cache) {
+            return false;
+        }
+    }
+
     // Allocate private data
     fs_private = kmalloc(sizeof(struct fat32_private));
     if (!fs_private) {
@@ -156,7 +177,7 @@ bool fat32_init(struct block_device* dev) {
 
     // Cache FAT
     fs_private->fat_cache_size = fs_private->boot_sector.sectors_per_fat_32 * fs_private->boot_sector.bytes_per_sector;
-    fs_private->fat_cache = kmalloc(fs_private->fat_cache_size);
+    fs_private->fat_cache = vmalloc_uninit(fs_private->fat_cache_size);
     if (!fs_private->fat_cache) {
         kfree(fs_private);
         return false;
@@ -166,7 +187,7 @@ bool fat32_init(struct block_device* dev) {
     for (uint32_t i = 0; i < fs_private->boot_sector.sectors_per_fat_32; i++) {
         if (!block_device_read(dev, fs_private->fat_start + i, 1, 
                              (uint8_t*)fs_private->fat_cache + (i * fs_private->boot_sector.bytes_per_sector))) {
-            kfree(fs_private->fat_cache);
+            vfree(fs_private->fat_cache);
             kfree(fs_private);
             return false;
         }
@@ -182,11 +203,10 @@ bool fat32_init(struct block_device* dev) {
     // Create persistent root node and impl
     if (fat32_root_node) {
         // Free previous root node if re-initializing
-        if (fat32_root_node->impl) kfree(fat32_root_node->impl);
-        kfree(fat32_root_node);
+        if (fat32_root_node->impl) fat32_close(fat32_root_node->impl);
+        vfs_free_node(fat32_root_node);
     }
-    fat32_root_node = kmalloc(sizeof(struct vfs_node));
-    memset(fat32_root_node, 0, sizeof(struct vfs_node));
+    fat32_root_node = vfs_alloc_node();
     strcpy(fat32_root_node->name, "/");
     fat32_root_node->flags = FS_DIRECTORY;
     fat32_root_node->open = fat32_vfs_open;
@@ -195,9 +215,10 @@ bool fat32_init(struct block_device* dev) {
     fat32_root_node->write = fat32_vfs_write;
     fat32_root_node->readdir = fat32_vfs_readdir;
     fat32_root_node->finddir = fat32_vfs_finddir;
+    fat32_root_node->mmap = fat32_vfs_mmap;
+    fat32_root_node->swap = fat32_vfs_swap;
     // Set up impl
-    struct fat32_file* root_file = kmalloc(sizeof(struct fat32_file));
-    memset(root_file, 0, sizeof(struct fat32_file));
+    struct fat32_file* root_file = fat32_alloc_file();
     root_file->dev = dev;
     root_file->first_cluster = fs_private->root_dir_cluster;
     root_file->current_cluster = root_file->first_cluster;
@@ -218,13 +239,12 @@ struct fat32_file* fat32_open(struct block_device* dev, const char* path) {
 
     // Special case for root directory
     if (strcmp(path, "/") == 0) {
-        struct fat32_file* root = kmalloc(sizeof(struct fat32_file));
+        struct fat32_file* root = fat32_alloc_file();
         if (!root) {
             kprintf(ERROR, "fat32_open: Failed to allocate root file\n");
             return NULL;
         }
         
-        memset(root, 0, sizeof(struct fat32_file));
         root->dev = dev;
         root->first_cluster = fs_private->root_dir_cluster;
         root->current_cluster = root->first_cluster;
@@ -236,13 +256,12 @@ struct fat32_file* fat32_open(struct block_device* dev, const char* path) {
     }
 
     // Start from root directory
-    struct fat32_file* current = kmalloc(sizeof(struct fat32_file));
+    struct fat32_file* current = fat32_alloc_file();
     if (!current) {
         kprintf(ERROR, "fat32_open: Failed to allocate current file\n");
         return NULL;
     }
     
-    memset(current, 0, sizeof(struct fat32_file));
     current->dev = dev;
     current->first_cluster = fs_private->root_dir_cluster;
     current->current_cluster = current->first_cluster;
@@ -258,7 +277,7 @@ struct fat32_file* fat32_open(struct block_device* dev, const char* path) {
     char* path_copy = strdup(path_ptr);
     if (!path_copy) {
         kprintf(ERROR, "fat32_open: Failed to allocate path copy\n");
-        kfree(current);
+        fat32_close(current);
         return NULL;
     }
     
@@ -331,7 +350,7 @@ struct fat32_file* fat32_open(struct block_device* dev, const char* path) {
         }
         
         // Create new file structure for the found entry
-        struct fat32_file* next = kmalloc(sizeof(struct fat32_file));
+        struct fat32_file* next = fat32_alloc_file();
         if (!next) {
             kprintf(ERROR, "fat32_open: Failed to allocate next file\n");
             fat32_close(current);
@@ -339,7 +358,6 @@ struct fat32_file* fat32_open(struct block_device* dev, const char* path) {
             return NULL;
         }
         
-        memset(next, 0, sizeof(struct fat32_file));
         next->dev = dev;
         next->first_cluster = entry.first_cluster_low | (entry.first_cluster_high << 16);
         next->current_cluster = next->first_cluster;
@@ -363,7 +381,7 @@ bool fat32_close(struct fat32_file* file) {
         return false;
     }
 
-    kfree(file);
+    kmem_cache_free(fat32_file_cache, file);
     return true;
 }
 
@@ -516,7 +534,7 @@ bool fat32_readdir(struct fat32_file* dir, struct fat32_dir_entry* entry) {
     }
     
     
-    uint8_t* cluster_buffer = kmalloc(fs_private->bytes_per_cluster);
+    uint8_t* cluster_buffer = kmalloc_uninit(fs_private->bytes_per_cluster);
     if (!cluster_buffer) {
         kprintf(ERROR, "fat32_readdir: Failed to allocate cluster buffer of size %d\n", 
                 fs_private->bytes_per_cluster);
@@ -580,13 +598,6 @@ bool fat32_readdir(struct fat32_file* dir, struct fat32_dir_entry* entry) {
         
         dir->current_cluster = next_cluster;
         dir->position = 0;  // Reset position for new cluster
-        
-        kfree(cluster_buffer);
-        cluster_buffer = kmalloc(fs_private->bytes_per_cluster);
-        if (!cluster_buffer) {
-            kprintf(ERROR, "fat32_readdir: Failed to allocate cluster buffer for next cluster\n");
-            return false;
-        }
     }
 }
 
@@ -684,14 +695,13 @@ bool fat32_mkdir(struct block_device* dev, const char* path) {
     }
     
     // Initialize directory with "." and ".." entries
-    uint8_t* cluster_buffer = kmalloc(fs_private->bytes_per_cluster);
+    uint8_t* cluster_buffer = kzalloc(fs_private->bytes_per_cluster);
     if (!cluster_buffer) {
         kprintf(ERROR, "fat32_mkdir: Failed to allocate cluster buffer\n");
         fat32_close(parent);
         kfree(path_copy);
         return false;
     }
-    memset(cluster_buffer, 0, fs_private->bytes_per_cluster);
     
     // Create "." entry
     struct fat32_dir_entry* dot_entry = (struct fat32_dir_entry*)cluster_buffer;
@@ -726,7 +736,7 @@ bool fat32_mkdir(struct block_device* dev, const char* path) {
     entry.first_cluster_high = (new_cluster >> 16) & 0xFFFF;
     
     // Write entry to parent directory
-    uint8_t* parent_sector = kmalloc(fs_private->bytes_per_cluster);
+    uint8_t* parent_sector = kmalloc_uninit(fs_private->bytes_per_cluster);
     if (!parent_sector) {
         kprintf(ERROR, "fat32_mkdir: Failed to allocate parent sector buffer\n");
         fat32_close(parent);
@@ -837,7 +847,7 @@ bool fat32_rmdir(struct block_device* dev, const char* path) {
     }
 
     // Read parent directory cluster
-    uint8_t* buffer = kmalloc(fs_private->bytes_per_cluster);
+    uint8_t* buffer = kmalloc_uninit(fs_private->bytes_per_cluster);
     if (!buffer) {
         fat32_close(dir);
         fat32_close(parent);
@@ -910,6 +920,11 @@ bool fat32_unlink(struct block_device* dev, const char* path) {
     if (!file || file->is_directory) {
         return false;
     }
+    if (swap_cluster && file->first_cluster == swap_cluster) {
+        kprintf(ERROR, "fat32_unlink: %s is in use as swap\n", path);
+        fat32_close(file);
+        return false;
+    }
     
     // Mark file entry as deleted
     uint8_t sector[512];
@@ -941,6 +956,8 @@ bool fat32_unlink(struct block_device* dev, const char* path) {
         return false;
     }
     
+    // Its clusters may go to another file
+    filemap_invalidate(file->first_cluster);
     fat32_close(file);
     return true;
 }
@@ -990,6 +1007,10 @@ uint32_t fat32_vfs_read(struct vfs_node* node, uint32_t offset, uint32_t size, u
 uint32_t fat32_vfs_write(struct vfs_node* node, uint32_t offset, uint32_t size, uint8_t* buffer) {
     struct fat32_file* file = node->impl;
     if (!file) return 0;
+    if (swap_cluster && file->first_cluster == swap_cluster) {
+        kprintf(ERROR, "fat32_vfs_write: %s is in use as swap\n", node->name);
+        return 0;
+    }
     
     if (offset != file->position) {
         if (!fat32_seek(file, offset)) {
@@ -997,7 +1018,178 @@ uint32_t fat32_vfs_write(struct vfs_node* node, uint32_t offset, uint32_t size,
         }
     }
     
-    return fat32_write(file, buffer, size);
+    uint32_t written = fat32_write(file, buffer, size);
+    if (written) {
+        filemap_invalidate(file->first_cluster);
+    }
+    return written;
+}
+
+// Page source for a mapped file. It keeps its own copy of the file's
+// location, as the node is usually closed long before the mapping goes.
+struct fat32_source {
+    struct file_source base;
+    uint32_t first_cluster;
+};
+
+// Runs in the page fault handler: the cluster chain comes from the cached
+// FAT and the sectors go straight into the page, so nothing is allocated
+static bool fat32_read_page(struct file_source* source, uint32_t index, void* buffer) {
+    struct fat32_source* file = (struct fat32_source*)source;
+    uint32_t cluster_size = fs_private->bytes_per_cluster;
+    uint32_t sector_size = fs_private->boot_sector.bytes_per_sector;
+    uint32_t fat_entries = fs_private->fat_cache_size / sizeof(uint32_t);
+    uint64_t offset = (uint64_t)index * PAGE_SIZE;
+    if (offset >= source->size) {
+        return false;
+    }
+
+    uint32_t cluster = file->first_cluster;
+    for (uint64_t skip = offset / cluster_size; skip > 0; skip--) {
+        cluster = cluster < fat_entries ? fs_private->fat_cache[cluster] & 0x0FFFFFFF : 0;
+        if (cluster < 2 || cluster >= 0x0FFFFFF8) {
+            return false;
+        }
+    }
+
+    uint8_t* page = buffer;
+    uint32_t done = 0;
+    uint32_t wanted = source->size - offset < PAGE_SIZE ? source->size - offset : PAGE_SIZE;
+    while (done < wanted) {
+        uint32_t within = (offset + done) % cluster_size;
+        uint32_t chunk = cluster_size - within < PAGE_SIZE - done ? cluster_size - within : PAGE_SIZE - done;
+        if (!block_device_read(fs_private->dev, cluster_to_lba(fs_private, cluster) + within / sector_size,
+                               chunk / sector_size, page + done)) {
+            return false;
+        }
+        done += chunk;
+        if (done < wanted) {
+            cluster = cluster < fat_entries ? fs_private->fat_cache[cluster] & 0x0FFFFFFF : 0;
+            if (cluster < 2 || cluster >= 0x0FFFFFF8) {
+                return false;
+            }
+        }
+    }
+
+    // The last sector read may run past the end of the file
+    memset(page + wanted, 0, PAGE_SIZE - wanted);
+    return true;
+}
+
+static void fat32_release_source(struct file_source* source) {
+    kfree(source);
+}
+
+struct file_source* fat32_vfs_mmap(struct vfs_node* node) {
+    struct fat32_file* file = node->impl;
+    if (!fs_private || !file || file->is_directory || file->first_cluster < 2 || file->size == 0) {
+        return NULL;
+    }
+
+    struct fat32_source* source = kmalloc(sizeof(struct fat32_source));
+    if (!source) {
+        return NULL;
+    }
+    source->base.id = file->first_cluster;
+    source->base.size = file->size;
+    source->base.read_page = fat32_read_page;
+    source->base.release = fat32_release_source;
+    source->first_cluster = file->first_cluster;
+    return &source->base;
+}
+
+// Swap area in a file. Only pages whose sectors are consecutive on disk
+// become slots. They are located once, here, so swapping goes straight to
+// the device without touching the FAT.
+struct fat32_swap {
+    struct swap_device base;
+    struct block_device* dev;
+    uint32_t sectors_per_page;
+    uint32_t* sectors;  // First sector of each slot
+};
+
+static bool fat32_swap_read(struct swap_device* device, uint32_t slot, void* buffer) {
+    struct fat32_swap* swap = (struct fat32_swap*)device;
+    return block_device_read(swap->dev, swap->sectors[slot], swap->sectors_per_page, buffer);
+}
+
+static bool fat32_swap_write(struct swap_device* device, uint32_t slot, const void* buffer) {
+    struct fat32_swap* swap = (struct fat32_swap*)device;
+    return block_device_write(swap->dev, swap->sectors[slot], swap->sectors_per_page, buffer);
+}
+
+static void fat32_swap_release(struct swap_device* device) {
+    struct fat32_swap* swap = (struct fat32_swap*)device;
+    swap_cluster = 0;
+    kfree(swap->sectors);
+    kfree(swap);
+}
+
+// Next cluster of a chain from the cached FAT, or 0 past its end
+static uint32_t cached_next_cluster(uint32_t cluster) {
+    uint32_t fat_entries = fs_private->fat_cache_size / sizeof(uint32_t);
+    uint32_t next = cluster < fat_entries ? fs_private->fat_cache[cluster] & 0x0FFFFFFF : 0;
+    return next >= 2 && next < 0x0FFFFFF8 ? next : 0;
+}
+
+struct swap_device* fat32_vfs_swap(struct vfs_node* node) {
+    struct fat32_file* file = node->impl;
+    uint32_t pages = file ? file->size / PAGE_SIZE : 0;
+    if (!fs_private || !file || file->is_directory || file->first_cluster < 2 || pages == 0) {
+        return NULL;
+    }
+    if (swap_cluster) {
+        kprintf(ERROR, "fat32_vfs_swap: Already swapping to a file\n");
+        return NULL;
+    }
+
+    struct fat32_swap* swap = kmalloc(sizeof(struct fat32_swap));
+    uint32_t* sectors = swap ? kmalloc(pages * sizeof(uint32_t)) : NULL;
+    if (!sectors) {
+        kfree(swap);
+        return NULL;
+    }
+
+    uint32_t cluster_size = fs_private->bytes_per_cluster;
+    uint32_t sector_size = fs_private->boot_sector.bytes_per_sector;
+    uint32_t cluster = file->first_cluster;
+    uint32_t slots = 0;
+    for (uint32_t page = 0; page < pages && cluster; page++) {
+        uint32_t within = (uint64_t)page * PAGE_SIZE % cluster_size;
+        uint32_t sector = cluster_to_lba(fs_private, cluster) + within / sector_size;
+
+        // Follow the chain to the cluster holding the page's last byte
+        bool consecutive = true;
+        for (uint32_t end = within + PAGE_SIZE; end > cluster_size && cluster; end -= cluster_size) {
+            uint32_t next = cached_next_cluster(cluster);
+            consecutive = consecutive && next == cluster + 1;
+            cluster = next;
+        }
+        if (consecutive && cluster) {
+            sectors[slots++] = sector;
+        }
+        if (cluster && (within + PAGE_SIZE) % cluster_size == 0) {
+            cluster = cached_next_cluster(cluster);
+        }
+    }
+    if (slots == 0) {
+        kfree(sectors);
+        kfree(swap);
+        return NULL;
+    }
+
+    swap->base.name = "FAT32 swap file";
+    swap->base.pages = slots;
+    swap->base.read_page = fat32_swap_read;
+    swap->base.write_page = fat32_swap_write;
+    swap->base.release = fat32_swap_release;
+    swap->dev = fs_private->dev;
+    swap->sectors_per_page = PAGE_SIZE / sector_size;
+    swap->sectors = sectors;
+
+    // Writes and unlinking would pull the clusters out from under swap
+    swap_cluster = file->first_cluster;
+    return &swap->base;
 }
 
 struct vfs_node* fat32_vfs_readdir(struct vfs_node* node, uint32_t index) {
@@ -1046,25 +1238,23 @@ struct vfs_node* fat32_vfs_readdir(struct vfs_node* node, uint32_t index) {
                 }
             }
             
-            struct vfs_node* result = kmalloc(sizeof(struct vfs_node));
+            struct vfs_node* result = vfs_alloc_node();
             if (!result) {
                 return NULL;
             }
             
-            memset(result, 0, sizeof(struct vfs_node));
             strncpy(result->name, entry_name, 127);
             result->name[127] = '\0';
             result->flags = (entry.attributes & 0x10) ? FS_DIRECTORY : FS_FILE;
             result->length = entry.file_size;
             
             // Create a new file structure for the entry
-            struct fat32_file* entry_file = kmalloc(sizeof(struct fat32_file));
+            struct fat32_file* entry_file = fat32_alloc_file();
             if (!entry_file) {
-                kfree(result);
+                vfs_free_node(result);
                 return NULL;
             }
             
-            memset(entry_file, 0, sizeof(struct fat32_file));
             entry_file->dev = file->dev;
             entry_file->first_cluster = entry.first_cluster_low | (entry.first_cluster_high << 16);
             entry_file->current_cluster = entry_file->first_cluster;
@@ -1099,24 +1289,22 @@ struct vfs_node* fat32_vfs_finddir(struct vfs_node* node, const char* name) {
     // Handle special directory entries
     if (strcmp(name, ".") == 0) {
         // Return current directory
-        struct vfs_node* result = kmalloc(sizeof(struct vfs_node));
+        struct vfs_node* result = vfs_alloc_node();
         if (!result) {
             kprintf(ERROR, "fat32_vfs_finddir: Failed to allocate node\n");
             return NULL;
         }
-        memset(result, 0, sizeof(struct vfs_node));
         strncpy(result->name, node->name, 127);
         result->name[127] = '\0';
         result->flags = node->flags;
         result->length = node->length;
         
         // Create a new file structure for the entry
-        struct fat32_file* entry_file = kmalloc(sizeof(struct fat32_file));
+        struct fat32_file* entry_file = fat32_alloc_file();
         if (!entry_file) {
-            kfree(result);
+            vfs_free_node(result);
             return NULL;
         }
-        memset(entry_file, 0, sizeof(struct fat32_file));
         entry_file->dev = file->dev;
         entry_file->first_cluster = file->first_cluster;
         entry_file->current_cluster = file->current_cluster;
@@ -1134,6 +1322,8 @@ struct vfs_node* fat32_vfs_finddir(struct vfs_node* node, const char* name) {
         result->write = fat32_vfs_write;
         result->readdir = fat32_vfs_readdir;
         result->finddir = fat32_vfs_finddir;
+        result->mmap = fat32_vfs_mmap;
+        result->swap = fat32_vfs_swap;
         
         return result;
     }
@@ -1149,13 +1339,11 @@ struct vfs_node* fat32_vfs_finddir(struct vfs_node* node, const char* name) {
         struct fat32_file* parent_file = node->parent->impl;
         if (!parent_file) {
             // If parent has no file structure, create one
-            parent_file = kmalloc(sizeof(struct fat32_file));
+            parent_file = fat32_alloc_file();
             if (!parent_file) {
                 kprintf(ERROR, "fat32_vfs_finddir: Failed to allocate parent file structure\n");
                 return NULL;
             }
-            memset(parent_file, 0, sizeof(struct fat32_file));
-            
             // Read the ".." entry to get parent's cluster
             struct fat32_dir_entry dotdot;
             bool found = false;
@@ -1173,7 +1361,7 @@ struct vfs_node* fat32_vfs_finddir(struct vfs_node* node, const char* name) {
             
             if (!found) {
                 kprintf(ERROR, "fat32_vfs_finddir: Could not find .. entry\n");
-                kfree(parent_file);
+                fat32_close(parent_file);
                 return NULL;
             }
             
@@ -1197,24 +1385,22 @@ struct vfs_node* fat32_vfs_finddir(struct vfs_node* node, const char* name) {
             node->parent->flags = FS_DIRECTORY;  // Ensure parent is marked as directory
         }
         
-        struct vfs_node* result = kmalloc(sizeof(struct vfs_node));
+        struct vfs_node* result = vfs_alloc_node();
         if (!result) {
             kprintf(ERROR, "fat32_vfs_finddir: Failed to allocate node\n");
             return NULL;
         }
-        memset(result, 0, sizeof(struct vfs_node));
         strncpy(result->name, node->parent->name, 127);
         result->name[127] = '\0';
         result->flags = FS_DIRECTORY;  // Ensure result is marked as directory
         result->length = node->parent->length;
         
         // Create a new file structure for the entry
-        struct fat32_file* entry_file = kmalloc(sizeof(struct fat32_file));
+        struct fat32_file* entry_file = fat32_alloc_file();
         if (!entry_file) {
-            kfree(result);
+            vfs_free_node(result);
             return NULL;
         }
-        memset(entry_file, 0, sizeof(struct fat32_file));
         entry_file->dev = parent_file->dev;
         entry_file->first_cluster = parent_file->first_cluster;
         entry_file->current_cluster = parent_file->first_cluster;  // Reset to first cluster
@@ -1232,6 +1418,8 @@ struct vfs_node* fat32_vfs_finddir(struct vfs_node* node, const char* name) {
         result->write = fat32_vfs_write;
         result->readdir = fat32_vfs_readdir;
         result->finddir = fat32_vfs_finddir;
+        result->mmap = fat32_vfs_mmap;
+        result->swap = fat32_vfs_swap;
         
         return result;
     }
@@ -1272,26 +1460,24 @@ struct vfs_node* fat32_vfs_finddir(struct vfs_node* node, const char* name) {
                 }
             }
             
-            struct vfs_node* result = kmalloc(sizeof(struct vfs_node));
+            struct vfs_node* result = vfs_alloc_node();
             if (!result) {
                 kprintf(ERROR, "fat32_vfs_finddir: Failed to allocate node\n");
                 return NULL;
             }
             
-            memset(result, 0, sizeof(struct vfs_node));
             strncpy(result->name, entry_name, 127);
             result->name[127] = '\0';
             result->flags = (entry.attributes & 0x10) ? FS_DIRECTORY : FS_FILE;
             result->length = entry.file_size;
             
             // Create a new file structure for the entry
-            struct fat32_file* entry_file = kmalloc(sizeof(struct fat32_file));
+            struct fat32_file* entry_file = fat32_alloc_file();
             if (!entry_file) {
-                kfree(result);
+                vfs_free_node(result);
                 return NULL;
             }
             
-            memset(entry_file, 0, sizeof(struct fat32_file));
             entry_file->dev = file->dev;
             entry_file->first_cluster = entry.first_cluster_low | (entry.first_cluster_high << 16);
             entry_file->current_cluster = entry_file->first_cluster;
@@ -1309,6 +1495,8 @@ struct vfs_node* fat32_vfs_finddir(struct vfs_node* node, const char* name) {
             result->write = fat32_vfs_write;
             result->readdir = fat32_vfs_readdir;
             result->finddir = fat32_vfs_finddir;
+            result->mmap = fat32_vfs_mmap;
+            result->swap = fat32_vfs_swap;
             
             return result;
         }
@@ -1328,10 +1516,9 @@ struct vfs_node* fat32_get_root(void) {
 
 // Create a new node
 struct vfs_node* fat32_create_node(const char* name, uint32_t flags) {
-    struct vfs_node* node = kmalloc(sizeof(struct vfs_node));
+    struct vfs_node* node = vfs_alloc_node();
     if (!node) return NULL;
     
-    memset(node, 0, sizeof(struct vfs_node));
     strncpy(node->name, name, 127);
     node->name[127] = '\0';
     node->flags = flags;
@@ -1343,6 +1530,8 @@ struct vfs_node* fat32_create_node(const char* name, uint32_t flags) {
     node->write = fat32_vfs_write;
     node->readdir = fat32_vfs_readdir;
     node->finddir = fat32_vfs_finddir;
+    node->mmap = fat32_vfs_mmap;
+    node->swap = fat32_vfs_swap;
     
     return node;
 }
@@ -1378,7 +1567,7 @@ bool fat32_unmount(void) {
     }
     
     // Free FAT cache
-    kfree(fs_private->fat_cache);
+    vfree(fs_private->fat_cache);
     
     // Free private data
     kfree(fs_private);
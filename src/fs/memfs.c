@@ -31,18 +31,17 @@ static uint32_t memfs_write(struct vfs_node* node, uint32_t offset, uint32_t siz
     // Resize if needed
     if (offset + size > mem_node->capacity) {
         uint32_t new_capacity = (offset + size + 4095) & ~4095; // Align to 4KB
-        uint8_t* new_data = kmalloc(new_capacity);
+        uint8_t* new_data = krealloc(mem_node->data, new_capacity);
         if (!new_data) return 0;
         
-        if (mem_node->data) {
-            memcpy(new_data, mem_node->data, node->length);
-            kfree(mem_node->data);
-        }
-        
         mem_node->data = new_data;
         mem_node->capacity = new_capacity;
     }
     
+    // Writing past the end leaves a hole that must read back as zeroes
+    if (offset > node->length) {
+        memset(mem_node->data + node->length, 0, offset - node->length);
+    }
     memcpy(mem_node->data + offset, buffer, size);
     if (offset + size > node->length) {
         node->length = offset + size;
@@ -83,16 +82,15 @@ static struct vfs_node* memfs_finddir(struct vfs_node* node, const char* name) {
 
 // Create a new memory filesystem node
 struct vfs_node* memfs_create_node(const char* name, uint32_t flags) {
-    struct vfs_node* node = kmalloc(sizeof(struct vfs_node));
+    struct vfs_node* node = vfs_alloc_node();
     struct memfs_node* mem_node = kmalloc(sizeof(struct memfs_node));
     
     if (!node || !mem_node) {
-        if (node) kfree(node);
+        if (node) vfs_free_node(node);
         if (mem_node) kfree(mem_node);
         return NULL;
     }
     
-    memset(node, 0, sizeof(struct vfs_node));
     memset(mem_node, 0, sizeof(struct memfs_node));
     
     strncpy(node->name, name, sizeof(node->name) - 1);
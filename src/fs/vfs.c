@@ -4,6 +4,8 @@
 #include "drivers/ata_block.h"
 #include "fs/fat32.h"
 #include "kernel/mm/kmalloc.h"
+#include "kernel/mm/filemap.h"
+#include "kernel/mm/swap.h"
 #include "kernel/sync.h"
 #include "kernel/kprintf.h"
 #include "string.h"
@@ -14,10 +16,33 @@ static struct vfs_node* current_dir = NULL;
 // VFS mutex for protecting operations
 static mutex_t vfs_mutex;
 
+// Every vfs_node comes from this cache
+static struct kmem_cache* vfs_node_cache = NULL;
+
+static void vfs_node_ctor(void* obj) {
+    memset(obj, 0, sizeof(struct vfs_node));
+}
+
+// Allocate a zeroed node
+struct vfs_node* vfs_alloc_node(void) {
+    return kmem_cache_alloc(vfs_node_cache);
+}
+
+// Free a node without touching its implementation data
+void vfs_free_node(struct vfs_node* node) {
+    kmem_cache_free(vfs_node_cache, node);
+}
+
 // Initialize VFS
 void vfs_init(void) {
     // Initialize mutex
     mutex_init(&vfs_mutex, "vfs_mutex");
+
+    vfs_node_cache = kmem_cache_create("vfs_node", sizeof(struct vfs_node), vfs_node_ctor);
+    if (!vfs_node_cache) {
+        kprintf(ERROR, "Failed to create vfs_node cache\n");
+        return;
+    }
     
     // Initialize ATA driver and block devices
     ata_init();
@@ -60,6 +85,8 @@ void vfs_init(void) {
     current_dir->write = fat32_vfs_write;
     current_dir->readdir = fat32_vfs_readdir;
     current_dir->finddir = fat32_vfs_finddir;
+    current_dir->mmap = fat32_vfs_mmap;
+    current_dir->swap = fat32_vfs_swap;
     
     kprintf(INFO, "FAT32 filesystem mounted successfully\n");
     // Defensive: Check current_dir and impl
@@ -83,13 +110,12 @@ struct vfs_node* vfs_create_node(const char* name, uint32_t flags) {
     }
     
     // Create the node
-    struct vfs_node *node = kmalloc(sizeof(struct vfs_node));
+    struct vfs_node *node = vfs_alloc_node();
     if (!node) {
         kprintf(ERROR, "vfs_create_node: Failed to allocate node\n");
         return NULL;
     }
     
-    memset(node, 0, sizeof(struct vfs_node));
     strncpy(node->name, name, 127);
     node->name[127] = '\0';
     node->flags = flags;
@@ -101,6 +127,8 @@ struct vfs_node* vfs_create_node(const char* name, uint32_t flags) {
     node->write = fat32_vfs_write;
     node->readdir = fat32_vfs_readdir;
     node->finddir = fat32_vfs_finddir;
+    node->mmap = fat32_vfs_mmap;
+    node->swap = fat32_vfs_swap;
     
     // Only hold mutex for the actual linking operation
     mutex_acquire(&vfs_mutex);
@@ -122,12 +150,12 @@ void vfs_destroy_node(struct vfs_node* node) {
         if (fat32_node->data) {
             kfree(fat32_node->data);
         }
-        kfree(fat32_node);
+        fat32_close(fat32_node);
     }
     
     // Only hold mutex for the actual node removal
     mutex_acquire(&vfs_mutex);
-    kfree(node);
+    vfs_free_node(node);
     mutex_release(&vfs_mutex);
 }
 
@@ -229,6 +257,32 @@ uint32_t vfs_write(struct vfs_node* node, uint32_t offset, uint32_t size, uint8_
     return result;
 }
 
+// Map part of a file through the page cache
+void* vfs_mmap(struct vfs_node* node, uint32_t offset, uint32_t size) {
+    if (!node || !node->mmap || (offset & (PAGE_SIZE - 1)) || size == 0) return NULL;
+    
+    struct file_source* source = node->mmap(node);
+    if (!source) return NULL;
+    
+    size_t pages = ((uint64_t)size + PAGE_SIZE - 1) / PAGE_SIZE;
+    return filemap_map(source, offset / PAGE_SIZE, pages);
+}
+
+void vfs_munmap(void* addr) {
+    filemap_unmap(addr);
+}
+
+bool vfs_mmap_populate(void* addr, uint32_t size) {
+    return filemap_populate(addr, size);
+}
+
+bool vfs_swapon(struct vfs_node* node) {
+    if (!node || !node->swap) return false;
+
+    struct swap_device* device = node->swap(node);
+    return device && swapon(device);
+}
+
 // Read directory entry
 struct vfs_node* vfs_readdir(struct vfs_node* node, uint32_t index) {
     if (!node || !(node->flags & FS_DIRECTORY)) {
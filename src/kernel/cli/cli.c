@@ -5,6 +5,11 @@
 #include "drivers/vga.h"
 #include "kernel/mm/pmm.h"
 #include "kernel/mm/vmm.h"
+#include "kernel/mm/vmalloc.h"
+#include "kernel/mm/shrinker.h"
+#include "kernel/mm/filemap.h"
+#include "kernel/mm/swap.h"
+#include "arch/x86_64/interrupt/isr.h"
 #include "arch/x86_64/interrupt/pit.h"
 #include "multiboot2/multiboot2_parser.h"
 #include "drivers/rtc.h"
@@ -29,6 +34,10 @@ static void cmd_help(const char* args);
 static void cmd_clear(const char* args);
 static void cmd_echo(const char* args);
 static void cmd_meminfo(const char* args);
+static void cmd_heapprof(const char* args);
+static void cmd_slabinfo(const char* args);
+static void cmd_faults(const char* args);
+static void cmd_compact(const char* args);
 static void cmd_sysinfo(const char* args);
 static void cmd_time(const char* args);
 static void cmd_uptime(const char* args);
@@ -38,6 +47,7 @@ static void cmd_mkdir(const char* args);
 static void cmd_rmdir(const char* args);
 // static void cmd_touch(const char* args);
 static void cmd_cat(const char* args);
+static void cmd_swapon(const char* args);
 static void cmd_shutdown(const char* args);
 static void cmd_wasmrun(const char* args);
 static void cmd_wasmtest(const char* args);
@@ -48,6 +58,10 @@ static const struct Command commands[] = {
     {"clear", cmd_clear, "Clear the screen"},
     {"echo", cmd_echo, "Print arguments"},
     {"meminfo", cmd_meminfo, "Show memory information"},
+    {"heapprof", cmd_heapprof, "Show kmalloc usage per call site [live|allocs|bytes]"},
+    {"slabinfo", cmd_slabinfo, "Show slab cache usage"},
+    {"faults", cmd_faults, "Show page fault counts per address region"},
+    {"compact", cmd_compact, "Rebuild free 2 MB blocks by moving pages"},
     {"sysinfo", cmd_sysinfo, "Show system information"},
     {"time", cmd_time, "Show current system time"},
     {"uptime", cmd_uptime, "Show system uptime"},
@@ -57,6 +71,7 @@ static const struct Command commands[] = {
     {"rmdir", cmd_rmdir, "Remove directory"},
     /*{"touch", cmd_touch, "Create empty file"}, */ // removing touch temporarily cause it doesn't work
     {"cat", cmd_cat, "Display file contents"},
+    {"swapon", cmd_swapon, "Swap out cold private pages to a file"},
     {"shutdown", cmd_shutdown, "Shutdown the system"},
     {"wasmrun", cmd_wasmrun, "Run a WebAssembly file"},
     {"wasmtest", cmd_wasmtest, "Run WebAssembly tests"},
@@ -102,6 +117,171 @@ static void cmd_meminfo(const char* args) {
     kprintf(CLI, "  Total RAM: %d KB\n", total_ram);
     kprintf(CLI, "  Used RAM:  %d KB\n", total_used);
     kprintf(CLI, "  Free RAM:  %d KB\n", free_ram);
+
+    struct pcp_stats pcp;
+    get_pcp_stats(&pcp);
+    uint64_t lookups = pcp.hits + pcp.misses;
+    kprintf(CLI, "Per-CPU page cache:\n");
+    kprintf(CLI, "  Cached:    %d pages\n", pcp.count);
+    kprintf(CLI, "  Hits:      %d (%d%%)\n", pcp.hits, lookups ? pcp.hits * 100 / lookups : 0);
+    kprintf(CLI, "  Misses:    %d\n", pcp.misses);
+    kprintf(CLI, "  Refills:   %d, drains: %d\n", pcp.refills, pcp.drains);
+
+    struct zero_pool_stats zero;
+    get_zero_pool_stats(&zero);
+    kprintf(CLI, "Pre-zeroed pool:\n");
+    kprintf(CLI, "  Ready:     %d pages\n", zero.count);
+    kprintf(CLI, "  Hits:      %d, misses: %d\n", zero.hits, zero.misses);
+    kprintf(CLI, "  Zeroed:    %d pages in the background\n", zero.zeroed);
+    kprintf(CLI, "  Reserve:   %d pages for page faults, empty %d times\n", zero.reserve, zero.reserve_empty);
+
+    struct kmalloc_stats heap;
+    kmalloc_get_stats(&heap);
+    kprintf(CLI, "Kernel heap:\n");
+    kprintf(CLI, "  Slabs:     %d (%d pages), %d blocks in use\n", heap.slabs, heap.slab_pages, heap.active);
+    kprintf(CLI, "  Large:     %d pages\n", heap.large_pages);
+
+    struct vmalloc_stats vm;
+    vmalloc_get_stats(&vm);
+    kprintf(CLI, "Vmalloc:\n");
+    kprintf(CLI, "  Areas:     %d (%d pages)\n", vm.areas, vm.pages);
+    kprintf(CLI, "  Holes:     %d, largest %d pages\n", vm.free_ranges, vm.largest_free);
+    struct vmm_stats vmm;
+    vmm_get_stats(&vmm);
+    kprintf(CLI, "Page tables: %d pages, %d large mappings, %d splits\n",
+            vmm.page_tables, vmm.huge_mappings, vmm.splits);
+    kprintf(CLI, "Direct map: %d MB in %d 1 GB and %d 2 MB pages\n",
+            vmm.direct_map >> 20, vmm.direct_gb_pages, vmm.direct_2mb_pages);
+    kprintf(CLI, "TLB flushes: %d pages, %d full, %d avoided\n",
+            vmm.tlb_page_flushes, vmm.tlb_full_flushes, vmm.tlb_flushes_avoided);
+    kprintf(CLI, "Address spaces: %d, %d switches, %d flushed the TLB\n",
+            vmm.address_spaces, vmm.space_switches, vmm.switch_flushes);
+    kprintf(CLI, "Copy-on-write: %d faults, %d frames copied\n", vmm.cow_faults, vmm.cow_copies);
+
+    struct page_cache_stats cache;
+    get_page_cache_stats(&cache);
+    kprintf(CLI, "File page cache:\n");
+    kprintf(CLI, "  Cached:    %d pages, %d file mappings\n", cache.pages, cache.mappings);
+    kprintf(CLI, "  Hits:      %d, misses: %d, evicted: %d\n", cache.hits, cache.misses, cache.evicted);
+
+    struct compact_stats compact;
+    get_compact_stats(&compact);
+    kprintf(CLI, "Compaction: %d runs, %d blocks rebuilt, %d frames moved, %d blocks given up, %d idle passes deferred\n",
+            compact.runs, compact.blocks, compact.migrated, compact.failed, compact.deferred);
+
+    struct swap_stats swap;
+    get_swap_stats(&swap);
+    kprintf(CLI, "Swap: %d of %d KB used, %d pages out, %d in, %d errors\n",
+            swap.used * PAGE_SIZE / 1024, swap.slots * PAGE_SIZE / 1024,
+            swap.swapped_out, swap.swapped_in, swap.errors);
+
+    kprintf(CLI, "Shrinkers:\n");
+    for (const struct shrinker* shrinker = shrinker_first(); shrinker; shrinker = shrinker->next) {
+        kprintf(CLI, "  %s: %d reclaimable, %d runs, %d pages freed\n",
+                shrinker->name, shrinker->count(), shrinker->invocations, shrinker->pages_freed);
+    }
+}
+
+#define COMPACT_BLOCKS 8
+
+static void cmd_compact(const char* args) {
+    (void)args;
+    struct compact_stats before, after;
+    get_compact_stats(&before);
+    size_t rebuilt = compact_memory(COMPACT_BLOCKS);
+    get_compact_stats(&after);
+    kprintf(CLI, "Rebuilt %d free 2 MB blocks, moved %d frames\n",
+            rebuilt, after.migrated - before.migrated);
+}
+
+#define HEAPPROF_MAX_SITES 256
+#define HEAPPROF_ROWS 20
+
+static uint64_t heapprof_key(const struct kmalloc_site* site, char sort) {
+    switch (sort) {
+        case 'a': return site->allocs;
+        case 'b': return site->bytes;
+        default:  return site->live_bytes;
+    }
+}
+
+static void cmd_heapprof(const char* args) {
+    char sort = 'l';
+    if (args && *args) {
+        if (strcmp(args, "live") && strcmp(args, "allocs") && strcmp(args, "bytes")) {
+            kprintf(ERROR, "Usage: heapprof [live|allocs|bytes]\n");
+            return;
+        }
+        sort = args[0];
+    }
+
+    struct kmalloc_site* sites = kmalloc_uninit(sizeof(struct kmalloc_site) * HEAPPROF_MAX_SITES);
+    if (!sites) {
+        kprintf(ERROR, "heapprof: out of memory\n");
+        return;
+    }
+
+    size_t count = kmalloc_get_sites(sites, HEAPPROF_MAX_SITES);
+    if (count == 0) {
+        kprintf(CLI, "No allocation sites recorded (kernel built without KMALLOC_PROFILE?)\n");
+        kfree(sites);
+        return;
+    }
+
+    // Insertion sort, largest first
+    for (size_t i = 1; i < count; i++) {
+        struct kmalloc_site site = sites[i];
+        size_t j = i;
+        while (j > 0 && heapprof_key(&sites[j - 1], sort) < heapprof_key(&site, sort)) {
+            sites[j] = sites[j - 1];
+            j--;
+        }
+        sites[j] = site;
+    }
+
+    kprintf(CLI, "Call site  Allocs  Live  Live KB  Total KB\n");
+    for (size_t i = 0; i < count && i < HEAPPROF_ROWS; i++) {
+        kprintf(CLI, "%p  %d  %d  %d  %d\n",
+                (void*)sites[i].caller, sites[i].allocs, sites[i].allocs - sites[i].frees,
+                sites[i].live_bytes / 1024, sites[i].bytes / 1024);
+    }
+    if (count > HEAPPROF_ROWS) {
+        kprintf(CLI, "... %d more sites\n", count - HEAPPROF_ROWS);
+    }
+
+    kfree(sites);
+}
+
+#define SLABINFO_MAX_CACHES 64
+
+static void cmd_faults(const char* args) {
+    (void)args;
+    struct fault_stats stats;
+    get_fault_stats(&stats);
+
+    kprintf(CLI, "Region  Minor  Major  Fatal\n");
+    for (int region = 0; region < FAULT_REGIONS; region++) {
+        kprintf(CLI, "%s  %d  %d  %d\n", fault_region_name(region),
+                stats.minor[region], stats.major[region], stats.fatal[region]);
+    }
+}
+
+static void cmd_slabinfo(const char* args) {
+    (void)args;
+    struct kmem_cache_stats* stats = kmalloc_uninit(sizeof(struct kmem_cache_stats) * SLABINFO_MAX_CACHES);
+    if (!stats) {
+        kprintf(ERROR, "slabinfo: out of memory\n");
+        return;
+    }
+
+    size_t count = kmem_cache_get_stats(stats, SLABINFO_MAX_CACHES);
+    kprintf(CLI, "Cache  Object size  Active  Allocs  Slabs (pages)\n");
+    for (size_t i = 0; i < count; i++) {
+        kprintf(CLI, "%s  %u  %d  %d  %d (%d)\n", stats[i].name, stats[i].object_size,
+                stats[i].active, stats[i].allocs, stats[i].slabs, stats[i].slab_pages);
+    }
+
+    kfree(stats);
 }
 
 static void cmd_sysinfo(const char* args) {
@@ -275,6 +455,8 @@ static void cmd_touch(const char* args) {
 }
 */
 
+#define CAT_MAP_CHUNK (256 * 1024)  // Page-aligned
+
 static void cmd_cat(const char* args) {
     if (!args || !*args) {
         kprintf(ERROR, "Usage: cat <file>\n");
@@ -287,9 +469,27 @@ static void cmd_cat(const char* args) {
         return;
     }
     
+    // Print straight out of the page cache, a chunk at a time so a large
+    // file never has more than CAT_MAP_CHUNK mapped
+    uint32_t length = file->length;
+    uint32_t offset = 0;
+    while (offset < length) {
+        uint32_t chunk = length - offset < CAT_MAP_CHUNK ? length - offset : CAT_MAP_CHUNK;
+        const char* data = vfs_mmap(file, offset, chunk);
+        if (!data || !vfs_mmap_populate((void*)data, chunk)) {
+            vfs_munmap((void*)data);
+            break;
+        }
+        for (uint32_t i = 0; i < chunk; i++) {
+            kprintf(CLI, "%c", data[i]);
+        }
+        vfs_munmap((void*)data);
+        offset += chunk;
+    }
+    
+    // Read whatever could not be mapped
     uint8_t buffer[512];
     uint32_t bytes_read;
-    uint32_t offset = 0;
     
     while ((bytes_read = vfs_read(file, offset, sizeof(buffer), buffer)) > 0) {
         for (uint32_t i = 0; i < bytes_read; i++) {
@@ -301,6 +501,23 @@ static void cmd_cat(const char* args) {
     vfs_close(file);
 }
 
+static void cmd_swapon(const char* args) {
+    if (!args || !*args) {
+        kprintf(ERROR, "Usage: swapon <file>\n");
+        return;
+    }
+
+    struct vfs_node* file = vfs_open(args, 0);
+    if (!file) {
+        kprintf(ERROR, "Failed to open file %s\n", args);
+        return;
+    }
+    if (!vfs_swapon(file)) {
+        kprintf(ERROR, "Cannot swap to %s\n", args);
+    }
+    vfs_close(file);
+}
+
 static void cmd_shutdown(const char* args) {
     (void)args;
     kprintf(INFO, "Shutting down system...\n");
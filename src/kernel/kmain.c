@@ -7,6 +7,9 @@
 #include "multiboot2/multiboot2_parser.h"
 #include "kernel/mm/pmm.h"
 #include "kernel/mm/vmm.h"
+#include "kernel/mm/vmalloc.h"
+#include "kernel/mm/filemap.h"
+#include "kernel/mm/swap.h"
 #include "arch/x86_64/interrupt/pit.h"
 #include "kernel/mm/kmalloc.h"
 #include "kernel/cli/cli.h"
@@ -36,11 +39,19 @@ void kmain() {
     rtc_init();
 
     // Initialize memory management
-    buddy_init((uintptr_t) &KERNEL_END, get_total_ram());
+    swap_init();
+    buddy_init((uintptr_t) &KERNEL_END);
     test_buddy_allocator();  // Run buddy allocator tests
 
     kmalloc_init();
+    vmm_init();
+    vmalloc_init();
+    filemap_init();
     heap_test();
+    vmalloc_test();
+    address_space_test();
+    filemap_test();
+    compaction_test();
     
     // Initialize filesystem
     vfs_init();
@@ -48,6 +59,14 @@ void kmain() {
     // Run ATA tests
     kprintf(INFO, "\nRunning ATA driver tests...\n");
     run_ata_tests();
+
+    // Swap to the disk image's swap file, if it has one
+    struct vfs_node* swapfile = vfs_open("/swapfile", FS_READ);
+    if (swapfile) {
+        vfs_swapon(swapfile);
+        vfs_close(swapfile);
+    }
+    swap_test();
     
     kprintf(INFO, "Welcome to ZenOS\n");
 
@@ -60,6 +79,8 @@ void kmain() {
     // Main kernel loop
     while (1) {
         // Kernel idle loop
+        refill_zero_pool();
+        compact_idle();
         asm("hlt");
     }
 }
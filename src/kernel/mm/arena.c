@@ -0,0 +1,117 @@
+#include <kernel/mm/arena.h>
+#include <kernel/mm/kmalloc.h>
+#include <kernel/kprintf.h>
+#include <string.h>
+
+/*
+Region allocator for data whose lifetime ends in one place, like a parsed
+WASM module. Allocation bumps a pointer inside the newest chunk; nothing
+is freed individually, and arena_release hands every chunk back to kmalloc
+in one pass.
+
+Chunks double in size up to ARENA_MAX_CHUNK. A request bigger than half a
+chunk gets a chunk of its own, linked behind the current one so the space
+left in the current chunk is not thrown away.
+*/
+
+#define ARENA_ALIGN 16
+#define ARENA_MIN_CHUNK 512
+#define ARENA_MAX_CHUNK (64 * 1024)
+
+#define ALIGN_UP(x, align) (((x) + (align) - 1) & ~((align) - 1))
+
+struct arena_chunk {
+    struct arena_chunk* next;
+    size_t size;  // Payload bytes after the header
+    size_t used;
+} __attribute__((aligned(ARENA_ALIGN)));
+
+void arena_init(arena_t* arena, size_t size_hint) {
+    size_t chunk_size = ALIGN_UP(size_hint, ARENA_ALIGN);
+    if (chunk_size < ARENA_MIN_CHUNK) chunk_size = ARENA_MIN_CHUNK;
+    if (chunk_size > ARENA_MAX_CHUNK) chunk_size = ARENA_MAX_CHUNK;
+
+    arena->chunks = NULL;
+    arena->chunk_size = chunk_size;
+    arena->allocated = 0;
+}
+
+static struct arena_chunk* arena_new_chunk(size_t size) {
+    struct arena_chunk* chunk = kmalloc_uninit(sizeof(struct arena_chunk) + size);
+    if (!chunk) {
+        kprintf(ERROR, "[ARENA] Failed to allocate a %d byte chunk\n", size);
+        return NULL;
+    }
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+    return chunk;
+}
+
+void* arena_alloc(arena_t* arena, size_t size) {
+    if (!arena || size == 0) {
+        return NULL;
+    }
+    size = ALIGN_UP(size, ARENA_ALIGN);
+
+    struct arena_chunk* chunk = arena->chunks;
+    if (!chunk || chunk->size - chunk->used < size) {
+        if (size > arena->chunk_size / 2) {
+            // Oversized: give it a dedicated chunk behind the current one
+            struct arena_chunk* big = arena_new_chunk(size);
+            if (!big) return NULL;
+            if (chunk) {
+                big->next = chunk->next;
+                chunk->next = big;
+            } else {
+                arena->chunks = big;
+            }
+            big->used = size;
+            arena->allocated += size;
+            return big + 1;
+        }
+
+        chunk = arena_new_chunk(arena->chunk_size);
+        if (!chunk) return NULL;
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+        if (arena->chunk_size < ARENA_MAX_CHUNK) {
+            arena->chunk_size *= 2;
+        }
+    }
+
+    void* ptr = (uint8_t*)(chunk + 1) + chunk->used;
+    chunk->used += size;
+    arena->allocated += size;
+    return ptr;
+}
+
+void* arena_zalloc(arena_t* arena, size_t size) {
+    void* ptr = arena_alloc(arena, size);
+    if (ptr) {
+        memset(ptr, 0, size);
+    }
+    return ptr;
+}
+
+char* arena_strndup(arena_t* arena, const void* src, size_t len) {
+    char* str = arena_alloc(arena, len + 1);
+    if (str) {
+        memcpy(str, src, len);
+        str[len] = '\0';
+    }
+    return str;
+}
+
+void arena_release(arena_t* arena) {
+    if (!arena) return;
+
+    struct arena_chunk* chunk = arena->chunks;
+    while (chunk) {
+        struct arena_chunk* next = chunk->next;
+        kfree(chunk);
+        chunk = next;
+    }
+    arena->chunks = NULL;
+    arena->allocated = 0;
+}
@@ -0,0 +1,449 @@
+#include "kernel/mm/filemap.h"
+#include "kernel/mm/kmalloc.h"
+#include "kernel/mm/vmalloc.h"
+#include "kernel/mm/vmm.h"
+#include "kernel/mm/shrinker.h"
+#include "kernel/sync.h"
+#include "kernel/kprintf.h"
+#include "string.h"
+
+/*
+Read-only file mappings and the page cache behind them.
+
+filemap_map only takes a hole in the vmalloc window and records it. The
+first touch of each page faults into filemap_fault, which finds the page
+in the cache or has the file's source read it into a frame from the fault
+reserve. That runs in the page fault handler with interrupts off, so the
+mapping list and the cache are guarded by irq_save rather than a mutex.
+The reserve only holds a few hundred frames, so callers about to read a
+large range fill it in first with filemap_populate, which allocates the
+frames outside the fault handler where reclaim can run.
+
+Cached frames are tagged PG_CACHE and hashed by file id and page index,
+kept in page->private and page->freelist. The cache holds one reference
+to each frame and every mapping another (get_page), so a frame nobody maps
+is exactly one without PG_SHARED. The shrinker only evicts those.
+filemap_invalidate unhashes mapped frames too and drops the cache's
+reference, leaving them to be freed with their last mapping.
+*/
+
+#define CACHE_SHIFT 8
+#define CACHE_BUCKETS (1u << CACHE_SHIFT)
+
+// A range of the vmalloc window showing part of a file
+struct file_mapping {
+    uintptr_t start;
+    size_t count;     // Pages
+    uint32_t first;   // File page mapped at start
+    struct file_source* source;
+    struct file_mapping* next;
+};
+
+static struct page* buckets[CACHE_BUCKETS];  // Chained through page->next
+static struct file_mapping* mappings = NULL;
+static struct kmem_cache* mapping_cache = NULL;
+static struct page_cache_stats cache_stats;
+static struct shrinker page_cache_shrinker;
+
+static inline size_t bucket_of(uint64_t id, uint32_t index) {
+    return ((id ^ ((uint64_t)index << 32 | index)) * 0x9E3779B97F4A7C15ull) >> (64 - CACHE_SHIFT);
+}
+
+static inline uint64_t page_file(struct page* page) {
+    return (uint64_t)(uintptr_t)page->private;
+}
+
+static inline uint32_t page_index(struct page* page) {
+    return (uint32_t)(uintptr_t)page->freelist;
+}
+
+// Interrupts must be off for the lookups below
+static struct page* cache_find(uint64_t id, uint32_t index) {
+    for (struct page* page = buckets[bucket_of(id, index)]; page; page = page->next) {
+        if (page_file(page) == id && page_index(page) == index) {
+            return page;
+        }
+    }
+    return NULL;
+}
+
+static void cache_insert(struct page* page, uint64_t id, uint32_t index) {
+    size_t bucket = bucket_of(id, index);
+    page->flags |= PG_CACHE;
+    page->private = (void*)(uintptr_t)id;
+    page->freelist = (void*)(uintptr_t)index;
+    page->next = buckets[bucket];
+    buckets[bucket] = page;
+    cache_stats.pages++;
+}
+
+static struct file_mapping* find_mapping(uintptr_t address) {
+    for (struct file_mapping* mapping = mappings; mapping; mapping = mapping->next) {
+        if (address >= mapping->start && address - mapping->start < mapping->count * PAGE_SIZE) {
+            return mapping;
+        }
+    }
+    return NULL;
+}
+
+// Unhash up to `limit` frames: every frame of file `id`, or unmapped frames
+// of any file if `any_file`. Returns them linked through page->next, still
+// holding the cache's reference. Interrupts must be off.
+static struct page* take_victims(uint64_t id, bool any_file, size_t limit, size_t* taken) {
+    struct page* victims = NULL;
+    size_t count = 0;
+
+    for (size_t i = 0; i < CACHE_BUCKETS && count < limit; i++) {
+        struct page** link = &buckets[i];
+        while (*link && count < limit) {
+            struct page* page = *link;
+            if (any_file ? (page->flags & PG_SHARED) != 0 : page_file(page) != id) {
+                link = &page->next;
+                continue;
+            }
+            *link = page->next;
+            page->next = victims;
+            victims = page;
+            count++;
+        }
+    }
+    cache_stats.pages -= count;
+    cache_stats.evicted += count;
+    *taken = count;
+    return victims;
+}
+
+// Forget a frame take_victims returned and drop the cache's reference,
+// returning true if that was the last one
+static bool release_victim(struct page* page) {
+    page->next = NULL;
+    page->private = NULL;
+    page->freelist = NULL;
+    page->flags &= ~PG_CACHE;
+    return put_page_testzero(page);
+}
+
+// Drop the cache's reference to up to `limit` frames, chosen as by
+// take_victims. Unmapped frames are freed; mapped ones go with their last
+// mapping.
+static size_t evict(uint64_t id, bool any_file, size_t limit) {
+    size_t count;
+    uint64_t irq_flags = irq_save();
+    struct page* victims = take_victims(id, any_file, limit, &count);
+    irq_restore(irq_flags);
+
+    // Once the reference is dropped an unmap may free the frame at any time
+    while (victims) {
+        struct page* page = victims;
+        victims = page->next;
+        if (release_victim(page)) {
+            free_pages(page);
+        }
+    }
+    return count;
+}
+
+struct page* filemap_reclaim_page(void) {
+    size_t count;
+    uint64_t irq_flags = irq_save();
+    struct page* page = take_victims(0, true, 1, &count);
+    irq_restore(irq_flags);
+
+    // Unmapped, so the cache held the only reference
+    if (page) {
+        release_victim(page);
+    }
+    return page;
+}
+
+void filemap_init(void) {
+    if (mapping_cache) return;
+
+    mapping_cache = kmem_cache_create("file_mapping", sizeof(struct file_mapping), NULL);
+    if (!mapping_cache) {
+        kprintf(ERROR, "[FILEMAP] Failed to create the file_mapping cache\n");
+        return;
+    }
+    register_shrinker(&page_cache_shrinker);
+}
+
+void* filemap_map(struct file_source* source, uint32_t first, size_t count) {
+    struct file_mapping* mapping = mapping_cache ? kmem_cache_alloc(mapping_cache) : NULL;
+    void* addr = mapping ? vmalloc_reserve(count * PAGE_SIZE) : NULL;
+    if (!addr) {
+        if (mapping) {
+            kmem_cache_free(mapping_cache, mapping);
+        }
+        source->release(source);
+        return NULL;
+    }
+
+    mapping->start = (uintptr_t)addr;
+    mapping->count = count;
+    mapping->first = first;
+    mapping->source = source;
+
+    uint64_t irq_flags = irq_save();
+    mapping->next = mappings;
+    mappings = mapping;
+    cache_stats.mappings++;
+    irq_restore(irq_flags);
+    return addr;
+}
+
+void filemap_unmap(void* addr) {
+    if (!addr) return;
+
+    uint64_t irq_flags = irq_save();
+    struct file_mapping** link = &mappings;
+    while (*link && (*link)->start != (uintptr_t)addr) {
+        link = &(*link)->next;
+    }
+    struct file_mapping* mapping = *link;
+    if (mapping) {
+        *link = mapping->next;
+        cache_stats.mappings--;
+    }
+    irq_restore(irq_flags);
+
+    if (!mapping) {
+        kprintf(ERROR, "[FILEMAP] %p is not a file mapping\n", addr);
+        return;
+    }
+
+    // Drops each page's mapping reference; the frames stay cached
+    vunreserve(addr, mapping->count * PAGE_SIZE);
+    mapping->source->release(mapping->source);
+    kmem_cache_free(mapping_cache, mapping);
+}
+
+bool filemap_fault(uintptr_t address, struct page** page, bool* major) {
+    uint64_t irq_flags = irq_save();
+    struct file_mapping* mapping = find_mapping(address);
+    if (!mapping) {
+        irq_restore(irq_flags);
+        return false;
+    }
+
+    struct file_source* source = mapping->source;
+    uint32_t index = mapping->first + (address - mapping->start) / PAGE_SIZE;
+    *page = cache_find(source->id, index);
+    *major = *page == NULL;
+    if (*page) {
+        cache_stats.hits++;
+    } else {
+        struct page* frame = alloc_atomic_page();
+        if (frame && source->read_page(source, index, page_address(frame))) {
+            cache_insert(frame, source->id, index);
+            cache_stats.misses++;
+            *page = frame;
+        } else if (frame) {
+            // The reserve only takes back zeroed frames
+            memset(page_address(frame), 0, PAGE_SIZE);
+            free_atomic_page(frame);
+        }
+    }
+    if (*page) {
+        get_page(*page);
+    }
+    irq_restore(irq_flags);
+    return true;
+}
+
+bool filemap_populate(void* addr, size_t size) {
+    uint64_t irq_flags = irq_save();
+    struct file_mapping* mapping = find_mapping((uintptr_t)addr);
+    irq_restore(irq_flags);
+    if (!mapping) {
+        return false;
+    }
+
+    uintptr_t start = (uintptr_t)addr & ~(uintptr_t)(PAGE_SIZE - 1);
+    uintptr_t end = mapping->start + mapping->count * PAGE_SIZE;
+    if (size < end - (uintptr_t)addr) {
+        end = (uintptr_t)addr + size;
+    }
+    struct file_source* source = mapping->source;
+    for (uintptr_t address = start; address < end; address += PAGE_SIZE) {
+        if (virtual_to_physical(address)) {
+            continue;
+        }
+
+        uint32_t index = mapping->first + (address - mapping->start) / PAGE_SIZE;
+        irq_flags = irq_save();
+        bool cached = cache_find(source->id, index) != NULL;
+        irq_restore(irq_flags);
+        if (!cached) {
+            struct page* frame = alloc_zeroed_page();
+            if (!frame) {
+                return false;
+            }
+            irq_flags = irq_save();
+            bool ok = cache_find(source->id, index) || source->read_page(source, index, page_address(frame));
+            if (ok && !cache_find(source->id, index)) {
+                cache_insert(frame, source->id, index);
+                cache_stats.misses++;
+                frame = NULL;
+            }
+            irq_restore(irq_flags);
+            if (frame) {
+                free_pages(frame);
+            }
+            if (!ok) {
+                return false;
+            }
+        }
+
+        // A cache hit now; nothing allocates before the touch, so the
+        // shrinker cannot take the frame back in between
+        (void)*(volatile uint8_t*)address;
+    }
+    return true;
+}
+
+void filemap_invalidate(uint64_t id) {
+    evict(id, false, (size_t)-1);
+}
+
+void get_page_cache_stats(struct page_cache_stats* stats) {
+    uint64_t irq_flags = irq_save();
+    *stats = cache_stats;
+    irq_restore(irq_flags);
+}
+
+static size_t page_cache_shrink_count(void) {
+    size_t count = 0;
+    uint64_t irq_flags = irq_save();
+    for (size_t i = 0; i < CACHE_BUCKETS; i++) {
+        for (struct page* page = buckets[i]; page; page = page->next) {
+            count += !(page->flags & PG_SHARED);
+        }
+    }
+    irq_restore(irq_flags);
+    return count;
+}
+
+static size_t page_cache_shrink_scan(size_t nr_pages) {
+    return evict(0, true, nr_pages);
+}
+
+static struct shrinker page_cache_shrinker = {
+    .name = "page-cache",
+    .count = page_cache_shrink_count,
+    .scan = page_cache_shrink_scan,
+};
+
+#define TEST_FILE (~0ull)  // No filesystem hands out this id
+#define TEST_PAGES 3
+
+static volatile uint32_t test_reads = 0;
+static uint8_t test_version = 0;  // Bumped to stand in for a write to the file
+
+static bool test_read_page(struct file_source* source, uint32_t index, void* buffer) {
+    (void)source;
+    test_reads++;
+    memset(buffer, 0xA0 + test_version + index, PAGE_SIZE);
+    return true;
+}
+
+static void test_release(struct file_source* source) {
+    kfree(source);
+}
+
+static void* test_map(uint32_t first, size_t count) {
+    struct file_source* source = kmalloc(sizeof(struct file_source));
+    if (!source) return NULL;
+    source->id = TEST_FILE;
+    source->size = TEST_PAGES * PAGE_SIZE;
+    source->read_page = test_read_page;
+    source->release = test_release;
+    return filemap_map(source, first, count);
+}
+
+void filemap_test(void) {
+    kprintf(INFO, "[FILEMAP] Starting page cache tests...\n");
+
+    struct page_cache_stats before, after;
+    get_page_cache_stats(&before);
+
+    // Mapping reads nothing; touching a page reads just that page
+    volatile uint8_t* data = test_map(0, TEST_PAGES);
+    if (!data) {
+        kprintf(ERROR, "[FILEMAP] Mapping failed\n");
+        return;
+    }
+    bool ok = test_reads == 0 && data[PAGE_SIZE + 7] == 0xA1 && test_reads == 1;
+    filemap_unmap((void*)data);
+    if (ok) {
+        kprintf(INFO, "[FILEMAP] Lazy fault-in test passed\n");
+    } else {
+        kprintf(ERROR, "[FILEMAP] Lazy fault-in test failed\n");
+    }
+
+    // A second mapping at another offset finds the page still cached
+    data = test_map(1, 2);
+    if (!data) {
+        kprintf(ERROR, "[FILEMAP] Mapping failed\n");
+        return;
+    }
+    ok = data[0] == 0xA1 && test_reads == 1 && data[PAGE_SIZE] == 0xA2 && test_reads == 2;
+    filemap_unmap((void*)data);
+    get_page_cache_stats(&after);
+    ok = ok && after.hits == before.hits + 1 && after.misses == before.misses + 2;
+    if (ok) {
+        kprintf(INFO, "[FILEMAP] Page cache hit test passed\n");
+    } else {
+        kprintf(ERROR, "[FILEMAP] Page cache hit test failed\n");
+    }
+
+    // Unmapped pages can be dropped
+    filemap_invalidate(TEST_FILE);
+    get_page_cache_stats(&after);
+    if (after.pages == before.pages && after.mappings == before.mappings) {
+        kprintf(INFO, "[FILEMAP] Invalidation test passed\n");
+    } else {
+        kprintf(ERROR, "[FILEMAP] Invalidation test failed\n");
+    }
+
+    // Populating reads and maps every page up front, so touching them
+    // afterwards faults on nothing
+    data = test_map(0, TEST_PAGES);
+    uint32_t reads = test_reads;
+    ok = data && filemap_populate((void*)data, TEST_PAGES * PAGE_SIZE) && test_reads == reads + TEST_PAGES;
+    for (uint32_t i = 0; ok && i < TEST_PAGES; i++) {
+        ok = virtual_to_physical((uintptr_t)data + i * PAGE_SIZE) != 0 && data[i * PAGE_SIZE] == 0xA0 + i;
+    }
+    filemap_unmap((void*)data);
+    filemap_invalidate(TEST_FILE);
+    if (ok && test_reads == reads + TEST_PAGES) {
+        kprintf(INFO, "[FILEMAP] Populate test passed\n");
+    } else {
+        kprintf(ERROR, "[FILEMAP] Populate test failed\n");
+    }
+
+    // A write while the file is mapped: the live mapping keeps its frame,
+    // a new mapping reads the new data, and the old frame goes with the
+    // old mapping
+    data = test_map(0, 1);
+    if (!data) {
+        kprintf(ERROR, "[FILEMAP] Mapping failed\n");
+        return;
+    }
+    ok = data[0] == 0xA0;
+    struct page* old = phys_to_page(virtual_to_physical((uintptr_t)data));
+    test_version = 0x10;
+    filemap_invalidate(TEST_FILE);
+    volatile uint8_t* fresh = test_map(0, 1);
+    ok = ok && fresh && fresh[0] == 0xB0 && data[0] == 0xA0;
+    filemap_unmap((void*)data);
+    ok = ok && !(old->flags & (PG_ALLOCATED | PG_CACHE));
+    filemap_unmap((void*)fresh);
+    filemap_invalidate(TEST_FILE);
+    test_version = 0;
+    get_page_cache_stats(&after);
+    if (ok && after.pages == before.pages) {
+        kprintf(INFO, "[FILEMAP] Invalidation under a live mapping test passed\n");
+    } else {
+        kprintf(ERROR, "[FILEMAP] Invalidation under a live mapping test failed\n");
+    }
+}
@@ -1,43 +1,151 @@
-#include <kernel/mm/vmm.h>
 #include <kernel/mm/kmalloc.h>
+#include <kernel/mm/pmm.h>
+#include <kernel/mm/vmalloc.h>
+#include <kernel/mm/shrinker.h>
+#include <kernel/sync.h>
 #include <kernel/kprintf.h>
 #include <string.h>
 #include <stdbool.h>
 
 /*
-Kernel Heap implementation using a linked list of free blocks.
+Kernel heap built from slab caches, one per size class.
+
+Blocks up to KMALLOC_MAX_CACHE_SIZE bytes (header included) are carved out
+of slabs of buddy pages. Slab bookkeeping lives in struct page, so
+kfree finds the owning cache from the block's frame without searching.
+
+Larger blocks are vmalloc areas, backed one buddy frame at a time, so they
+need no physically contiguous memory. Freeing one unmaps it and hands
+every frame straight back to the PMM.
+
+KMALLOC_HARDENING picks the debugging checks at compile time:
+  0 - no block header at all; the smallest size class is 16 bytes
+  1 - a header magic that catches double frees and stray pointers
+  2 - magic, guard and checksum, a redzone after every block checked on
+      free, and POISON_FREE over freed memory
+KMALLOC_PROFILE records allocation counters per kmalloc call site (the
+return address), read back through kmalloc_get_sites. It costs a 32-bit
+site index in every block header.
+
+The Makefile sets both to 0 for production builds; `make debug` and
+`make test` build with level 2 and the profiler. A build that leaves them
+out gets level 2 and the profiler with DEBUG_MODE.
 */
 
-#define PAGE_SIZE 4096
-#define HEAP_START 0x1000000
-#define HEAP_SIZE (PAGE_SIZE * 128)
+#ifndef KMALLOC_HARDENING
+#ifdef DEBUG_MODE
+#define KMALLOC_HARDENING 2
+#else
+#define KMALLOC_HARDENING 0
+#endif
+#endif
+
+#ifndef KMALLOC_PROFILE
+#ifdef DEBUG_MODE
+#define KMALLOC_PROFILE 1
+#else
+#define KMALLOC_PROFILE 0
+#endif
+#endif
+
+#define HAS_HEADER (KMALLOC_HARDENING >= 1 || KMALLOC_PROFILE)
+
 #define ALIGN_UP(x, align) (((x) + (align) - 1) & ~((align) - 1))
-#define MIN_BLOCK_SIZE (sizeof(free_block_t) + sizeof(void*))
 #define ALIGNMENT 16  // Ensure 16-byte alignment
+#define KMALLOC_MAX_CACHE_SIZE 2048
+#define MAX_SLAB_ORDER 2  // Slabs span at most 4 pages
+
+#define PROFILE_SITE_BITS 8
+#define PROFILE_SITES (1 << PROFILE_SITE_BITS)  // Slot 0 collects callers that did not fit
 
-typedef struct free_block {
-    struct free_block *next;
-    size_t size;
+#if HAS_HEADER
+// Padded to 16 bytes so payloads stay aligned
+typedef struct __attribute__((aligned(ALIGNMENT))) block_header {
+#if KMALLOC_HARDENING >= 1
+    uint32_t size;       // Bytes reserved for the block, header included
     uint32_t magic;      // Magic number to detect corruption
     uint32_t checksum;   // Checksum for corruption detection
-    uint32_t guard;      // Guard value at end of block
-} free_block_t;
+    uint32_t guard;      // Guard value at end of header
+#endif
+#if KMALLOC_HARDENING >= 2
+    uint32_t requested;  // Bytes asked for; the redzone starts right after
+#endif
+#if KMALLOC_PROFILE
+    uint32_t site;       // Profile slot of the allocating call site
+#endif
+} block_header_t;
+
+#define HEADER_SIZE sizeof(block_header_t)
+_Static_assert(sizeof(block_header_t) % ALIGNMENT == 0, "block header must keep payloads aligned");
+#else
+#define HEADER_SIZE 0
+#endif
+
+#if KMALLOC_HARDENING >= 2
+#define REDZONE_SIZE 16
+#else
+#define REDZONE_SIZE 0
+#endif
 
 #define FREE_MAGIC 0xDEADBEEF
 #define ALLOC_MAGIC 0xCAFEBABE
 #define GUARD_VALUE 0xBADF00D
+#define REDZONE_BYTE 0xCC
+#define POISON_FREE 0x6B
+
+// Slabs of equally sized blocks: a kmalloc size class or a typed object cache
+typedef struct kmem_cache {
+    const char* name;
+    uint32_t object_size;   // Bytes callers get
+    uint32_t size;          // Block size, header and redzone included
+    uint32_t order;         // Slab size as a buddy order
+    uint32_t objects;       // Blocks per slab
+    uint32_t empty_slabs;   // Fully free slabs kept on the partial list
+    struct page* partial;   // Slabs with at least one free block
+    void (*ctor)(void*);    // Run on every object handed out
+    uint64_t slabs;         // Slabs currently allocated
+    uint64_t active;        // Blocks handed out
+    uint64_t allocs;        // Allocations over the cache's lifetime
+    struct kmem_cache* next;  // All caches, for statistics and shrinking
+} kmem_cache_t;
+
+// Powers of two plus the midpoints between them, to keep internal waste under 33%
+static const uint32_t size_classes[] = {
+#if !HAS_HEADER
+    16,
+#endif
+    32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048
+};
+#define NR_SIZE_CLASSES (sizeof(size_classes) / sizeof(size_classes[0]))
+
+static kmem_cache_t caches[NR_SIZE_CLASSES];
+static char cache_names[NR_SIZE_CLASSES][16];
+static kmem_cache_t* cache_list = NULL;
+static uint8_t size_index[KMALLOC_MAX_CACHE_SIZE / ALIGNMENT];  // (size - 1) / ALIGNMENT -> cache
+static bool kmalloc_ready = false;
+static uint64_t large_pages = 0;
+
+static struct shrinker kmalloc_shrinker;
+
+#if KMALLOC_PROFILE
+static struct kmalloc_site profile_sites[PROFILE_SITES];
+#endif
 
-static uintptr_t heap_top = HEAP_START;
-static free_block_t *free_list = NULL;
+#define CALLER ((uintptr_t)__builtin_return_address(0))
 
+#if KMALLOC_HARDENING >= 1
 // Calculate checksum for a block
-static uint32_t calculate_checksum(free_block_t *block) {
+static uint32_t calculate_checksum(block_header_t *block) {
     if (!block) return 0;
+#if KMALLOC_HARDENING >= 2
+    return (uint32_t)((uintptr_t)block ^ block->size ^ block->magic ^ block->guard ^ block->requested);
+#else
     return (uint32_t)((uintptr_t)block ^ block->size ^ block->magic ^ block->guard);
+#endif
 }
 
 // Verify block integrity
-static bool verify_block(free_block_t *block) {
+static bool verify_block(block_header_t *block) {
     if (!block) {
         kprintf(ERROR, "[KMALLOC] Null block pointer\n");
         return false;
@@ -48,6 +156,7 @@ static bool verify_block(free_block_t *block) {
         return false;
     }
     
+#if KMALLOC_HARDENING >= 2
     if (block->guard != GUARD_VALUE) {
         kprintf(ERROR, "[KMALLOC] Guard value corrupted at %p: 0x%x\n", block, block->guard);
         return false;
@@ -59,104 +168,658 @@ static bool verify_block(free_block_t *block) {
                 block, expected_checksum, block->checksum);
         return false;
     }
+#endif
     
     return true;
 }
 
-// Initialize a new block
-static void init_block(free_block_t *block, size_t size, uint32_t magic) {
+// Initialize a block header
+static void init_block(block_header_t *block, size_t size, uint32_t magic) {
     if (!block) return;
     block->size = size;
     block->magic = magic;
-    block->next = NULL;
     block->guard = GUARD_VALUE;
     block->checksum = calculate_checksum(block);
 }
+#endif
+
+// Validate the header of a block the caller claims to own
+static bool check_block(void *ptr, const char *who) {
+#if KMALLOC_HARDENING >= 1
+    block_header_t *block = (block_header_t *)ptr - 1;
+
+    // Check for memory corruption
+    if (!verify_block(block)) {
+        kprintf(ERROR, "[%s] Memory corruption detected at %p\n", who, block);
+        return false;
+    }
+
+    if (block->magic != ALLOC_MAGIC) {
+        kprintf(ERROR, "[%s] Double free detected at %p\n", who, ptr);
+        return false;
+    }
+
+#if KMALLOC_HARDENING >= 2
+    const uint8_t *redzone = (const uint8_t *)ptr + block->requested;
+    for (size_t i = 0; i < REDZONE_SIZE; i++) {
+        if (redzone[i] != REDZONE_BYTE) {
+            kprintf(ERROR, "[%s] Write past the %u bytes allocated at %p\n", who, block->requested, ptr);
+            return false;
+        }
+    }
+#endif
+#else
+    (void)ptr;
+    (void)who;
+#endif
+    return true;
+}
+
+// Stamp a block as handed out and return its payload
+static void *mark_allocated(void *base, size_t size, size_t requested) {
+#if KMALLOC_HARDENING >= 2
+    ((block_header_t *)base)->requested = requested;
+    memset((uint8_t *)base + HEADER_SIZE + requested, REDZONE_BYTE, REDZONE_SIZE);
+#endif
+#if KMALLOC_HARDENING >= 1
+    init_block(base, size, ALLOC_MAGIC);
+#endif
+    (void)size;
+    (void)requested;
+    return (uint8_t *)base + HEADER_SIZE;
+}
+
+static void mark_free(void *base, size_t size) {
+#if KMALLOC_HARDENING >= 2
+    // Make use-after-free reads stand out
+    memset((uint8_t *)base + HEADER_SIZE, POISON_FREE, size - HEADER_SIZE);
+    ((block_header_t *)base)->requested = 0;
+#endif
+#if KMALLOC_HARDENING >= 1
+    init_block(base, size, FREE_MAGIC);
+#endif
+    (void)base;
+    (void)size;
+}
+
+#if KMALLOC_PROFILE
+// Find or claim the hash slot for a call site; irqs must be off
+static uint32_t profile_slot(uintptr_t caller) {
+    uint32_t hash = (uint32_t)((caller * 0x9E3779B97F4A7C15ull) >> (64 - PROFILE_SITE_BITS));
+    for (uint32_t probe = 0; probe < PROFILE_SITES; probe++) {
+        uint32_t slot = (hash + probe) & (PROFILE_SITES - 1);
+        if (slot == 0) continue;
+        if (profile_sites[slot].caller == caller) return slot;
+        if (profile_sites[slot].caller == 0) {
+            profile_sites[slot].caller = caller;
+            return slot;
+        }
+    }
+    return 0;
+}
+#endif
+
+static void profile_alloc(void *base, size_t requested, size_t size, uintptr_t caller) {
+#if KMALLOC_PROFILE
+    uint64_t irq_flags = irq_save();
+    uint32_t slot = profile_slot(caller);
+    profile_sites[slot].allocs++;
+    profile_sites[slot].bytes += requested;
+    profile_sites[slot].live_bytes += size;
+    ((block_header_t *)base)->site = slot;
+    irq_restore(irq_flags);
+#else
+    (void)base;
+    (void)requested;
+    (void)size;
+    (void)caller;
+#endif
+}
+
+// Account for a block growing in place
+static void profile_resize(void *base, size_t old_size, size_t new_size) {
+#if KMALLOC_PROFILE
+    uint64_t irq_flags = irq_save();
+    struct kmalloc_site *site = &profile_sites[((block_header_t *)base)->site];
+    site->live_bytes = site->live_bytes - old_size + new_size;
+    irq_restore(irq_flags);
+#else
+    (void)base;
+    (void)old_size;
+    (void)new_size;
+#endif
+}
+
+static void profile_free(void *base, size_t size) {
+#if KMALLOC_PROFILE
+    uint64_t irq_flags = irq_save();
+    struct kmalloc_site *site = &profile_sites[((block_header_t *)base)->site];
+    site->frees++;
+    site->live_bytes -= size;
+    irq_restore(irq_flags);
+#else
+    (void)base;
+    (void)size;
+#endif
+}
+
+// Free blocks are chained through their first payload word
+static inline void* get_free_next(void *block) {
+    return *(void**)((uint8_t *)block + HEADER_SIZE);
+}
+
+static inline void set_free_next(void *block, void* next) {
+    *(void**)((uint8_t *)block + HEADER_SIZE) = next;
+}
+
+static void slab_list_add(kmem_cache_t* cache, struct page* slab) {
+    slab->prev = NULL;
+    slab->next = cache->partial;
+    if (cache->partial) {
+        cache->partial->prev = slab;
+    }
+    cache->partial = slab;
+}
+
+static void slab_list_remove(kmem_cache_t* cache, struct page* slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        cache->partial = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    slab->next = NULL;
+    slab->prev = NULL;
+}
+
+// Grab pages for a slab and thread every block onto its freelist
+static struct page* new_slab(kmem_cache_t* cache) {
+    struct page* slab = alloc_pages(cache->order);
+    if (!slab) return NULL;
+
+    // Tail pages point back at the cache so kfree can find the head
+    for (uint32_t i = 1; i < (1u << cache->order); i++) {
+        slab[i].flags = PG_SLAB;
+        slab[i].private = cache;
+    }
+    slab->flags |= PG_SLAB;
+    slab->private = cache;
+    slab->inuse = 0;
+
+    uint8_t* base = page_address(slab);
+    void* next = NULL;
+    for (uint32_t i = cache->objects; i-- > 0;) {
+        void* block = base + i * cache->size;
+#if KMALLOC_HARDENING >= 1
+        init_block(block, cache->size, FREE_MAGIC);
+#endif
+        set_free_next(block, next);
+        next = block;
+    }
+    slab->freelist = next;
+
+    slab_list_add(cache, slab);
+    cache->empty_slabs++;
+    cache->slabs++;
+    return slab;
+}
+
+// Hand a slab that has no blocks in use back to the buddy allocator
+static void release_slab(kmem_cache_t* cache, struct page* slab) {
+    slab_list_remove(cache, slab);
+    cache->empty_slabs--;
+    cache->slabs--;
+
+    for (uint32_t i = 1; i < (1u << cache->order); i++) {
+        slab[i].flags = 0;
+        slab[i].private = NULL;
+    }
+    slab->flags &= ~PG_SLAB;
+    slab->private = NULL;
+    slab->freelist = NULL;
+    free_pages(slab);
+}
+
+static void* cache_alloc(kmem_cache_t* cache) {
+    uint64_t irq_flags = irq_save();
+
+    struct page* slab = cache->partial;
+    if (!slab) {
+        slab = new_slab(cache);
+        if (!slab) {
+            irq_restore(irq_flags);
+            return NULL;
+        }
+    }
+
+    void* block = slab->freelist;
+    slab->freelist = get_free_next(block);
+    if (slab->inuse++ == 0) {
+        cache->empty_slabs--;
+    }
+    if (!slab->freelist) {
+        slab_list_remove(cache, slab);
+    }
+    cache->active++;
+    cache->allocs++;
+
+    irq_restore(irq_flags);
+    return block;
+}
+
+static void cache_free(kmem_cache_t* cache, struct page* slab, void* block) {
+    uint64_t irq_flags = irq_save();
+
+    // A full slab is off the partial list until it gets a block back
+    if (!slab->freelist) {
+        slab_list_add(cache, slab);
+    }
+    set_free_next(block, slab->freelist);
+    slab->freelist = block;
+    cache->active--;
+
+    // Keep one empty slab per cache so alloc/free pairs don't bounce pages
+    if (--slab->inuse == 0) {
+        cache->empty_slabs++;
+        if (cache->empty_slabs > 1) {
+            release_slab(cache, slab);
+        }
+    }
+
+    irq_restore(irq_flags);
+}
+
+static size_t large_block_pages(void* block) {
+    return vmalloc_size(block) / PAGE_SIZE;
+}
+
+static void* large_alloc(size_t size) {
+    void* block = vmalloc_uninit(size);
+    if (block) {
+        large_pages += large_block_pages(block);
+    }
+    return block;
+}
+
+// Grow a large block over the free pages that follow it
+static bool large_extend(void* block, size_t size) {
+    size_t old_pages = large_block_pages(block);
+    if (!vmalloc_extend(block, size)) return false;
+
+    large_pages += large_block_pages(block) - old_pages;
+    return true;
+}
+
+static void large_free(void* block) {
+    large_pages -= large_block_pages(block);
+    vfree(block);
+}
+
+static size_t kmalloc_shrink_count(void) {
+    size_t count = 0;
+    for (kmem_cache_t* cache = cache_list; cache; cache = cache->next) {
+        count += (size_t)cache->empty_slabs << cache->order;
+    }
+    return count;
+}
+
+// Release the empty slabs each cache keeps in reserve
+static size_t kmalloc_shrink_scan(size_t nr_pages) {
+    size_t freed = 0;
+    for (kmem_cache_t* cache = cache_list; cache && freed < nr_pages; cache = cache->next) {
+        uint64_t irq_flags = irq_save();
+        struct page* slab = cache->partial;
+        while (slab && cache->empty_slabs && freed < nr_pages) {
+            struct page* next = slab->next;
+            if (slab->inuse == 0) {
+                release_slab(cache, slab);
+                freed += 1u << cache->order;
+            }
+            slab = next;
+        }
+        irq_restore(irq_flags);
+    }
+    return freed;
+}
+
+static struct shrinker kmalloc_shrinker = {
+    .name = "kmalloc",
+    .count = kmalloc_shrink_count,
+    .scan = kmalloc_shrink_scan,
+};
+
+// Smallest slab order that wastes no more than an eighth of the slab
+static uint32_t slab_order(uint32_t size) {
+    for (uint32_t order = 0; order < MAX_SLAB_ORDER; order++) {
+        uint32_t slab_size = PAGE_SIZE << order;
+        if ((slab_size % size) * 8 <= slab_size) {
+            return order;
+        }
+    }
+    return MAX_SLAB_ORDER;
+}
+
+static void cache_init(kmem_cache_t* cache, const char* name, uint32_t object_size,
+                       uint32_t size, void (*ctor)(void*)) {
+    memset(cache, 0, sizeof(kmem_cache_t));
+    cache->name = name;
+    cache->object_size = object_size;
+    cache->size = size;
+    cache->order = slab_order(size);
+    cache->objects = (PAGE_SIZE << cache->order) / size;
+    cache->ctor = ctor;
+
+    uint64_t irq_flags = irq_save();
+    cache->next = cache_list;
+    cache_list = cache;
+    irq_restore(irq_flags);
+}
+
+// "kmalloc-<size>"
+static const char* size_class_name(char* buf, uint32_t size) {
+    char digits[10];
+    int len = 0;
+    do {
+        digits[len++] = '0' + size % 10;
+        size /= 10;
+    } while (size);
+
+    strcpy(buf, "kmalloc-");
+    char* p = buf + strlen(buf);
+    while (len) {
+        *p++ = digits[--len];
+    }
+    *p = '\0';
+    return buf;
+}
 
 // Initialize the heap
 void kmalloc_init(void) {
-    // Clear the heap area
-    memset((void*)HEAP_START, 0, HEAP_SIZE);
-    
-    // Initialize the first free block
-    free_block_t *block = (free_block_t*)HEAP_START;
-    init_block(block, HEAP_SIZE, FREE_MAGIC);
-    
-    free_list = block;
-    heap_top = HEAP_START + HEAP_SIZE;
-    
-    kprintf(INFO, "[KMALLOC] Heap initialized at %p with size %u bytes\n", 
-            (void*)HEAP_START, HEAP_SIZE);
-    kprintf(INFO, "[KMALLOC] First block at %p, size %u\n", 
-            block, block->size);
+    if (kmalloc_ready) return;
+
+    // Registered largest first so statistics list the small classes first
+    for (uint32_t i = NR_SIZE_CLASSES; i-- > 0;) {
+        cache_init(&caches[i], size_class_name(cache_names[i], size_classes[i]),
+                   size_classes[i] - HEADER_SIZE - REDZONE_SIZE, size_classes[i], NULL);
+    }
+
+    uint32_t cache = 0;
+    for (uint32_t i = 0; i < KMALLOC_MAX_CACHE_SIZE / ALIGNMENT; i++) {
+        while ((i + 1) * ALIGNMENT > size_classes[cache]) {
+            cache++;
+        }
+        size_index[i] = cache;
+    }
+
+    register_shrinker(&kmalloc_shrinker);
+    kmalloc_ready = true;
+
+    kprintf(INFO, "[KMALLOC] Heap initialized with %u size classes from %u to %u bytes\n",
+            (uint32_t)NR_SIZE_CLASSES, size_classes[0], KMALLOC_MAX_CACHE_SIZE);
+}
+
+static void *heap_alloc(size_t size, uintptr_t caller) {
+    if (size == 0) return NULL;
+
+    if (size > VMALLOC_SIZE - HEADER_SIZE - REDZONE_SIZE) {
+        kprintf(ERROR, "[KMALLOC] Allocation of %u bytes is too large\n", size);
+        return NULL;
+    }
+
+    // Add space for the header and redzone, and align
+    size_t total = ALIGN_UP(size + HEADER_SIZE + REDZONE_SIZE, ALIGNMENT);
+
+    void *block;
+    size_t block_size;
+    if (total <= KMALLOC_MAX_CACHE_SIZE) {
+        kmem_cache_t* cache = &caches[size_index[(total - 1) / ALIGNMENT]];
+        block = cache_alloc(cache);
+        block_size = cache->size;
+    } else {
+        block = large_alloc(total);
+        block_size = ALIGN_UP(total, PAGE_SIZE);
+    }
+
+    if (!block) {
+        kprintf(ERROR, "[KMALLOC] Out of memory allocating %u bytes\n", size);
+        return NULL;
+    }
+
+    profile_alloc(block, size, block_size, caller);
+    return mark_allocated(block, block_size, size);
 }
 
-static void expand_heap(size_t size) {
-    size = ALIGN_UP(size, PAGE_SIZE);
-    for (size_t i = 0; i < size; i += PAGE_SIZE) {
-        uintptr_t vaddr = heap_top + i;
-        uintptr_t paddr = vaddr;
-        map_virtual_to_physical(vaddr, paddr, PAGE_PRESENT | PAGE_WRITABLE);
+static void *heap_zalloc(size_t size, uintptr_t caller) {
+    void *ptr = heap_alloc(size, caller);
+    if (ptr) {
+        memset(ptr, 0, size);
     }
-    heap_top += size;
+    return ptr;
+}
+
+// Each entry point passes its own return address so the profiler sees the real caller
+void *kmalloc_uninit(size_t size) {
+    return heap_alloc(size, CALLER);
+}
+
+void *kzalloc(size_t size) {
+    return heap_zalloc(size, CALLER);
 }
 
 void *kmalloc(size_t size) {
-    if (size == 0) return NULL;
+    return heap_zalloc(size, CALLER);
+}
+
+// Resize a block, growing in place when its slot or the pages after it have room
+void *krealloc(void *ptr, size_t size) {
+    if (!ptr) return heap_alloc(size, CALLER);
+    if (size == 0) {
+        kfree(ptr);
+        return NULL;
+    }
 
-    // Add space for magic number and align
-    size = ALIGN_UP(size + sizeof(uint32_t), ALIGNMENT);
-    if (size < MIN_BLOCK_SIZE) size = MIN_BLOCK_SIZE;
+    if (!check_block(ptr, "KREALLOC")) return NULL;
 
-    free_block_t **prev = &free_list;
-    for (free_block_t *block = free_list; block; block = block->next) {
-        if (!verify_block(block)) {
-            kprintf(ERROR, "[KMALLOC] Memory corruption detected at %p\n", block);
-            return NULL;
+    if (size > VMALLOC_SIZE - HEADER_SIZE - REDZONE_SIZE) {
+        kprintf(ERROR, "[KREALLOC] Allocation of %u bytes is too large\n", size);
+        return NULL;
+    }
+
+    void *block = (uint8_t *)ptr - HEADER_SIZE;
+    size_t total = ALIGN_UP(size + HEADER_SIZE + REDZONE_SIZE, ALIGNMENT);
+    size_t block_size;
+    if (is_vmalloc_addr(block)) {
+        block_size = large_block_pages(block) * PAGE_SIZE;
+        if (total > block_size && large_extend(block, total)) {
+            profile_resize(block, block_size, ALIGN_UP(total, PAGE_SIZE));
+            block_size = ALIGN_UP(total, PAGE_SIZE);
         }
-        if (block->size >= size) {
-            *prev = block->next;
-            // Mark as allocated
-            init_block(block, size, ALLOC_MAGIC);
-            // Zero out the memory
-            memset(block + 1, 0, size - sizeof(free_block_t));
-            return (void *)(block + 1);
+    } else {
+        struct page* page = virt_to_page(block);
+        if (!page || !(page->flags & PG_SLAB)) {
+            kprintf(ERROR, "[KREALLOC] %p was not allocated by kmalloc\n", ptr);
+            return NULL;
         }
-        prev = &block->next;
+        block_size = ((kmem_cache_t*)page->private)->size;
     }
 
-    if (heap_top + size > HEAP_START + HEAP_SIZE) {
-        expand_heap(size);
+    // Shrinking, or growing within the slot, keeps the block where it is
+    if (total <= block_size) {
+        return mark_allocated(block, block_size, size);
     }
 
-    free_block_t *block = (free_block_t*)heap_top;
-    init_block(block, size, ALLOC_MAGIC);
-    
-    heap_top += size;
-    
-    // Zero out the memory
-    memset(block + 1, 0, size - sizeof(free_block_t));
-    return (void *)(block + 1);
+    void *new_ptr = heap_alloc(size, CALLER);
+    if (!new_ptr) return NULL;
+
+    memcpy(new_ptr, ptr, block_size - HEADER_SIZE - REDZONE_SIZE);
+    kfree(ptr);
+    return new_ptr;
+}
+
+// Return a block to the slab that owns it
+static void slab_free_block(struct page* page, void* block) {
+    kmem_cache_t* cache = page->private;
+    profile_free(block, cache->size);
+    mark_free(block, cache->size);
+
+    uint64_t pfn = page_to_phys(page) >> PAGE_SHIFT;
+    struct page* slab = page - (pfn & ((1u << cache->order) - 1));
+    cache_free(cache, slab, block);
 }
 
 void kfree(void *ptr) {
     if (!ptr) return;
 
-    free_block_t *block = (free_block_t *)ptr - 1;
-    
-    // Check for memory corruption
-    if (!verify_block(block)) {
-        kprintf(ERROR, "[KFREE] Memory corruption detected at %p\n", block);
+    if (!check_block(ptr, "KFREE")) return;
+
+    void *block = (uint8_t *)ptr - HEADER_SIZE;
+    if (is_vmalloc_addr(block)) {
+        profile_free(block, large_block_pages(block) * PAGE_SIZE);
+        mark_free(block, large_block_pages(block) * PAGE_SIZE);
+        large_free(block);
         return;
     }
-    
-    // Mark as free
-    init_block(block, block->size, FREE_MAGIC);
-    block->next = free_list;
-    free_list = block;
-    
-    // Zero out the memory
-    memset(ptr, 0, block->size - sizeof(free_block_t));
+
+    struct page* page = virt_to_page(block);
+    if (!page || !(page->flags & PG_SLAB)) {
+        kprintf(ERROR, "[KFREE] %p was not allocated by kmalloc\n", ptr);
+        return;
+    }
+
+    slab_free_block(page, block);
+}
+
+struct kmem_cache* kmem_cache_create(const char* name, size_t size, void (*ctor)(void*)) {
+    size_t block_size = ALIGN_UP(size + HEADER_SIZE + REDZONE_SIZE, ALIGNMENT);
+    if (size == 0 || block_size > (PAGE_SIZE << MAX_SLAB_ORDER)) {
+        kprintf(ERROR, "[KMALLOC] Cannot create cache %s for %u byte objects\n", name, size);
+        return NULL;
+    }
+
+    kmem_cache_t* cache = kmalloc_uninit(sizeof(kmem_cache_t));
+    if (!cache) {
+        kprintf(ERROR, "[KMALLOC] Failed to allocate cache %s\n", name);
+        return NULL;
+    }
+
+    cache_init(cache, name, size, block_size, ctor);
+    kprintf(INFO, "[KMALLOC] Created cache %s: %u byte objects, %u per slab\n",
+            name, (uint32_t)size, cache->objects);
+    return cache;
+}
+
+void* kmem_cache_alloc(struct kmem_cache* cache) {
+    void *block = cache_alloc(cache);
+    if (!block) {
+        kprintf(ERROR, "[KMALLOC] Out of memory in cache %s\n", cache->name);
+        return NULL;
+    }
+
+    profile_alloc(block, cache->object_size, cache->size, CALLER);
+    void *ptr = mark_allocated(block, cache->size, cache->object_size);
+    if (cache->ctor) {
+        cache->ctor(ptr);
+    }
+    return ptr;
+}
+
+void kmem_cache_free(struct kmem_cache* cache, void* ptr) {
+    if (!ptr) return;
+
+    if (!check_block(ptr, "KMEM_CACHE_FREE")) return;
+
+    void *block = (uint8_t *)ptr - HEADER_SIZE;
+    struct page* page = is_vmalloc_addr(block) ? NULL : virt_to_page(block);
+    if (!page || !(page->flags & PG_SLAB) || page->private != cache) {
+        kprintf(ERROR, "[KMEM_CACHE_FREE] %p does not belong to cache %s\n", ptr, cache->name);
+        return;
+    }
+
+    slab_free_block(page, block);
+}
+
+void kmem_cache_destroy(struct kmem_cache* cache) {
+    if (!cache) return;
+
+    uint64_t irq_flags = irq_save();
+    if (cache->active) {
+        irq_restore(irq_flags);
+        kprintf(ERROR, "[KMALLOC] Cannot destroy cache %s with %u objects in use\n",
+                cache->name, (uint32_t)cache->active);
+        return;
+    }
+
+    // With nothing handed out every slab is empty and on the partial list
+    while (cache->partial) {
+        release_slab(cache, cache->partial);
+    }
+    for (kmem_cache_t** link = &cache_list; *link; link = &(*link)->next) {
+        if (*link == cache) {
+            *link = cache->next;
+            break;
+        }
+    }
+    irq_restore(irq_flags);
+
+    kfree(cache);
+}
+
+static uint64_t kmalloc_active_blocks(void) {
+    uint64_t active = 0;
+    for (kmem_cache_t* cache = cache_list; cache; cache = cache->next) {
+        active += cache->active;
+    }
+    return active;
+}
+
+void kmalloc_get_stats(struct kmalloc_stats* stats) {
+    uint64_t irq_flags = irq_save();
+    stats->slabs = 0;
+    stats->slab_pages = 0;
+    stats->active = 0;
+    for (kmem_cache_t* cache = cache_list; cache; cache = cache->next) {
+        stats->slabs += cache->slabs;
+        stats->slab_pages += cache->slabs << cache->order;
+        stats->active += cache->active;
+    }
+    stats->large_pages = large_pages;
+    irq_restore(irq_flags);
+}
+
+size_t kmem_cache_get_stats(struct kmem_cache_stats* stats, size_t max) {
+    size_t count = 0;
+    uint64_t irq_flags = irq_save();
+    for (kmem_cache_t* cache = cache_list; cache && count < max; cache = cache->next) {
+        stats[count].name = cache->name;
+        stats[count].object_size = cache->object_size;
+        stats[count].objects_per_slab = cache->objects;
+        stats[count].active = cache->active;
+        stats[count].allocs = cache->allocs;
+        stats[count].slabs = cache->slabs;
+        stats[count].slab_pages = cache->slabs << cache->order;
+        count++;
+    }
+    irq_restore(irq_flags);
+    return count;
+}
+
+size_t kmalloc_get_sites(struct kmalloc_site* sites, size_t max) {
+    size_t count = 0;
+#if KMALLOC_PROFILE
+    uint64_t irq_flags = irq_save();
+    for (uint32_t slot = 0; slot < PROFILE_SITES && count < max; slot++) {
+        if (profile_sites[slot].allocs) {
+            sites[count++] = profile_sites[slot];
+        }
+    }
+    irq_restore(irq_flags);
+#else
+    (void)sites;
+    (void)max;
+#endif
+    return count;
 }
 
 // Test different allocation sizes
@@ -168,6 +831,10 @@ void kfree(void *ptr) {
 // Test memory corruption detection
 void kmalloc_test_corruption(void) {
     kprintf(INFO, "[KMALLOC] Starting memory corruption tests...\n");
+#if KMALLOC_HARDENING < 2
+    kprintf(INFO, "[KMALLOC] Skipped: built with KMALLOC_HARDENING=%d\n", KMALLOC_HARDENING);
+#else
+    uint64_t active_before = kmalloc_active_blocks();
     
     // Test 1: Basic allocation
     void* ptr = kmalloc(64);
@@ -177,7 +844,7 @@ void kmalloc_test_corruption(void) {
     }
     
     // Test 2: Corrupt magic number
-    free_block_t *block = (free_block_t *)ptr - 1;
+    block_header_t *block = (block_header_t *)ptr - 1;
     uint32_t original_magic = block->magic;
     block->magic = 0x12345678;
     kfree(ptr);  // Should detect corruption
@@ -197,7 +864,7 @@ void kmalloc_test_corruption(void) {
         kprintf(ERROR, "[KMALLOC] Test failed: Allocation for guard test failed\n");
         return;
     }
-    block = (free_block_t *)ptr - 1;
+    block = (block_header_t *)ptr - 1;
     uint32_t original_guard = block->guard;
     block->guard = 0x87654321;
     kfree(ptr);  // Should detect corruption
@@ -217,7 +884,7 @@ void kmalloc_test_corruption(void) {
         kprintf(ERROR, "[KMALLOC] Test failed: Allocation for checksum test failed\n");
         return;
     }
-    block = (free_block_t *)ptr - 1;
+    block = (block_header_t *)ptr - 1;
     uint32_t original_checksum = block->checksum;
     block->checksum = 0xAAAAAAAA;
     kfree(ptr);  // Should detect corruption
@@ -238,12 +905,41 @@ void kmalloc_test_corruption(void) {
     }
     kfree(ptr);
     kfree(ptr);  // Should detect double free
-    kprintf(SUCCESS, "[KMALLOC] Double free detection test passed\n");
+    block = (block_header_t *)ptr - 1;
+    if (block->magic == FREE_MAGIC) {
+        kprintf(SUCCESS, "[KMALLOC] Double free detection test passed\n");
+    } else {
+        kprintf(ERROR, "[KMALLOC] Double free detection test failed\n");
+    }
     
-    // Reinitialize the heap to ensure clean state
-    kmalloc_init();
+    // Test 6: Redzone overflow detection
+    ptr = kmalloc(40);
+    if (!ptr) {
+        kprintf(ERROR, "[KMALLOC] Test failed: Allocation for redzone test failed\n");
+        return;
+    }
+    ((uint8_t *)ptr)[40] = 0;
+    kfree(ptr);  // Should detect the overflow
+    block = (block_header_t *)ptr - 1;
+    if (block->magic == ALLOC_MAGIC) {
+        kprintf(SUCCESS, "[KMALLOC] Redzone overflow test passed\n");
+    } else {
+        kprintf(ERROR, "[KMALLOC] Redzone overflow test failed\n");
+    }
+    // Restore and properly free
+    ((uint8_t *)ptr)[40] = REDZONE_BYTE;
+    kfree(ptr);
+
+    // Every block from the tests should be back in its cache
+    if (kmalloc_active_blocks() == active_before) {
+        kprintf(SUCCESS, "[KMALLOC] Leak check passed\n");
+    } else {
+        kprintf(ERROR, "[KMALLOC] Leak check failed: %u blocks still in use\n",
+                kmalloc_active_blocks() - active_before);
+    }
     
     kprintf(INFO, "[KMALLOC] Memory corruption tests completed\n");
+#endif
 }
 
 // Test heap functionality
@@ -251,15 +947,11 @@ void kmalloc_test_heap(void) {
     kprintf(INFO, "[KMALLOC] Starting heap tests...\n");
     
     // Verify heap is initialized
-    if (!free_list) {
+    if (!kmalloc_ready) {
         kprintf(ERROR, "[KMALLOC] Heap not initialized!\n");
         return;
     }
-    
-    if (!verify_block(free_list)) {
-        kprintf(ERROR, "[KMALLOC] Initial free block corrupted!\n");
-        return;
-    }
+    uint64_t active_before = kmalloc_active_blocks();
 
     // Test 1: Basic allocations
     kprintf(INFO, "[KMALLOC] Testing basic allocations...\n");
@@ -309,11 +1001,47 @@ void kmalloc_test_heap(void) {
         return;
     }
     kprintf(INFO, "[KMALLOC] Reallocation successful: %p\n", ptr4);
+    if (ptr4 != ptr2) {
+        kprintf(ERROR, "[KMALLOC] Freed block was not reused by its size class\n");
+    }
+
+    // Test 4: Page-level allocation
+    void* ptr5 = kmalloc(HUGE_SIZE);
+    if (!ptr5 || (uintptr_t)ptr5 % 16 != 0 || !is_vmalloc_addr(ptr5)) {
+        kprintf(ERROR, "[KMALLOC] Huge allocation failed!\n");
+    } else {
+        kprintf(INFO, "[KMALLOC] Huge (%d bytes): %p\n", HUGE_SIZE, ptr5);
+        kfree(ptr5);
+    }
+
+    // Test 5: Resizing keeps the contents
+    uint8_t* grown = kmalloc_uninit(100);
+    for (int i = 0; grown && i < 100; i++) {
+        grown[i] = (uint8_t)i;
+    }
+    grown = krealloc(grown, 3 * PAGE_SIZE);
+    grown = krealloc(grown, 6 * PAGE_SIZE);
+    bool intact = grown != NULL;
+    for (int i = 0; intact && i < 100; i++) {
+        intact = grown[i] == (uint8_t)i;
+    }
+    if (intact) {
+        kprintf(INFO, "[KMALLOC] Reallocation test passed: %p\n", grown);
+    } else {
+        kprintf(ERROR, "[KMALLOC] Reallocation test failed\n");
+    }
+    kfree(grown);
 
     // Cleanup
     kfree(ptr1);
     kfree(ptr3);
     kfree(ptr4);
+
+    if (kmalloc_active_blocks() != active_before) {
+        kprintf(ERROR, "[KMALLOC] Leak check failed: %u blocks still in use\n",
+                kmalloc_active_blocks() - active_before);
+        return;
+    }
     
     kprintf(INFO, "[KMALLOC] Basic heap tests completed successfully\n");
 }
@@ -1,189 +1,773 @@
 #include "kernel/mm/pmm.h"
+#include "kernel/mm/vmm.h"
+#include "kernel/mm/vmalloc.h"
 #include "kernel/kprintf.h"
 #include "kernel/sync.h"
+#include "kernel/mm/shrinker.h"
+#include "multiboot2/multiboot2_parser.h"
+#include "string.h"
 
-#define MIN_ORDER 12  // 4KB minimum block size
-#define MAX_ORDER 20  // 1MB maximum block size
-#define BLOCK_MAGIC 0xCAFEBABE
-#define PAGE_SHIFT 12  // 4KB pages
-#define PAGE_SIZE (1 << PAGE_SHIFT)
-
-typedef struct Block {
-    struct Block* next;
-    uint64_t order;    // Size of this block (2^order bytes)
-    uint32_t magic;    // Magic number for corruption detection
-} Block;
-
-static Block** free_lists;
-static uint8_t* memory_pool;
-static uint64_t total_memory;
+#define LOW_MEMORY_END 0x100000          // Leave the BIOS/real-mode area alone
+#define IDENTITY_MAP_END (1ull << 30)    // loader.asm identity-maps the first 1GB
+#define MAX_RESERVED_RANGES 4
+
+#define PCP_CPUS 1      // Only the boot CPU runs kernel code today
+#define PCP_BATCH 16    // Frames moved per refill or drain
+#define PCP_HIGH 64     // Drain once a cache holds more than this
+
+#define ZERO_POOL_TARGET 256  // Keep 1MB of frames zeroed ahead of time
+#define ZERO_POOL_BATCH 8     // Frames cleared per idle refill
+#define FAULT_RESERVE_TARGET 32  // Zeroed frames held back for the page fault path
+
+#define SHRINK_RETRIES 2      // Shrink-and-retry passes before failing
+
+#define COMPACT_ORDER 9                          // Compaction rebuilds 2 MB blocks
+#define COMPACT_PAGES (1u << COMPACT_ORDER)
+#define COMPACT_MAX_MIGRATE ((int)COMPACT_PAGES / 4)  // Leave busier blocks alone
+#define COMPACT_MAX_TRIES 4                      // Blocks attempted per run
+#define COMPACT_MAX_DEFER 6                      // Idle back-off of up to 2^6 calls
+
+#define PAGE_ALIGN_UP(x) (((x) + PAGE_SIZE - 1) & ~((uint64_t)PAGE_SIZE - 1))
+#define PAGE_ALIGN_DOWN(x) ((x) & ~((uint64_t)PAGE_SIZE - 1))
+
+// A physical range handed to the allocator
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+} PhysRange;
+
+// Doubly linked list of free blocks of one order
+typedef struct {
+    struct page* head;
+    uint64_t count;
+} FreeArea;
+
+// Per-CPU stack of order-0 frames, linked through page->next
+typedef struct {
+    struct page* head;
+    uint32_t count;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t refills;
+    uint64_t drains;
+} PageCache;
+
+static FreeArea free_areas[MAX_ORDER + 1];
+static PageCache page_caches[PCP_CPUS];
+
+// Frames cleared ahead of time, linked through page->next. Pooled frames
+// carry only PG_ZEROED, so free_pages turns them away; whatever takes one
+// out marks it PG_ALLOCATED.
+static struct page* zero_pool = NULL;
+static uint32_t zero_pool_count = 0;
+static struct zero_pool_stats zero_stats;
+
+// Zeroed frames only alloc_atomic_page may take, linked through page->next.
+// Unlike the zero pool they are never shrunk away.
+static struct page* fault_reserve = NULL;
+static uint32_t fault_reserve_count = 0;
+
+static struct shrinker pcp_shrinker;
+static struct shrinker zero_pool_shrinker;
+static struct page* mem_map = NULL;
+static uint64_t max_pfn = 0;
+static PhysRange reserved_ranges[MAX_RESERVED_RANGES];
+static uint32_t reserved_range_count = 0;
 static mutex_t buddy_mutex;
 static uint64_t total_pages = 0;
 static uint64_t used_pages = 0;
+static struct compact_stats compact_stats;
+static uint32_t compact_defer_shift = 0;  // Idle calls to skip grow as 2^shift
+static uint32_t compact_defer_count = 0;
+
+struct page* phys_to_page(uintptr_t phys) {
+    uint64_t pfn = phys >> PAGE_SHIFT;
+    if (pfn >= max_pfn) {
+        return NULL;
+    }
+    return &mem_map[pfn];
+}
+
+uintptr_t page_to_phys(struct page* page) {
+    return (uintptr_t)(page - mem_map) << PAGE_SHIFT;
+}
+
+static void free_area_add(struct page* page, uint32_t order) {
+    FreeArea* area = &free_areas[order];
+    page->order = order;
+    page->flags = PG_FREE;
+    page->prev = NULL;
+    page->next = area->head;
+    if (area->head) {
+        area->head->prev = page;
+    }
+    area->head = page;
+    area->count++;
+}
+
+static void free_area_remove(struct page* page, uint32_t order) {
+    FreeArea* area = &free_areas[order];
+    if (page->prev) {
+        page->prev->next = page->next;
+    } else {
+        area->head = page->next;
+    }
+    if (page->next) {
+        page->next->prev = page->prev;
+    }
+    page->next = page->prev = NULL;
+    page->flags &= ~PG_FREE;
+    area->count--;
+}
+
+static void reserve_range(uint64_t start, uint64_t end) {
+    if (reserved_range_count >= MAX_RESERVED_RANGES) {
+        kprintf(ERROR, "Too many reserved ranges, ignoring %p-%p\n", start, end);
+        return;
+    }
+    reserved_ranges[reserved_range_count].start = PAGE_ALIGN_DOWN(start);
+    reserved_ranges[reserved_range_count].end = PAGE_ALIGN_UP(end);
+    reserved_range_count++;
+}
+
+static bool overlaps_reserved(uint64_t start, uint64_t end) {
+    for (uint32_t i = 0; i < reserved_range_count; i++) {
+        if (reserved_ranges[i].start < end && reserved_ranges[i].end > start) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Clip an available memory map region to what the allocator may use
+static bool clip_region(const struct memory_region* region, uint64_t* start, uint64_t* end) {
+    if (region->type != MULTIBOOT_MEMORY_AVAILABLE) {
+        return false;
+    }
 
-void buddy_init(uintptr_t mem_start, uint64_t mem_size) {
+    *start = region->base;
+    *end = region->base + region->length;
+
+    // Allocated frames are handed out through the direct map
+    if (*start < LOW_MEMORY_END) *start = LOW_MEMORY_END;
+    if (*end > DIRECT_MAP_SIZE) *end = DIRECT_MAP_SIZE;
+
+    *start = PAGE_ALIGN_UP(*start);
+    *end = PAGE_ALIGN_DOWN(*end);
+    return *start < *end;
+}
+
+// Find a physical range below `limit` for early boot data that avoids
+// every reservation
+static uint64_t find_boot_memory(const struct memory_region* regions, uint32_t count, uint64_t size,
+                                 uint64_t limit) {
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t start, end;
+        if (!clip_region(&regions[i], &start, &end)) {
+            continue;
+        }
+        if (end > limit) end = limit;
+
+        // Candidates are the region start and the end of every reservation
+        for (uint32_t j = 0; j <= reserved_range_count; j++) {
+            uint64_t candidate = j < reserved_range_count ? reserved_ranges[j].end : start;
+            if (candidate < start || candidate + size > end) {
+                continue;
+            }
+            if (!overlaps_reserved(candidate, candidate + size)) {
+                return candidate;
+            }
+        }
+    }
+    return 0;
+}
+
+// Split [start, end) into the largest naturally aligned blocks and free them
+static void seed_free_blocks(uint64_t start, uint64_t end) {
+    uint64_t pfn = start >> PAGE_SHIFT;
+    uint64_t end_pfn = end >> PAGE_SHIFT;
+
+    while (pfn < end_pfn) {
+        uint32_t order = MAX_ORDER;
+        while (order > 0 && ((pfn & ((1ull << order) - 1)) || pfn + (1ull << order) > end_pfn)) {
+            order--;
+        }
+
+        for (uint64_t i = 0; i < (1ull << order); i++) {
+            mem_map[pfn + i].flags = 0;
+        }
+        free_area_add(&mem_map[pfn], order);
+
+        pfn += 1ull << order;
+    }
+}
+
+// Add [start, end) minus every reserved range from index `first` onwards
+static void add_usable_range(uint64_t start, uint64_t end, uint32_t first) {
+    for (uint32_t i = first; i < reserved_range_count; i++) {
+        PhysRange* reserved = &reserved_ranges[i];
+        if (reserved->start < end && reserved->end > start) {
+            if (start < reserved->start) {
+                add_usable_range(start, reserved->start, i + 1);
+            }
+            if (reserved->end < end) {
+                add_usable_range(reserved->end, end, i + 1);
+            }
+            return;
+        }
+    }
+
+    if (start >= end) return;
+
+    total_pages += (end - start) / PAGE_SIZE;
+    seed_free_blocks(start, end);
+}
+
+void buddy_init(uintptr_t kernel_end) {
     mutex_init(&buddy_mutex, "buddy_mutex");
     
-    total_memory = mem_size;
-    total_pages = mem_size / PAGE_SIZE;
+    total_pages = 0;
     used_pages = 0;
+    reserved_range_count = 0;
     
-    // Initialize free lists
-    free_lists = (Block**)mem_start;
-    for (uint64_t i = 0; i <= MAX_ORDER; i++) {
-        free_lists[i] = NULL;
+    for (uint32_t i = 0; i <= MAX_ORDER; i++) {
+        free_areas[i].head = NULL;
+        free_areas[i].count = 0;
     }
-    
-    // Calculate memory pool start (aligned to MAX_ORDER)
-    uint64_t pool_start = (uint64_t)mem_start + sizeof(Block*) * (MAX_ORDER + 1);
-    pool_start = (pool_start + (1ull << MAX_ORDER) - 1) & ~((1ull << MAX_ORDER) - 1);
-    memory_pool = (uint8_t*)pool_start;
-    
-    // Initialize the initial free block
-    uint64_t initial_order = MAX_ORDER;
-    while ((1ull << initial_order) > mem_size) {
-        initial_order--;
+    memset(page_caches, 0, sizeof(page_caches));
+    zero_pool = NULL;
+    zero_pool_count = 0;
+    memset(&zero_stats, 0, sizeof(zero_stats));
+
+    // Kernel image and the boot information we still read from
+    uintptr_t info_start, info_end;
+    multiboot2_get_info_range(&info_start, &info_end);
+    reserve_range(LOW_MEMORY_END, kernel_end);
+    reserve_range(info_start, info_end);
+
+    uint32_t region_count;
+    const struct memory_region* regions = multiboot2_get_memory_map(&region_count);
+
+    max_pfn = 0;
+    for (uint32_t i = 0; i < region_count; i++) {
+        uint64_t start, end;
+        if (clip_region(&regions[i], &start, &end) && (end >> PAGE_SHIFT) > max_pfn) {
+            max_pfn = end >> PAGE_SHIFT;
+        }
     }
-    
-    Block* initial_block = (Block*)memory_pool;
-    initial_block->next = NULL;
-    initial_block->order = initial_order;
-    initial_block->magic = BLOCK_MAGIC;
-    
-    free_lists[initial_order] = initial_block;
-    
-    kprintf(INFO, "Buddy allocator initialized with %d MB of memory\n", mem_size >> 20);
-}
 
-void* buddy_alloc(size_t size) {
-    if (size == 0 || size > (1ull << MAX_ORDER)) {
-        kprintf(ERROR, "Invalid allocation size: %u\n", size);
-        return NULL;
+    // Map all RAM at DIRECT_MAP_BASE. Until that is done only the identity
+    // mapped first 1GB is reachable, so the page tables must come from there.
+    uint32_t ranges = 0;
+    for (uint32_t i = 0; i < region_count; i++) {
+        uint64_t start, end;
+        ranges += clip_region(&regions[i], &start, &end);
     }
-    
-    mutex_acquire(&buddy_mutex);
-    
-    // Calculate required order
-    uint64_t order = MIN_ORDER;
-    while ((1ull << order) < size + sizeof(Block)) {
-        order++;
+    uint64_t pool_size = direct_map_tables_needed(max_pfn << PAGE_SHIFT, ranges);
+    uintptr_t pool_start = find_boot_memory(regions, region_count, pool_size, IDENTITY_MAP_END);
+    uintptr_t pool = pool_start;
+    for (uint32_t i = 0; pool_start && i < region_count; i++) {
+        uint64_t start, end;
+        if (clip_region(&regions[i], &start, &end) &&
+            !direct_map_range(start, end, &pool, pool_start + pool_size)) {
+            pool_start = 0;
+        }
+    }
+    if (!pool_start) {
+        kprintf(FATAL, "No room for %d KB of direct map page tables\n", pool_size >> 10);
+        return;
+    }
+    // Keep only the tables actually used
+    reserve_range(pool_start, pool);
+
+    // Place the page metadata array in the first hole that fits it
+    uint64_t map_size = PAGE_ALIGN_UP(max_pfn * sizeof(struct page));
+    uint64_t map_phys = find_boot_memory(regions, region_count, map_size, DIRECT_MAP_SIZE);
+    if (!map_phys) {
+        kprintf(FATAL, "No room for %d KB of page metadata\n", map_size >> 10);
+        return;
+    }
+    reserve_range(map_phys, map_phys + map_size);
+
+    mem_map = phys_to_virt(map_phys);
+    memset(mem_map, 0, max_pfn * sizeof(struct page));
+    for (uint64_t pfn = 0; pfn < max_pfn; pfn++) {
+        mem_map[pfn].flags = PG_RESERVED;
     }
+
+    for (uint32_t i = 0; i < region_count; i++) {
+        uint64_t start, end;
+        if (clip_region(&regions[i], &start, &end)) {
+            add_usable_range(start, end, 0);
+        }
+    }
+    
+    // Drained last, so frames released by other caches can coalesce
+    register_shrinker(&pcp_shrinker);
+    register_shrinker(&zero_pool_shrinker);
     
+    kprintf(INFO, "Buddy allocator initialized with %d MB of memory, %d KB of page metadata, "
+            "%d KB of direct map tables\n",
+            (total_pages * PAGE_SIZE) >> 20, map_size >> 10, (pool - pool_start) >> 10);
+}
+
+// Take a block of the given order from the free lists; buddy_mutex must be held
+static struct page* rmqueue(uint32_t order) {
     // Find a suitable block
-    uint64_t current_order = order;
-    while (current_order <= MAX_ORDER && !free_lists[current_order]) {
+    uint32_t current_order = order;
+    while (current_order <= MAX_ORDER && !free_areas[current_order].head) {
         current_order++;
     }
     
     if (current_order > MAX_ORDER) {
-        kprintf(ERROR, "No suitable block found for size %u\n", size);
-        mutex_release(&buddy_mutex);
         return NULL;
     }
     
-    // Split blocks until we get the right size
-    Block* block = free_lists[current_order];
-    free_lists[current_order] = block->next;
+    struct page* page = free_areas[current_order].head;
+    free_area_remove(page, current_order);
     
+    // Split blocks until we get the right size, freeing the upper halves
     while (current_order > order) {
         current_order--;
-        
-        // Create buddy block
-        Block* buddy = (Block*)((uint8_t*)block + (1ull << current_order));
-        buddy->next = free_lists[current_order];
-        buddy->order = current_order;
-        buddy->magic = BLOCK_MAGIC;
-        free_lists[current_order] = buddy;
-        
-        // Update current block
-        block->order = current_order;
+        free_area_add(page + (1ull << current_order), current_order);
     }
     
-    // Mark block as allocated
-    block->magic = ~BLOCK_MAGIC;
+    page->order = order;
+    page->flags = PG_ALLOCATED;
+    return page;
+}
+
+// Return a block to the free lists, merging buddies; buddy_mutex must be held
+static void free_one_block(struct page* page, uint32_t order) {
+    uint64_t pfn = page - mem_map;
+    page->flags = 0;
+    
+    // Merge with the buddy while it is a free block of the same order
+    while (order < MAX_ORDER) {
+        uint64_t buddy_pfn = pfn ^ (1ull << order);
+        if (buddy_pfn >= max_pfn) {
+            break;
+        }
+
+        struct page* buddy = &mem_map[buddy_pfn];
+        if (!(buddy->flags & PG_FREE) || buddy->order != order) {
+            break;
+        }
 
-    used_pages += (1ULL << block->order) / PAGE_SIZE;
+        free_area_remove(buddy, order);
+        pfn &= ~(1ull << order);
+        order++;
+    }
     
+    free_area_add(&mem_map[pfn], order);
+}
+
+static PageCache* this_cpu_cache(void) {
+    return &page_caches[0];
+}
+
+// Move up to PCP_BATCH frames from the buddy core into a cache
+static void pcp_refill(PageCache* pcp) {
+    bool added = false;
+    mutex_acquire(&buddy_mutex);
+    for (uint32_t i = 0; i < PCP_BATCH; i++) {
+        struct page* page = rmqueue(0);
+        if (!page) {
+            break;
+        }
+        page->flags = PG_PCP;
+        page->next = pcp->head;
+        pcp->head = page;
+        pcp->count++;
+        added = true;
+    }
     mutex_release(&buddy_mutex);
-    return (void*)((uint8_t*)block + sizeof(Block));
+    if (added) {
+        pcp->refills++;
+    }
 }
 
-void buddy_free(void* ptr) {
-    if (!ptr) return;
-    
+// Hand up to `count` frames from a cache back to the buddy core
+static void pcp_drain(PageCache* pcp, uint32_t count) {
     mutex_acquire(&buddy_mutex);
+    while (count-- && pcp->head) {
+        struct page* page = pcp->head;
+        pcp->head = page->next;
+        pcp->count--;
+        page->next = NULL;
+        free_one_block(page, 0);
+    }
+    mutex_release(&buddy_mutex);
+    pcp->drains++;
+}
+
+static struct page* pcp_alloc(void) {
+    uint64_t irq_flags = irq_save();
+    PageCache* pcp = this_cpu_cache();
+
+    if (pcp->head) {
+        pcp->hits++;
+    } else {
+        pcp->misses++;
+        pcp_refill(pcp);
+    }
+
+    struct page* page = pcp->head;
+    if (page) {
+        pcp->head = page->next;
+        pcp->count--;
+        page->next = NULL;
+        page->order = 0;
+        page->flags = PG_ALLOCATED;
+        used_pages++;
+    }
+
+    irq_restore(irq_flags);
+    return page;
+}
+
+static void pcp_free(struct page* page) {
+    uint64_t irq_flags = irq_save();
+    PageCache* pcp = this_cpu_cache();
+
+    page->flags = PG_PCP;
+    page->next = pcp->head;
+    pcp->head = page;
+    pcp->count++;
+    used_pages--;
+
+    if (pcp->count > PCP_HIGH) {
+        pcp_drain(pcp, PCP_BATCH);
+    }
+
+    irq_restore(irq_flags);
+}
+
+struct page* try_alloc_pages(uint32_t order) {
+    // Single frames come from the per-CPU cache without the global lock
+    if (order == 0) {
+        return pcp_alloc();
+    }
     
-    Block* block = (Block*)((uint8_t*)ptr - sizeof(Block));
+    mutex_acquire(&buddy_mutex);
+    struct page* page = rmqueue(order);
+    if (page) {
+        used_pages += 1ull << order;
+    }
+    mutex_release(&buddy_mutex);
+    return page;
+}
+
+struct page* alloc_pages(uint32_t order) {
+    if (order > MAX_ORDER) {
+        kprintf(ERROR, "Invalid allocation order: %u\n", order);
+        return NULL;
+    }
+
+    struct page* page = try_alloc_pages(order);
+
+    // Let registered caches give memory back before failing
+    for (uint32_t attempt = 0; !page && attempt < SHRINK_RETRIES; attempt++) {
+        if (!shrink_caches(1ull << order)) {
+            break;
+        }
+        page = try_alloc_pages(order);
+    }
+
+    if (!page) {
+        kprintf(ERROR, "No suitable block found for order %u\n", order);
+    }
+    return page;
+}
+
+void free_pages(struct page* page) {
+    if (!page) return;
     
-    // Check for corruption
-    if (block->magic != ~BLOCK_MAGIC) {
-        kprintf(ERROR, "Invalid block magic: %x\n", block->magic);
-        mutex_release(&buddy_mutex);
+    // Check for double frees and pointers into the middle of a block
+    if (!(page->flags & PG_ALLOCATED)) {
+        kprintf(ERROR, "Freeing page %p that is not allocated (flags 0x%x)\n",
+                page_to_phys(page), page->flags);
         return;
     }
     
-    uint64_t order = block->order;
-    used_pages -= (1ULL << (order - PAGE_SHIFT));  // Calculate size from order
-    
-    // Try to merge with buddy blocks
-    while (order < MAX_ORDER) {
-        uint64_t block_size = 1ull << order;
-        uint64_t buddy_addr = (uint64_t)block ^ block_size;
-        
-        // Check if buddy is in our memory pool
-        if (buddy_addr < (uint64_t)memory_pool || 
-            buddy_addr >= (uint64_t)memory_pool + total_memory) {
-            break;
+    uint32_t order = page->order;
+    if (order == 0) {
+        pcp_free(page);
+        return;
+    }
+
+    mutex_acquire(&buddy_mutex);
+    used_pages -= 1ull << order;
+    free_one_block(page, order);
+    mutex_release(&buddy_mutex);
+}
+
+void get_page(struct page* page) {
+    uint64_t irq_flags = irq_save();
+    if (!(page->flags & PG_SHARED)) {
+        page->flags |= PG_SHARED;
+        page->inuse = 1;
+    }
+    page->inuse++;
+    irq_restore(irq_flags);
+}
+
+bool put_page_testzero(struct page* page) {
+    uint64_t irq_flags = irq_save();
+    bool last = !(page->flags & PG_SHARED);
+    if (!last && --page->inuse == 1) {
+        page->flags &= ~PG_SHARED;  // Back to a single owner
+    }
+    irq_restore(irq_flags);
+    return last;
+}
+
+void drain_page_caches(void) {
+    for (uint32_t cpu = 0; cpu < PCP_CPUS; cpu++) {
+        uint64_t irq_flags = irq_save();
+        if (page_caches[cpu].count) {
+            pcp_drain(&page_caches[cpu], page_caches[cpu].count);
         }
-        
-        Block* buddy = (Block*)buddy_addr;
-        
-        // Check if buddy is free and same order
-        if (buddy->magic != BLOCK_MAGIC || buddy->order != order) {
-            break;
+        irq_restore(irq_flags);
+    }
+}
+
+static size_t pcp_shrink_count(void) {
+    size_t count = 0;
+    for (uint32_t cpu = 0; cpu < PCP_CPUS; cpu++) {
+        count += page_caches[cpu].count;
+    }
+    return count;
+}
+
+// Cached frames are already free; draining lets them coalesce into larger blocks
+static size_t pcp_shrink_scan(size_t nr_pages) {
+    size_t drained = 0;
+    for (uint32_t cpu = 0; cpu < PCP_CPUS && drained < nr_pages; cpu++) {
+        uint64_t irq_flags = irq_save();
+        uint32_t count = page_caches[cpu].count;
+        if (count > nr_pages - drained) {
+            count = nr_pages - drained;
+        }
+        if (count) {
+            pcp_drain(&page_caches[cpu], count);
+            drained += count;
+        }
+        irq_restore(irq_flags);
+    }
+    return drained;
+}
+
+static struct shrinker pcp_shrinker = {
+    .name = "pcp",
+    .count = pcp_shrink_count,
+    .scan = pcp_shrink_scan,
+};
+
+void get_pcp_stats(struct pcp_stats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    for (uint32_t cpu = 0; cpu < PCP_CPUS; cpu++) {
+        stats->hits += page_caches[cpu].hits;
+        stats->misses += page_caches[cpu].misses;
+        stats->refills += page_caches[cpu].refills;
+        stats->drains += page_caches[cpu].drains;
+        stats->count += page_caches[cpu].count;
+    }
+}
+
+void refill_zero_pool(void) {
+    if (!mem_map) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < ZERO_POOL_BATCH &&
+         (fault_reserve_count < FAULT_RESERVE_TARGET || zero_pool_count < ZERO_POOL_TARGET); i++) {
+        // Quietly stop when memory runs low
+        struct page* page = pcp_alloc();
+        if (!page) {
+            return;
         }
-        
-        // Remove buddy from free list
-        Block* prev = NULL;
-        Block* curr = free_lists[order];
-        while (curr && curr != buddy) {
-            prev = curr;
-            curr = curr->next;
-        }
-        
-        if (!curr) break;
-        
-        if (prev) {
-            prev->next = curr->next;
+
+        // Clear with interrupts enabled; only the list update is protected
+        memset(page_address(page), 0, PAGE_SIZE);
+
+        // The fault reserve is topped up first
+        uint64_t irq_flags = irq_save();
+        page->flags = PG_ZEROED;
+        if (fault_reserve_count < FAULT_RESERVE_TARGET) {
+            page->next = fault_reserve;
+            fault_reserve = page;
+            fault_reserve_count++;
         } else {
-            free_lists[order] = curr->next;
+            page->next = zero_pool;
+            zero_pool = page;
+            zero_pool_count++;
         }
-        
-        // Merge blocks
-        if (block > buddy) {
-            block = buddy;
+        zero_stats.zeroed++;
+        used_pages--;
+        irq_restore(irq_flags);
+    }
+}
+
+struct page* alloc_zeroed_page(void) {
+    uint64_t irq_flags = irq_save();
+    struct page* page = zero_pool;
+    if (page) {
+        zero_pool = page->next;
+        zero_pool_count--;
+        zero_stats.hits++;
+        used_pages++;
+        page->next = NULL;
+        page->flags = PG_ALLOCATED;
+    } else {
+        zero_stats.misses++;
+    }
+    irq_restore(irq_flags);
+
+    if (!page) {
+        page = alloc_pages(0);
+        if (page) {
+            memset(page_address(page), 0, PAGE_SIZE);
         }
-        order++;
-        block->order = order;
     }
-    
-    // Add block to free list
-    block->magic = BLOCK_MAGIC;
-    block->next = free_lists[order];
-    free_lists[order] = block;
-    
+    return page;
+}
+
+struct page* alloc_atomic_page(void) {
+    uint64_t irq_flags = irq_save();
+    bool reserved = fault_reserve != NULL;
+    struct page* page = reserved ? fault_reserve : zero_pool;
+    if (page) {
+        if (reserved) {
+            fault_reserve = page->next;
+            fault_reserve_count--;
+        } else {
+            zero_pool = page->next;
+            zero_pool_count--;
+        }
+        used_pages++;
+        page->next = NULL;
+        page->flags = PG_ALLOCATED;
+    } else {
+        zero_stats.reserve_empty++;
+    }
+    irq_restore(irq_flags);
+    return page;
+}
+
+void free_atomic_page(struct page* page) {
+    uint64_t irq_flags = irq_save();
+    page->flags = PG_ZEROED;
+    page->next = fault_reserve;
+    fault_reserve = page;
+    fault_reserve_count++;
+    used_pages--;
+    irq_restore(irq_flags);
+}
+
+static size_t zero_pool_shrink_count(void) {
+    return zero_pool_count;
+}
+
+// Give frames straight back to the buddy core; through free_pages they would
+// only park in the per-CPU cache, out of reach of the allocation that ran
+// the shrinkers unless it is order 0
+static size_t zero_pool_shrink_scan(size_t nr_pages) {
+    struct page* list = NULL;
+    size_t freed = 0;
+    uint64_t irq_flags = irq_save();
+    while (freed < nr_pages && zero_pool) {
+        struct page* page = zero_pool;
+        zero_pool = page->next;
+        zero_pool_count--;
+        page->next = list;
+        list = page;
+        freed++;
+    }
+    irq_restore(irq_flags);
+
+    // Pooled frames are not counted in used_pages, so nothing to adjust
+    mutex_acquire(&buddy_mutex);
+    while (list) {
+        struct page* page = list;
+        list = page->next;
+        page->next = NULL;
+        free_one_block(page, 0);
+    }
     mutex_release(&buddy_mutex);
+    return freed;
+}
+
+static struct shrinker zero_pool_shrinker = {
+    .name = "zero-pool",
+    .count = zero_pool_shrink_count,
+    .scan = zero_pool_shrink_scan,
+};
+
+void get_zero_pool_stats(struct zero_pool_stats* stats) {
+    uint64_t irq_flags = irq_save();
+    *stats = zero_stats;
+    stats->count = zero_pool_count;
+    stats->reserve = fault_reserve_count;
+    irq_restore(irq_flags);
+}
+
+void* buddy_alloc(size_t size) {
+    if (size == 0 || size > ((size_t)PAGE_SIZE << MAX_ORDER)) {
+        kprintf(ERROR, "Invalid allocation size: %u\n", size);
+        return NULL;
+    }
+    
+    // Calculate required order
+    uint32_t order = 0;
+    while (((size_t)PAGE_SIZE << order) < size) {
+        order++;
+    }
+
+    struct page* page = alloc_pages(order);
+    return page ? page_address(page) : NULL;
+}
+
+void* buddy_alloc_zeroed(size_t size) {
+    if (size > 0 && size <= PAGE_SIZE) {
+        struct page* page = alloc_zeroed_page();
+        return page ? page_address(page) : NULL;
+    }
+
+    void* ptr = buddy_alloc(size);
+    if (ptr) {
+        memset(ptr, 0, size);
+    }
+    return ptr;
+}
+
+void buddy_free(void* ptr) {
+    if (!ptr) return;
+
+    if ((uintptr_t)ptr & (PAGE_SIZE - 1)) {
+        kprintf(ERROR, "Freeing unaligned frame pointer %p\n", ptr);
+        return;
+    }
+
+    struct page* page = virt_to_page(ptr);
+    if (!page) {
+        kprintf(ERROR, "Freeing frame %p outside of managed memory\n", ptr);
+        return;
+    }
+
+    free_pages(page);
 }
 
 uint64_t get_free_ram(void) {
     uint64_t free_bytes = 0;
     for (int i = 0; i <= MAX_ORDER; i++) {
-        Block* block = free_lists[i];
-        while (block) {
-            free_bytes += (1ULL << (i + PAGE_SHIFT));
-            block = block->next;
-        }
+        free_bytes += free_areas[i].count * ((uint64_t)PAGE_SIZE << i);
+    }
+    for (uint32_t cpu = 0; cpu < PCP_CPUS; cpu++) {
+        free_bytes += (uint64_t)page_caches[cpu].count * PAGE_SIZE;
     }
+    // Pooled frames are taken out of used_pages, so they count as free
+    free_bytes += (uint64_t)(zero_pool_count + fault_reserve_count) * PAGE_SIZE;
     return free_bytes / 1024;  // Convert bytes to KB
 }
 
@@ -194,22 +778,194 @@ uint64_t get_used_ram(void) {
 uint64_t get_fragmented_ram(void) {
     uint64_t fragmented_bytes = 0;
     for (int i = 0; i <= MAX_ORDER; i++) {
-        Block* block = free_lists[i];
-        if (block) {
-            fragmented_bytes += (1ULL << (i + PAGE_SHIFT));
+        if (free_areas[i].head) {
+            fragmented_bytes += ((uint64_t)PAGE_SIZE << i);
         }
     }
     return fragmented_bytes / 1024;  // Convert bytes to KB
 }
 
+/*
+Compaction empties a nearly free 2 MB block by moving the frames still in
+use elsewhere, then frees it whole. Only frames the VMM can move are
+allowed in a candidate block: single order-0 frames behind vmalloc areas,
+large kmalloc blocks among them, or behind map_anonymous ranges such as
+WASM memory. Slab, page table, pooled and multi-page allocations make a
+block ineligible. The block's free parts are taken off the free lists
+first, so no migration target can land back inside it.
+*/
+
+// Frames in use in the 2 MB block at `pfn`, or -1 if the block is free
+// already or holds anything but single allocated frames; buddy_mutex must
+// be held
+static int block_in_use(uint64_t pfn) {
+    int used = 0;
+    for (uint64_t i = 0; i < COMPACT_PAGES;) {
+        struct page* page = &mem_map[pfn + i];
+        if (page->flags & PG_FREE) {
+            if (page->order >= COMPACT_ORDER) {
+                return -1;
+            }
+            i += 1ull << page->order;
+            continue;
+        }
+        if (page->flags != PG_ALLOCATED || page->order != 0) {
+            return -1;
+        }
+        used++;
+        i++;
+    }
+    return used;
+}
+
+static struct page* compact_alloc(void) {
+    return try_alloc_pages(0);
+}
+
+// Move every frame out of the 2 MB block at `pfn` and free it whole.
+// Returns false, leaving the block as it was apart from frames already
+// moved, if something in it could not move.
+static bool compact_block(uint64_t pfn) {
+    struct page* isolated = NULL;
+    mutex_acquire(&buddy_mutex);
+    int used = block_in_use(pfn);
+    if (used > 0 && used <= COMPACT_MAX_MIGRATE) {
+        for (uint64_t i = 0; i < COMPACT_PAGES;) {
+            struct page* page = &mem_map[pfn + i];
+            uint32_t order = page->flags & PG_FREE ? page->order : 0;
+            if (page->flags & PG_FREE) {
+                free_area_remove(page, order);
+                page->flags = PG_ALLOCATED;
+                page->next = isolated;
+                isolated = page;
+                used_pages += 1ull << order;
+            }
+            i += 1ull << order;
+        }
+    }
+    mutex_release(&buddy_mutex);
+    if (!isolated) {
+        return false;
+    }
+
+    size_t moved;
+    uint64_t start = pfn << PAGE_SHIFT;
+    struct page* old = migrate_range(start, start + ((uint64_t)COMPACT_PAGES << PAGE_SHIFT), compact_alloc, &moved);
+    bool whole = moved == (size_t)used;
+
+    if (!whole) {
+        // Something else still holds a frame here: give back what was taken
+        while (old) {
+            struct page* page = old;
+            old = page->next;
+            page->next = NULL;
+            free_pages(page);
+        }
+    }
+
+    mutex_acquire(&buddy_mutex);
+    if (whole) {
+        for (uint64_t i = 0; i < COMPACT_PAGES; i++) {
+            mem_map[pfn + i].flags = 0;
+            mem_map[pfn + i].next = NULL;
+            mem_map[pfn + i].private = NULL;
+            mem_map[pfn + i].freelist = NULL;
+        }
+        used_pages -= COMPACT_PAGES;
+        free_one_block(&mem_map[pfn], COMPACT_ORDER);
+    } else {
+        while (isolated) {
+            struct page* page = isolated;
+            isolated = page->next;
+            page->next = NULL;
+            used_pages -= 1ull << page->order;
+            free_one_block(page, page->order);
+        }
+    }
+    mutex_release(&buddy_mutex);
+
+    uint64_t irq_flags = irq_save();
+    compact_stats.migrated += moved;
+    if (whole) {
+        compact_stats.blocks++;
+    } else {
+        compact_stats.failed++;
+    }
+    irq_restore(irq_flags);
+    return whole;
+}
+
+size_t compact_memory(size_t blocks) {
+    if (!mem_map) {
+        return 0;
+    }
+
+    // Frames parked in the per-CPU caches would pin their blocks
+    drain_page_caches();
+
+    size_t rebuilt = 0;
+    uint32_t tries = 0;
+    for (uint64_t pfn = 0; pfn + COMPACT_PAGES <= max_pfn && rebuilt < blocks && tries < COMPACT_MAX_TRIES;
+         pfn += COMPACT_PAGES) {
+        mutex_acquire(&buddy_mutex);
+        int used = block_in_use(pfn);
+        mutex_release(&buddy_mutex);
+        if (used > 0 && used <= COMPACT_MAX_MIGRATE) {
+            tries++;
+            rebuilt += compact_block(pfn);
+        }
+    }
+
+    uint64_t irq_flags = irq_save();
+    compact_stats.runs++;
+    irq_restore(irq_flags);
+    return rebuilt;
+}
+
+void compact_idle(void) {
+    if (!mem_map) {
+        return;
+    }
+    for (uint32_t order = COMPACT_ORDER; order <= MAX_ORDER; order++) {
+        if (free_areas[order].count) {
+            return;
+        }
+    }
+
+    // Back off exponentially while runs keep finding nothing to rebuild
+    if (compact_defer_count) {
+        compact_defer_count--;
+        compact_stats.deferred++;
+        return;
+    }
+    if (compact_memory(1)) {
+        compact_defer_shift = 0;
+    } else {
+        if (compact_defer_shift < COMPACT_MAX_DEFER) {
+            compact_defer_shift++;
+        }
+        compact_defer_count = 1u << compact_defer_shift;
+    }
+}
+
+void get_compact_stats(struct compact_stats* stats) {
+    uint64_t irq_flags = irq_save();
+    *stats = compact_stats;
+    irq_restore(irq_flags);
+}
+
 void test_buddy_allocator(void) {
     kprintf(INFO, "Starting buddy allocator tests...\n");
+    uint64_t initial_free = get_free_ram();
     
     // Test 1: Basic allocation and free
     kprintf(INFO, "Test 1: Basic allocation and free\n");
     void* ptr1 = buddy_alloc(4096);  // 4KB
     if (ptr1) {
         kprintf(INFO, "Allocated 4KB at %p\n", ptr1);
+        if ((uintptr_t)ptr1 & (PAGE_SIZE - 1)) {
+            kprintf(ERROR, "4KB block is not page aligned\n");
+        }
         buddy_free(ptr1);
         kprintf(INFO, "Freed 4KB block\n");
     }
@@ -239,10 +995,21 @@ void test_buddy_allocator(void) {
     // Test 4: Invalid allocations
     kprintf(INFO, "Test 4: Invalid allocations\n");
     void* ptr6 = buddy_alloc(0);     // Zero size
-    void* ptr7 = buddy_alloc(1 << 21); // Too large (2MB)
+    void* ptr7 = buddy_alloc(((size_t)PAGE_SIZE << MAX_ORDER) + 1); // Too large (>1GB)
     if (!ptr6 && !ptr7) {
         kprintf(INFO, "Correctly rejected invalid allocations\n");
     }
+
+    // Test 5: Huge blocks
+    kprintf(INFO, "Test 5: Huge blocks\n");
+    void* ptr8 = buddy_alloc(1 << 21); // 2MB
+    if (ptr8) {
+        kprintf(INFO, "Allocated 2MB at %p\n", ptr8);
+        buddy_free(ptr8);
+        kprintf(INFO, "Freed 2MB block\n");
+    } else {
+        kprintf(ERROR, "2MB allocation failed\n");
+    }
     
     // Test 6: Stress test
     kprintf(INFO, "Test 6: Stress test\n");
@@ -262,9 +1029,86 @@ void test_buddy_allocator(void) {
         }
     }
     
+    // Test 7: Every block merged back with its buddy
+    kprintf(INFO, "Test 7: Coalescing\n");
+    if (get_free_ram() == initial_free) {
+        kprintf(INFO, "All blocks coalesced back\n");
+    } else {
+        kprintf(ERROR, "Free RAM changed from %llu KB to %llu KB\n", initial_free, get_free_ram());
+    }
+
+    // Test 8: Pre-zeroed frames
+    kprintf(INFO, "Test 8: Pre-zeroed frames\n");
+    refill_zero_pool();
+    uint8_t* zeroed = buddy_alloc_zeroed(PAGE_SIZE);
+    if (zeroed) {
+        bool clean = true;
+        for (uint32_t i = 0; i < PAGE_SIZE; i++) {
+            if (zeroed[i]) {
+                clean = false;
+                break;
+            }
+        }
+        kprintf(clean ? INFO : ERROR, "Zeroed frame at %p is %s\n", zeroed, clean ? "clean" : "dirty");
+        memset(zeroed, 0xAA, PAGE_SIZE);
+        buddy_free(zeroed);
+    }
+
     kprintf(INFO, "Buddy allocator tests completed\n");
     kprintf(INFO, "Final memory statistics:\n");
     kprintf(INFO, "Free RAM: %llu KB\n", get_free_ram());
     kprintf(INFO, "Used RAM: %llu KB\n", get_used_ram());
     kprintf(INFO, "Fragmented RAM: %llu KB\n", get_fragmented_ram());
 }
+
+#define COMPACT_TEST_FRAMES 3
+
+void compaction_test(void) {
+    kprintf(INFO, "Starting compaction test...\n");
+
+    // A 2 MB block left holding a few frames, mapped through a vmalloc hole
+    struct page* block = alloc_pages(COMPACT_ORDER);
+    uint8_t* area = vmalloc_reserve(COMPACT_TEST_FRAMES * PAGE_SIZE);
+    if (!block || !area) {
+        kprintf(ERROR, "Compaction test setup failed\n");
+        free_pages(block);
+        return;
+    }
+
+    uintptr_t frames[COMPACT_TEST_FRAMES];
+    for (uint32_t i = 0; i < COMPACT_PAGES; i++) {
+        block[i].order = 0;
+        block[i].flags = PG_ALLOCATED;
+        block[i].private = NULL;
+    }
+    for (uint32_t i = 0; i < COMPACT_TEST_FRAMES; i++) {
+        frames[i] = page_to_phys(&block[1 + i * 100]);
+    }
+
+    // Map first, so no page table it needs comes out of the block
+    bool ok = map_frames((uintptr_t)area, frames, COMPACT_TEST_FRAMES, PAGE_PRESENT | PAGE_WRITABLE);
+    for (uint32_t i = 0; i < COMPACT_PAGES; i++) {
+        if (!ok || i % 100 != 1 || i / 100 >= COMPACT_TEST_FRAMES) {
+            free_pages(&block[i]);
+        }
+    }
+    for (uint32_t i = 0; ok && i < COMPACT_TEST_FRAMES; i++) {
+        memset(area + i * PAGE_SIZE, 0x5A + i, PAGE_SIZE);
+    }
+
+    drain_page_caches();
+    ok = ok && compact_block(page_to_phys(block) >> PAGE_SHIFT);
+
+    // The data moved with the pages, and out of the block
+    for (uint32_t i = 0; ok && i < COMPACT_TEST_FRAMES; i++) {
+        uintptr_t phys = virtual_to_physical((uintptr_t)(area + i * PAGE_SIZE));
+        ok = area[i * PAGE_SIZE + 42] == 0x5A + i &&
+             (phys - page_to_phys(block)) >= ((uint64_t)COMPACT_PAGES << PAGE_SHIFT);
+    }
+    if (ok) {
+        kprintf(INFO, "Compaction test passed\n");
+    } else {
+        kprintf(ERROR, "Compaction test failed\n");
+    }
+    vunreserve(area, COMPACT_TEST_FRAMES * PAGE_SIZE);
+}
@@ -0,0 +1,63 @@
+#include "kernel/mm/shrinker.h"
+#include "kernel/sync.h"
+#include "kernel/kprintf.h"
+
+/*
+Registry of caches the page allocator can squeeze under memory pressure.
+*/
+
+static struct shrinker* shrinkers = NULL;
+static spinlock_t shrinker_lock = { 0, "shrinker_lock" };
+
+void register_shrinker(struct shrinker* shrinker) {
+    if (!shrinker || !shrinker->count || !shrinker->scan) {
+        kprintf(ERROR, "[SHRINKER] Invalid shrinker registration\n");
+        return;
+    }
+
+    shrinker->invocations = 0;
+    shrinker->pages_freed = 0;
+
+    spinlock_acquire(&shrinker_lock);
+    shrinker->next = shrinkers;
+    shrinkers = shrinker;
+    spinlock_release(&shrinker_lock);
+}
+
+void unregister_shrinker(struct shrinker* shrinker) {
+    spinlock_acquire(&shrinker_lock);
+    for (struct shrinker** link = &shrinkers; *link; link = &(*link)->next) {
+        if (*link == shrinker) {
+            *link = shrinker->next;
+            shrinker->next = NULL;
+            break;
+        }
+    }
+    spinlock_release(&shrinker_lock);
+}
+
+size_t shrink_caches(size_t nr_pages) {
+    // A shrinker that itself runs out of memory must not recurse into us
+    if (!spinlock_try_acquire(&shrinker_lock)) {
+        return 0;
+    }
+
+    size_t freed = 0;
+    for (struct shrinker* shrinker = shrinkers; shrinker && freed < nr_pages; shrinker = shrinker->next) {
+        if (shrinker->count() == 0) {
+            continue;
+        }
+
+        size_t released = shrinker->scan(nr_pages - freed);
+        shrinker->invocations++;
+        shrinker->pages_freed += released;
+        freed += released;
+    }
+
+    spinlock_release(&shrinker_lock);
+    return freed;
+}
+
+const struct shrinker* shrinker_first(void) {
+    return shrinkers;
+}
@@ -0,0 +1,245 @@
+#include "kernel/mm/swap.h"
+#include "kernel/mm/vmm.h"
+#include "kernel/mm/vmalloc.h"
+#include "kernel/mm/shrinker.h"
+#include "kernel/sync.h"
+#include "kernel/kprintf.h"
+#include "string.h"
+
+/*
+Swap space for the private pages of address spaces, such as WASM linear
+memory.
+
+The VMM decides what goes out and keeps the slot in the page table entry
+(see swap_out_anonymous); this file only hands out slots and moves pages
+to and from the device. Each slot counts the entries pointing at it: one,
+or more after share_range_cow cloned a space with pages swapped out. Pages
+go out through the "swap" shrinker and come back in the page fault
+handler, both with interrupts off, so the slot map is guarded by irq_save
+rather than a mutex.
+
+There is no swap cache: a page read back gives up its slot, and is written
+out again in full if it goes cold again.
+*/
+
+static struct swap_device* swap_device = NULL;
+static uint16_t* slot_counts = NULL;  // Entries using each slot
+static uint32_t slot_cursor = 0;      // Where the next free slot search starts
+static struct swap_stats swap_stats;
+static struct shrinker swap_shrinker;
+
+void swap_init(void) {
+    register_shrinker(&swap_shrinker);
+}
+
+bool swapon(struct swap_device* device) {
+    if (swap_device) {
+        kprintf(ERROR, "[SWAP] Already swapping to %s\n", swap_device->name);
+        device->release(device);
+        return false;
+    }
+
+    uint16_t* counts = device->pages ? vmalloc(device->pages * sizeof(uint16_t)) : NULL;
+    if (!counts) {
+        kprintf(ERROR, "[SWAP] No room for the slot map of %s\n", device->name);
+        device->release(device);
+        return false;
+    }
+
+    uint64_t irq_flags = irq_save();
+    slot_counts = counts;
+    slot_cursor = 0;
+    swap_stats.slots = device->pages;
+    swap_device = device;
+    irq_restore(irq_flags);
+
+    kprintf(INFO, "[SWAP] Swapping to %s, %d KB\n", device->name, (uint64_t)device->pages * PAGE_SIZE / 1024);
+    return true;
+}
+
+uint32_t swap_write_page(const void* data) {
+    uint32_t slot = SWAP_NONE;
+    uint64_t irq_flags = irq_save();
+    if (swap_device && swap_stats.used < swap_stats.slots) {
+        slot = slot_cursor;
+        while (slot_counts[slot]) {
+            slot = slot + 1 < swap_stats.slots ? slot + 1 : 0;
+        }
+        if (swap_device->write_page(swap_device, slot, data)) {
+            slot_counts[slot] = 1;
+            slot_cursor = slot + 1 < swap_stats.slots ? slot + 1 : 0;
+            swap_stats.used++;
+            swap_stats.swapped_out++;
+        } else {
+            slot = SWAP_NONE;
+            swap_stats.errors++;
+        }
+    }
+    irq_restore(irq_flags);
+    return slot;
+}
+
+bool swap_read_page(uint32_t slot, void* buffer) {
+    uint64_t irq_flags = irq_save();
+    bool ok = swap_device && slot < swap_stats.slots && swap_device->read_page(swap_device, slot, buffer);
+    if (ok) {
+        swap_stats.swapped_in++;
+    } else {
+        swap_stats.errors++;
+    }
+    irq_restore(irq_flags);
+    return ok;
+}
+
+bool swap_dup(uint32_t slot) {
+    uint64_t irq_flags = irq_save();
+    bool ok = slot < swap_stats.slots && slot_counts[slot] && slot_counts[slot] < 0xFFFF;
+    if (ok) {
+        slot_counts[slot]++;
+    }
+    irq_restore(irq_flags);
+    return ok;
+}
+
+void swap_free(uint32_t slot) {
+    uint64_t irq_flags = irq_save();
+    if (slot < swap_stats.slots && slot_counts[slot] && --slot_counts[slot] == 0) {
+        swap_stats.used--;
+    }
+    irq_restore(irq_flags);
+}
+
+void get_swap_stats(struct swap_stats* stats) {
+    uint64_t irq_flags = irq_save();
+    *stats = swap_stats;
+    irq_restore(irq_flags);
+}
+
+// What swap could take: resident private pages, as many as there are free
+// slots for
+static size_t swap_shrink_count(void) {
+    uint64_t irq_flags = irq_save();
+    size_t free_slots = swap_device ? swap_stats.slots - swap_stats.used : 0;
+    irq_restore(irq_flags);
+    return free_slots ? count_anonymous_pages(free_slots) : 0;
+}
+
+static size_t swap_shrink_scan(size_t nr_pages) {
+    return swap_out_anonymous(nr_pages);
+}
+
+static struct shrinker swap_shrinker = {
+    .name = "swap",
+    .count = swap_shrink_count,
+    .scan = swap_shrink_scan,
+};
+
+#define TEST_ADDRESS USER_SPACE_START
+#define TEST_PAGES 4
+#define BULK_ADDRESS (USER_SPACE_START + (2ull << 20))
+#define BULK_PAGES 512  // More than the fault reserve and zero pool hold together
+
+// True if none of the test pages is resident
+static bool test_swapped_out(void) {
+    for (uint32_t i = 0; i < TEST_PAGES; i++) {
+        if (virtual_to_physical(TEST_ADDRESS + i * PAGE_SIZE)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool test_contents(void) {
+    volatile uint8_t* data = (volatile uint8_t*)TEST_ADDRESS;
+    for (uint32_t i = 0; i < TEST_PAGES; i++) {
+        if (data[i * PAGE_SIZE] != 0x50 + i || data[i * PAGE_SIZE + PAGE_SIZE - 1] != 0x50 + i) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void swap_test(void) {
+    if (!swap_device) {
+        kprintf(INFO, "[SWAP] No swap device, skipping tests\n");
+        return;
+    }
+    kprintf(INFO, "[SWAP] Starting swap tests...\n");
+
+    struct address_space* space = address_space_create();
+    if (!space) {
+        kprintf(ERROR, "[SWAP] Address space setup failed\n");
+        return;
+    }
+    struct address_space* prev = address_space_switch(space);
+    if (!map_anonymous(TEST_ADDRESS, TEST_PAGES * PAGE_SIZE, false)) {
+        kprintf(ERROR, "[SWAP] Address space setup failed\n");
+        address_space_switch(prev);
+        address_space_destroy(space);
+        return;
+    }
+    for (uint32_t i = 0; i < TEST_PAGES; i++) {
+        memset((void*)(TEST_ADDRESS + i * PAGE_SIZE), 0x50 + i, PAGE_SIZE);
+    }
+
+    struct swap_stats before, after;
+    get_swap_stats(&before);
+
+    // The pages were just written, so the clock has to come round twice;
+    // touching them afterwards reads each back through a page fault
+    size_t resident = count_anonymous_pages((size_t)-1);
+    swap_out_anonymous(TEST_PAGES);
+    bool ok = resident >= TEST_PAGES && count_anonymous_pages((size_t)-1) == resident - TEST_PAGES &&
+              test_swapped_out() && test_contents();
+    get_swap_stats(&after);
+    ok = ok && after.swapped_out == before.swapped_out + TEST_PAGES &&
+         after.swapped_in == before.swapped_in + TEST_PAGES && after.used == before.used;
+    if (ok) {
+        kprintf(INFO, "[SWAP] Swap round trip test passed\n");
+    } else {
+        kprintf(ERROR, "[SWAP] Swap round trip test failed\n");
+    }
+
+    // A copy-on-write clone shares the slots until both sides read back
+    swap_out_anonymous(TEST_PAGES);
+    struct address_space* clone = address_space_create();
+    ok = clone && test_swapped_out();
+    if (ok) {
+        address_space_switch(clone);
+        ok = share_range_cow(space, TEST_ADDRESS, TEST_PAGES * PAGE_SIZE) && test_contents();
+        unmap_anonymous(TEST_ADDRESS, TEST_PAGES * PAGE_SIZE);
+        address_space_switch(space);
+        get_swap_stats(&after);
+        ok = ok && after.used == before.used + TEST_PAGES && test_contents();
+    }
+    address_space_destroy(clone);
+    get_swap_stats(&after);
+    if (ok && after.used == before.used) {
+        kprintf(INFO, "[SWAP] Shared swap slot test passed\n");
+    } else {
+        kprintf(ERROR, "[SWAP] Shared swap slot test failed\n");
+    }
+
+    // Reading back more pages than the reserve and the zero pool hold makes
+    // the fault path reclaim frames itself
+    ok = map_anonymous(BULK_ADDRESS, BULK_PAGES * PAGE_SIZE, false);
+    for (uint32_t i = 0; ok && i < BULK_PAGES; i++) {
+        *(volatile uint32_t*)(BULK_ADDRESS + i * PAGE_SIZE) = 0x5A000000 | i;
+    }
+    get_swap_stats(&before);
+    ok = ok && swap_out_anonymous(BULK_PAGES) == BULK_PAGES;
+    for (uint32_t i = 0; ok && i < BULK_PAGES; i++) {
+        ok = *(volatile uint32_t*)(BULK_ADDRESS + i * PAGE_SIZE) == (0x5A000000 | i);
+    }
+    get_swap_stats(&after);
+    unmap_anonymous(BULK_ADDRESS, BULK_PAGES * PAGE_SIZE);
+    if (ok && after.swapped_in >= before.swapped_in + BULK_PAGES && after.errors == before.errors) {
+        kprintf(INFO, "[SWAP] Bulk swap-in test passed\n");
+    } else {
+        kprintf(ERROR, "[SWAP] Bulk swap-in test failed\n");
+    }
+
+    unmap_anonymous(TEST_ADDRESS, TEST_PAGES * PAGE_SIZE);
+    address_space_switch(prev);
+    address_space_destroy(space);
+}
@@ -0,0 +1,579 @@
+#include <kernel/mm/vmalloc.h>
+#include <kernel/mm/kmalloc.h>
+#include <kernel/mm/pmm.h>
+#include <kernel/mm/vmm.h>
+#include <kernel/sync.h>
+#include <kernel/kprintf.h>
+#include <string.h>
+
+/*
+Virtually contiguous kernel areas backed one buddy frame at a time.
+
+Holes in [VMALLOC_START, VMALLOC_START + VMALLOC_SIZE) live in an AVL tree
+keyed by address. Every node also records the largest hole in its subtree,
+so finding the lowest hole that fits a request, and merging a freed area
+with its neighbours, are both O(log n) however fragmented the window is.
+
+Areas of 2 MB or more start on a 2 MB boundary, and every aligned 2 MB
+stretch is backed by an order-9 block mapped as one large page when the
+buddy allocator has one free, falling back to single frames otherwise.
+
+Areas themselves are not in the tree: the first frame of an area keeps its
+page count in struct page->private, which is all vfree needs.
+
+map_anonymous backs ranges outside the window, such as an address space's
+private half, the same way; those ranges are tracked by their owner. So are
+holes taken with vmalloc_reserve, which their owner fills itself.
+*/
+
+#define ALIGN_UP(x, align) (((x) + (align) - 1) & ~((align) - 1))
+#define HUGE_ORDER 9
+#define HUGE_PAGES (1u << HUGE_ORDER)
+#define HUGE_SIZE (HUGE_PAGES * PAGE_SIZE)
+#define MAP_BATCH 64  // 4 KB frames mapped per map_frames call
+
+// A free range of the window
+struct vmap_area {
+    uintptr_t start;
+    size_t pages;
+    size_t max_pages;  // Largest range in this subtree
+    struct vmap_area* left;
+    struct vmap_area* right;
+    int height;
+};
+
+static struct vmap_area* free_root = NULL;
+static struct kmem_cache* vmap_area_cache = NULL;
+static uint64_t nr_areas = 0;
+static uint64_t nr_pages = 0;
+static uint64_t nr_free_ranges = 0;
+
+static inline int node_height(struct vmap_area* node) {
+    return node ? node->height : 0;
+}
+
+static inline size_t node_max(struct vmap_area* node) {
+    return node ? node->max_pages : 0;
+}
+
+static void update_node(struct vmap_area* node) {
+    int left = node_height(node->left);
+    int right = node_height(node->right);
+    node->height = 1 + (left > right ? left : right);
+
+    size_t max = node->pages;
+    if (node_max(node->left) > max) max = node_max(node->left);
+    if (node_max(node->right) > max) max = node_max(node->right);
+    node->max_pages = max;
+}
+
+static struct vmap_area* rotate_right(struct vmap_area* node) {
+    struct vmap_area* left = node->left;
+    node->left = left->right;
+    left->right = node;
+    update_node(node);
+    update_node(left);
+    return left;
+}
+
+static struct vmap_area* rotate_left(struct vmap_area* node) {
+    struct vmap_area* right = node->right;
+    node->right = right->left;
+    right->left = node;
+    update_node(node);
+    update_node(right);
+    return right;
+}
+
+static struct vmap_area* rebalance(struct vmap_area* node) {
+    update_node(node);
+    int balance = node_height(node->left) - node_height(node->right);
+
+    if (balance > 1) {
+        if (node_height(node->left->left) < node_height(node->left->right)) {
+            node->left = rotate_left(node->left);
+        }
+        return rotate_right(node);
+    }
+    if (balance < -1) {
+        if (node_height(node->right->right) < node_height(node->right->left)) {
+            node->right = rotate_right(node->right);
+        }
+        return rotate_left(node);
+    }
+    return node;
+}
+
+static struct vmap_area* tree_insert(struct vmap_area* root, struct vmap_area* node) {
+    if (!root) {
+        node->left = node->right = NULL;
+        update_node(node);
+        return node;
+    }
+    if (node->start < root->start) {
+        root->left = tree_insert(root->left, node);
+    } else {
+        root->right = tree_insert(root->right, node);
+    }
+    return rebalance(root);
+}
+
+static struct vmap_area* tree_remove_min(struct vmap_area* root, struct vmap_area** min) {
+    if (!root->left) {
+        *min = root;
+        return root->right;
+    }
+    root->left = tree_remove_min(root->left, min);
+    return rebalance(root);
+}
+
+static struct vmap_area* tree_erase(struct vmap_area* root, struct vmap_area* node) {
+    if (!root) {
+        return NULL;
+    }
+    if (node->start < root->start) {
+        root->left = tree_erase(root->left, node);
+    } else if (node->start > root->start) {
+        root->right = tree_erase(root->right, node);
+    } else {
+        struct vmap_area* left = root->left;
+        struct vmap_area* right = root->right;
+        if (!right) {
+            return left;
+        }
+        struct vmap_area* min;
+        right = tree_remove_min(right, &min);
+        min->left = left;
+        min->right = right;
+        return rebalance(min);
+    }
+    return rebalance(root);
+}
+
+// Lowest-addressed hole of at least `pages` pages
+static struct vmap_area* find_first_fit(size_t pages) {
+    struct vmap_area* node = free_root;
+    while (node && node->max_pages >= pages) {
+        if (node_max(node->left) >= pages) {
+            node = node->left;
+        } else if (node->pages >= pages) {
+            return node;
+        } else {
+            node = node->right;
+        }
+    }
+    return NULL;
+}
+
+// Hole starting exactly at addr
+static struct vmap_area* find_at(uintptr_t addr) {
+    struct vmap_area* node = free_root;
+    while (node && node->start != addr) {
+        node = addr < node->start ? node->left : node->right;
+    }
+    return node;
+}
+
+// Hole ending exactly at addr
+static struct vmap_area* find_ending_at(uintptr_t addr) {
+    struct vmap_area* node = free_root;
+    struct vmap_area* prev = NULL;
+    while (node) {
+        if (node->start < addr) {
+            prev = node;
+            node = node->right;
+        } else {
+            node = node->left;
+        }
+    }
+    return prev && prev->start + prev->pages * PAGE_SIZE == addr ? prev : NULL;
+}
+
+// Carve pages off the front of a hole; irqs must be off
+static void take_front(struct vmap_area* area, size_t pages) {
+    free_root = tree_erase(free_root, area);
+    area->start += pages * PAGE_SIZE;
+    area->pages -= pages;
+    if (area->pages) {
+        free_root = tree_insert(free_root, area);
+    } else {
+        kmem_cache_free(vmap_area_cache, area);
+        nr_free_ranges--;
+    }
+}
+
+// Return a range to the tree, merging it with the holes around it; irqs must be off
+static void release_range(uintptr_t start, size_t pages) {
+    struct vmap_area* prev = find_ending_at(start);
+    struct vmap_area* next = find_at(start + pages * PAGE_SIZE);
+
+    if (prev && next) {
+        free_root = tree_erase(free_root, next);
+        free_root = tree_erase(free_root, prev);
+        prev->pages += pages + next->pages;
+        free_root = tree_insert(free_root, prev);
+        kmem_cache_free(vmap_area_cache, next);
+        nr_free_ranges--;
+    } else if (prev) {
+        free_root = tree_erase(free_root, prev);
+        prev->pages += pages;
+        free_root = tree_insert(free_root, prev);
+    } else if (next) {
+        free_root = tree_erase(free_root, next);
+        next->start = start;
+        next->pages += pages;
+        free_root = tree_insert(free_root, next);
+    } else {
+        struct vmap_area* area = kmem_cache_alloc(vmap_area_cache);
+        if (!area) {
+            kprintf(WARN, "[VMALLOC] No memory to track a free range, leaking %u pages of address space at %p\n",
+                    pages, (void*)start);
+            return;
+        }
+        area->start = start;
+        area->pages = pages;
+        free_root = tree_insert(free_root, area);
+        nr_free_ranges++;
+    }
+}
+
+static uintptr_t reserve_range(size_t pages) {
+    // Large areas get slack to start on a 2 MB boundary; the rest goes back
+    size_t slack = pages >= HUGE_PAGES ? HUGE_PAGES - 1 : 0;
+
+    uint64_t irq_flags = irq_save();
+    struct vmap_area* area = find_first_fit(pages + slack);
+    uintptr_t start = 0;
+    if (area) {
+        uintptr_t base = area->start;
+        take_front(area, pages + slack);
+        start = slack ? ALIGN_UP(base, (uintptr_t)HUGE_SIZE) : base;
+        size_t head = (start - base) / PAGE_SIZE;
+        if (head) {
+            release_range(base, head);
+        }
+        if (slack - head) {
+            release_range(start + pages * PAGE_SIZE, slack - head);
+        }
+    }
+    irq_restore(irq_flags);
+    return start;
+}
+
+static void unreserve_range(uintptr_t start, size_t pages) {
+    uint64_t irq_flags = irq_save();
+    release_range(start, pages);
+    irq_restore(irq_flags);
+}
+
+// Unmap and free whatever backs a range, returning the pages freed. Holes
+// are skipped a page table at a time, and the frames are only freed once
+// the whole range has been flushed from the TLB.
+static size_t unmap_pages(uintptr_t start, size_t pages) {
+    uintptr_t end = start + pages * PAGE_SIZE;
+    struct tlb_batch batch;
+    struct page* frames = NULL;
+    size_t freed = 0;
+
+    tlb_batch_init(&batch);
+    for (uintptr_t addr = start; addr < end;) {
+        size_t size;
+        uintptr_t phys = unmap_leaf(addr, &size, &batch);
+        struct page* page = phys ? phys_to_page(phys) : NULL;
+        if (page && put_page_testzero(page)) {
+            // Frames still shared copy-on-write stay with their other mappings
+            page->private = NULL;
+            page->next = frames;
+            frames = page;
+            freed += size / PAGE_SIZE;
+        }
+        addr = (addr & ~(uintptr_t)(size - 1)) + size;
+    }
+    tlb_batch_finish(&batch);
+
+    while (frames) {
+        struct page* page = frames;
+        frames = page->next;
+        free_pages(page);
+    }
+    return freed;
+}
+
+// Back an aligned 2 MB stretch with one large page, if a block is free
+static bool map_huge(uintptr_t addr, bool zero) {
+    struct page* block = try_alloc_pages(HUGE_ORDER);
+    if (!block) return false;
+
+    if (zero) {
+        memset(page_address(block), 0, HUGE_SIZE);
+    }
+    if (!map_range(addr, page_to_phys(block), HUGE_SIZE, PAGE_PRESENT | PAGE_WRITABLE)) {
+        free_pages(block);
+        return false;
+    }
+    return true;
+}
+
+// Map the `*count` frames gathered for the pages just below `end`, freeing
+// them if that fails
+static bool map_batch(uintptr_t end, uintptr_t* frames, size_t* count) {
+    bool ok = *count == 0 ||
+              map_frames(end - *count * PAGE_SIZE, frames, *count, PAGE_PRESENT | PAGE_WRITABLE);
+    if (!ok) {
+        for (size_t i = 0; i < *count; i++) {
+            free_pages(phys_to_page(frames[i]));
+        }
+    }
+    *count = 0;
+    return ok;
+}
+
+// Back a range with fresh frames, undoing everything if memory runs out.
+// 4 KB frames are gathered MAP_BATCH at a time so each page table is
+// filled in one walk.
+static bool map_pages(uintptr_t start, size_t pages, bool zero) {
+    uintptr_t end = start + pages * PAGE_SIZE;
+    uintptr_t frames[MAP_BATCH];
+    size_t count = 0;
+    bool ok = true;
+
+    for (uintptr_t addr = start; ok && addr < end; addr += PAGE_SIZE) {
+        if (!(addr & (HUGE_SIZE - 1))) {
+            ok = map_batch(addr, frames, &count);
+            if (ok && end - addr >= HUGE_SIZE && map_huge(addr, zero)) {
+                addr += HUGE_SIZE - PAGE_SIZE;
+                continue;
+            }
+        }
+
+        struct page* page = NULL;
+        if (ok) {
+            page = zero ? alloc_zeroed_page() : alloc_pages(0);
+            ok = page != NULL;
+        }
+        if (page) {
+            frames[count++] = page_to_phys(page);
+            if (count == MAP_BATCH) {
+                ok = map_batch(addr + PAGE_SIZE, frames, &count);
+            }
+        }
+    }
+
+    if (ok) {
+        ok = map_batch(end, frames, &count);
+    }
+    if (!ok) {
+        while (count) {
+            free_pages(phys_to_page(frames[--count]));
+        }
+        unmap_pages(start, pages);
+    }
+    return ok;
+}
+
+static struct page* area_head(const void* addr) {
+    return phys_to_page(virtual_to_physical((uintptr_t)addr));
+}
+
+void vmalloc_init(void) {
+    if (vmap_area_cache) return;
+
+    vmap_area_cache = kmem_cache_create("vmap_area", sizeof(struct vmap_area), NULL);
+    if (!vmap_area_cache) {
+        kprintf(ERROR, "[VMALLOC] Failed to create the vmap_area cache\n");
+        return;
+    }
+
+    struct vmap_area* area = kmem_cache_alloc(vmap_area_cache);
+    if (!area) {
+        kprintf(ERROR, "[VMALLOC] No memory for the initial free range\n");
+        kmem_cache_destroy(vmap_area_cache);
+        vmap_area_cache = NULL;
+        return;
+    }
+    area->start = VMALLOC_START;
+    area->pages = VMALLOC_SIZE / PAGE_SIZE;
+    free_root = tree_insert(NULL, area);
+    nr_free_ranges = 1;
+
+    kprintf(INFO, "[VMALLOC] %u MB window at %p\n", (uint32_t)(VMALLOC_SIZE >> 20), (void*)VMALLOC_START);
+}
+
+static void* alloc_area(size_t size, bool zero) {
+    if (size == 0 || size > VMALLOC_SIZE) return NULL;
+    if (!vmap_area_cache) {
+        kprintf(ERROR, "[VMALLOC] Called before vmalloc_init\n");
+        return NULL;
+    }
+
+    size_t pages = ALIGN_UP(size, PAGE_SIZE) / PAGE_SIZE;
+    uintptr_t start = reserve_range(pages);
+    if (!start) {
+        kprintf(ERROR, "[VMALLOC] No %u page hole left in the window\n", pages);
+        return NULL;
+    }
+
+    if (!map_pages(start, pages, zero)) {
+        unreserve_range(start, pages);
+        return NULL;
+    }
+
+    area_head((void*)start)->private = (void*)(uintptr_t)pages;
+
+    uint64_t irq_flags = irq_save();
+    nr_areas++;
+    nr_pages += pages;
+    irq_restore(irq_flags);
+    return (void*)start;
+}
+
+void* vmalloc(size_t size) {
+    return alloc_area(size, true);
+}
+
+void* vmalloc_uninit(size_t size) {
+    return alloc_area(size, false);
+}
+
+size_t vmalloc_size(const void* addr) {
+    struct page* page = is_vmalloc_addr(addr) ? area_head(addr) : NULL;
+    return page ? (size_t)(uintptr_t)page->private * PAGE_SIZE : 0;
+}
+
+bool vmalloc_extend(void* addr, size_t size) {
+    size_t old_pages = vmalloc_size(addr) / PAGE_SIZE;
+    size_t pages = ALIGN_UP(size, PAGE_SIZE) / PAGE_SIZE;
+    if (!old_pages) return false;
+    if (pages <= old_pages) return true;
+
+    size_t extra = pages - old_pages;
+    uintptr_t end = (uintptr_t)addr + old_pages * PAGE_SIZE;
+
+    uint64_t irq_flags = irq_save();
+    struct vmap_area* next = find_at(end);
+    bool reserved = next && next->pages >= extra;
+    if (reserved) {
+        take_front(next, extra);
+    }
+    irq_restore(irq_flags);
+    if (!reserved) return false;
+
+    if (!map_pages(end, extra, false)) {
+        unreserve_range(end, extra);
+        return false;
+    }
+
+    area_head(addr)->private = (void*)(uintptr_t)pages;
+
+    irq_flags = irq_save();
+    nr_pages += extra;
+    irq_restore(irq_flags);
+    return true;
+}
+
+void* vmalloc_reserve(size_t size) {
+    if (size == 0 || size > VMALLOC_SIZE || !vmap_area_cache) return NULL;
+    return (void*)reserve_range(ALIGN_UP(size, PAGE_SIZE) / PAGE_SIZE);
+}
+
+void vunreserve(void* addr, size_t size) {
+    size_t pages = ALIGN_UP(size, PAGE_SIZE) / PAGE_SIZE;
+    unmap_pages((uintptr_t)addr, pages);
+    unreserve_range((uintptr_t)addr, pages);
+}
+
+bool map_anonymous(uintptr_t start, size_t size, bool zero) {
+    return map_pages(start, ALIGN_UP(size, PAGE_SIZE) / PAGE_SIZE, zero);
+}
+
+size_t unmap_anonymous(uintptr_t start, size_t size) {
+    return unmap_pages(start, ALIGN_UP(size, PAGE_SIZE) / PAGE_SIZE);
+}
+
+void vfree(void* addr) {
+    if (!addr) return;
+
+    size_t pages = vmalloc_size(addr);
+    if (((uintptr_t)addr & (PAGE_SIZE - 1)) || !pages) {
+        kprintf(ERROR, "[VFREE] %p was not allocated by vmalloc\n", addr);
+        return;
+    }
+    pages /= PAGE_SIZE;
+
+    unmap_pages((uintptr_t)addr, pages);
+    unreserve_range((uintptr_t)addr, pages);
+
+    uint64_t irq_flags = irq_save();
+    nr_areas--;
+    nr_pages -= pages;
+    irq_restore(irq_flags);
+}
+
+void vmalloc_get_stats(struct vmalloc_stats* stats) {
+    uint64_t irq_flags = irq_save();
+    stats->areas = nr_areas;
+    stats->pages = nr_pages;
+    stats->free_ranges = nr_free_ranges;
+    stats->largest_free = node_max(free_root);
+    irq_restore(irq_flags);
+}
+
+#define TEST_AREAS 8
+#define TEST_BIG_SIZE (8 * 1024 * 1024)  // 8MB
+
+// Test the free-range tree and multi-megabyte areas
+void vmalloc_test(void) {
+    kprintf(INFO, "[VMALLOC] Starting vmalloc tests...\n");
+
+    struct vmalloc_stats before;
+    vmalloc_get_stats(&before);
+
+    // Punch holes, then check first fit reuses the lowest one
+    void* areas[TEST_AREAS];
+    for (int i = 0; i < TEST_AREAS; i++) {
+        areas[i] = vmalloc_uninit((i + 1) * PAGE_SIZE);
+        if (!areas[i]) {
+            kprintf(ERROR, "[VMALLOC] Allocation %d failed\n", i);
+            return;
+        }
+    }
+    for (int i = 1; i < TEST_AREAS; i += 2) {
+        vfree(areas[i]);
+    }
+    void* reused = vmalloc_uninit(PAGE_SIZE);
+    if (reused && reused <= areas[1]) {
+        kprintf(INFO, "[VMALLOC] First-fit reuse test passed\n");
+    } else {
+        kprintf(ERROR, "[VMALLOC] First-fit reuse test failed: %p, expected %p\n", reused, areas[1]);
+    }
+    vfree(reused);
+    for (int i = 0; i < TEST_AREAS; i += 2) {
+        vfree(areas[i]);
+    }
+
+    // A multi-megabyte area comes back zeroed and can grow in place
+    uint8_t* big = vmalloc(TEST_BIG_SIZE);
+    bool zeroed = big != NULL;
+    for (size_t i = 0; zeroed && i < TEST_BIG_SIZE; i += PAGE_SIZE) {
+        zeroed = big[i] == 0 && big[i + PAGE_SIZE - 1] == 0;
+    }
+    if (zeroed && vmalloc_extend(big, 2 * TEST_BIG_SIZE) && vmalloc_size(big) == 2 * TEST_BIG_SIZE) {
+        big[2 * TEST_BIG_SIZE - 1] = 0xAA;
+        kprintf(INFO, "[VMALLOC] Large area test passed: %p\n", big);
+    } else {
+        kprintf(ERROR, "[VMALLOC] Large area test failed\n");
+    }
+    vfree(big);
+
+    // Everything merged back into the holes we started with
+    struct vmalloc_stats after;
+    vmalloc_get_stats(&after);
+    if (after.areas != before.areas || after.free_ranges != before.free_ranges ||
+        after.largest_free != before.largest_free) {
+        kprintf(ERROR, "[VMALLOC] Leak check failed: %u areas, %u free ranges\n",
+                after.areas, after.free_ranges);
+        return;
+    }
+
+    kprintf(INFO, "[VMALLOC] vmalloc tests completed successfully\n");
+}
@@ -1,89 +1,1504 @@
+#include "kernel/mm/vmm.h"
+#include "kernel/mm/kmalloc.h"
+#include "kernel/mm/vmalloc.h"
+#include "kernel/mm/filemap.h"
+#include "kernel/mm/swap.h"
+#include "kernel/sync.h"
 #include "arch/x86_64/asm.h"
 #include "kernel/kprintf.h"
+#include <string.h>
 
-#define PAGE_PRESENT    0x01
-#define PAGE_WRITABLE   0x02
-#define PAGE_USER       0x04
-#define PAGE_NOCACHE    0x08
-#define PAGE_WASM       0x10  // Special flag for WASM pages
-#define PAGE_SIZE       4096
+/*
+Four-level page table management for the kernel address space.
 
-#define ALIGN_4K __attribute__((aligned(PAGE_SIZE)))
+Tables below the PML4 are zeroed frames from the buddy allocator, tagged
+PG_PGTABLE. Their struct page counts present entries in `inuse`, so
+removing the last mapping under a table hands the table straight back to
+the PMM. The boot tables built by loader.asm and those of the direct map
+carry no tag and are never freed.
 
-#define MAX_PAGE_TABLES 128
+Levels are numbered from the leaf: 0 is the page table, 1 the page
+directory, 2 the PDPT and 3 the PML4. Levels 1 and 2 may hold 2 MB and
+1 GB leaves (PAGE_HUGE). map_range picks the largest leaf that alignment
+and size allow; mapping or unmapping part of a large page first splits it
+into 512 leaves of the next size down that map the same frames.
+
+Installing a leaf where nothing was mapped needs no TLB flush at all, since
+non-present entries are never cached. Changes to live entries are queued in
+a struct tlb_batch and flushed once the whole range is done: one invlpg per
+address for up to TLB_BATCH_MAX of them, a CR3 reload beyond that. Tables
+emptied by an unmap wait in the batch until that flush, so no stale
+paging-structure cache entry can point at a reused frame.
+
+Each struct address_space has its own PML4 whose lower-half slots 1-255
+(USER_SPACE_START to USER_SPACE_END) are private; slot 0, the kernel's
+identity map, and the whole upper half point at the same tables as the
+boot PML4. Those shared PDPTs are never freed, and a new one is copied
+into every space as it is created, so the kernel half stays identical
+everywhere. Private addresses always resolve through the current space.
+
+buddy_init maps all RAM at DIRECT_MAP_BASE before the PMM hands out a
+single frame, so phys_to_virt reaches any frame without a table walk of
+our own. The direct map's PDPTs and page directories come from a pool of
+boot memory inside loader.asm's 1 GB identity map and are reached through
+it while being filled; from then on every table the VMM allocates is read
+through the direct map.
+
+With PCID each space tags its TLB entries, so a switch keeps them. A
+space's entries are only dropped on the way in when another space has
+used its PCID since, or when kernel-half translations changed
+(kernel_tlb_gen) after it was last loaded; invlpg only reaches the
+current PCID.
+
+migrate_range lets the PMM's compaction empty a block of frames: every
+4 KB leaf of the vmalloc window and of each private half maps a frame
+that vmalloc or map_anonymous allocated for that page alone, so moving
+the contents and rewriting the one entry is all it takes.
+
+Pages of a private half can be swapped out (see swap.h). The leaf then
+stays in place, not present, holding the swap slot above PTE_SWAP with the
+page's other flag bits kept, and still counts towards its table's `inuse`.
+The swap shrinker runs swap_out_anonymous, a clock sweep over every
+space's private half: a page whose accessed bit the CPU set since the hand
+last passed gets the bit cleared and another lap; one left alone that long
+goes to swap. Cold 2 MB leaves are split first so their pages can go one
+by one. The page fault handler reads a page back into a frame from the
+fault reserve. When that is empty it reclaims one on the spot, taking an
+unmapped page cache frame or swapping out one more cold page, without
+splitting.
+
+share_range_cow maps another space's private frames into the current one
+read-only with the PTE_COW software bit set on both sides, counting the
+extra mapping on the frame (get_page). The first write fault on either
+side copies the frame, or just restores write access once the faulting
+space holds the only mapping left.
+*/
 
 #define PAGE_ENTRIES 512
+#define PTE_PAT_HUGE (1ull << 12)  // PAT bit of a 2 MB or 1 GB leaf
+#define PTE_PAT      (1ull << 7)   // PAT bit of a 4 KB leaf
+#define PTE_COW      (1ull << 9)   // Software bit: read-only until the shared frame is copied
+#define PTE_SWAP     (1ull << 10)  // Software bit of a not-present leaf: the page is in swap
+#define PTE_ACCESSED (1ull << 5)   // Set by the CPU whenever a leaf is used
+#define PTE_DIRTY    (1ull << 6)
 
-typedef ALIGN_4K struct PageTable {
+#define KERNEL_SLOTS_START 256    // First upper-half PML4 slot
+#define NR_PCIDS     4096
+#define CR3_NOFLUSH  (1ull << 63) // Keep the new PCID's TLB entries
+#define CR4_PCIDE    (1ull << 17)
+
+typedef struct PageTable {
     uintptr_t entries[PAGE_ENTRIES];
 } PageTable;
 
 extern PageTable pml4;
 
-static PageTable page_tables[MAX_PAGE_TABLES];
-size_t next_free_page_table = 0;
+enum {
+    MAP_OK,
+    MAP_NOMEM,  // A page table could not be allocated
+    MAP_BUSY,   // A page table sits where the large leaf would go
+    MAP_STALE,  // The entry being copied changed while memory was allocated
+};
+
+#define SWAP_SCAN_RATIO 32   // Leaves the swap clock may pass per page wanted
+#define SWAP_SCAN_MIN   512
+#define SWAP_MAX_LAPS   3    // Two full passes whatever the hand's starting point
+
+static size_t page_table_count = 0;
+static uint64_t huge_mappings = 0;  // Large leaves installed, over the kernel's lifetime
+static uint64_t huge_splits = 0;
+static int gb_pages = -1;  // 1 GB leaves supported; probed on first use
+static uint64_t tlb_page_flushes = 0;
+static uint64_t tlb_full_flushes = 0;
+static uint64_t tlb_flushes_avoided = 0;
+
+struct address_space kernel_space = {
+    .pml4 = (uintptr_t)&pml4,  // Identity mapped
+    .pcid = 0,
+    .tlb_gen = 1,
+    .next = &kernel_space,
+    .prev = &kernel_space,
+};
+static struct address_space* current_space = &kernel_space;
+// Space whose TLB entries each PCID currently holds
+static struct address_space* pcid_owner[NR_PCIDS] = { &kernel_space };
+static uint16_t next_pcid = 1;
+static bool pcid_enabled = false;
+static uint64_t kernel_tlb_gen = 1;  // Bumped whenever kernel-half translations are flushed
+static struct kmem_cache* space_cache = NULL;
+static uint64_t nr_spaces = 0;
+static uint64_t space_switches = 0;
+static uint64_t switch_flushes = 0;
+static uint64_t cow_faults = 0;
+static uint64_t cow_copies = 0;
+static uint64_t direct_map_bytes = 0;
+static uint64_t direct_leaves[3] = { 0 };  // Direct map leaves per level
+// Swap clock hand: the next private address to look at, and in which space
+static struct address_space* hand_space = &kernel_space;
+static uintptr_t hand_address = USER_SPACE_START;
+
+static inline size_t table_index(uintptr_t virtual_address, int level) {
+    return (virtual_address >> (PAGE_SHIFT + 9 * level)) & (PAGE_ENTRIES - 1);
+}
+
+// Bytes mapped by one entry at the given level
+static inline uintptr_t level_span(int level) {
+    return 1ull << (PAGE_SHIFT + 9 * level);
+}
+
+static inline PageTable* entry_table(uintptr_t entry) {
+    return phys_to_virt(entry & PTE_ADDR_MASK);
+}
+
+static inline bool is_leaf(uintptr_t entry, int level) {
+    return level == 0 || (level <= 2 && (entry & PAGE_HUGE));
+}
+
+static inline bool is_swap_entry(uintptr_t entry) {
+    return !(entry & PAGE_PRESENT) && (entry & PTE_SWAP);
+}
+
+static inline uint32_t swap_slot(uintptr_t entry) {
+    return (uint32_t)(entry >> PAGE_SHIFT);
+}
+
+static inline bool is_private(uintptr_t virtual_address) {
+    return virtual_address >= USER_SPACE_START && virtual_address < USER_SPACE_END;
+}
+
+// Top-level table an address is walked from
+static inline PageTable* root_table(uintptr_t virtual_address) {
+    return is_private(virtual_address) ? phys_to_virt(current_space->pml4) : &pml4;
+}
+
+static bool cpu_has_gb_pages(void) {
+    if (gb_pages < 0) {
+        uint32_t regs[4];
+        cpuid(0x80000000, regs);
+        gb_pages = 0;
+        if (regs[0] >= 0x80000001) {
+            cpuid(0x80000001, regs);
+            gb_pages = (regs[3] >> 26) & 1;
+        }
+    }
+    return gb_pages;
+}
+
+// Tag a zeroed frame as a VMM page table
+static PageTable* init_page_table(struct page* page) {
+    page->flags |= PG_PGTABLE;
+    page->inuse = 0;
+
+    uint64_t irq_flags = irq_save();
+    page_table_count++;
+    irq_restore(irq_flags);
+    return page_address(page);
+}
+
+static PageTable* allocate_page_table(void) {
+    struct page* page = alloc_zeroed_page();
+    if (!page) {
+        kprintf(ERROR, "[VMM] Out of memory for a page table\n");
+        return NULL;
+    }
+    return init_page_table(page);
+}
+
+static void free_page_table(PageTable* table) {
+    struct page* page = virt_to_page(table);
+    page->flags &= ~PG_PGTABLE;
+    free_pages(page);
+
+    uint64_t irq_flags = irq_save();
+    page_table_count--;
+    irq_restore(irq_flags);
+}
+
+void tlb_batch_init(struct tlb_batch* batch) {
+    batch->count = 0;
+    batch->invalidations = 0;
+    batch->shared = false;
+    batch->tables = NULL;
+}
+
+// Queue a live translation for invalidation
+static void tlb_batch_add(struct tlb_batch* batch, uintptr_t virtual_address) {
+    if (batch->count < TLB_BATCH_MAX) {
+        batch->addresses[batch->count] = virtual_address;
+    }
+    batch->count++;
+    batch->invalidations++;
+    batch->shared |= !is_private(virtual_address);
+}
+
+void tlb_batch_finish(struct tlb_batch* batch) {
+    uint64_t irq_flags = irq_save();
+    size_t flushes = 0;
+    if (batch->count > TLB_BATCH_MAX) {
+        reload_cr3();
+        flushes = 1;
+        tlb_full_flushes++;
+    } else {
+        for (size_t i = 0; i < batch->count; i++) {
+            invlpg(batch->addresses[i]);
+        }
+        flushes = batch->count;
+        tlb_page_flushes += flushes;
+    }
+    tlb_flushes_avoided += batch->invalidations - flushes;
+    if (batch->shared) {
+        // Other PCIDs may still cache the old kernel-half entries
+        current_space->tlb_gen = ++kernel_tlb_gen;
+    }
+    irq_restore(irq_flags);
+
+    while (batch->tables) {
+        struct page* page = batch->tables;
+        batch->tables = page->next;
+        free_page_table(page_address(page));
+    }
+    tlb_batch_init(batch);
+}
+
+// Present-entry accounting; only tables the VMM allocated are counted
+static void table_get(PageTable* table) {
+    struct page* page = virt_to_page(table);
+    if (page && (page->flags & PG_PGTABLE)) {
+        page->inuse++;
+    }
+}
+
+// Drop one entry, returning true when an owned table became empty
+static bool table_put(PageTable* table) {
+    struct page* page = virt_to_page(table);
+    if (!page || !(page->flags & PG_PGTABLE)) {
+        return false;
+    }
+    return --page->inuse == 0;
+}
+
+// Find the entry mapping an address under a given PML4, stopping at a leaf
+// or a hole
+static uintptr_t* lookup_entry_in(PageTable* table, uintptr_t virtual_address, int* level) {
+    for (int l = 3; ; l--) {
+        uintptr_t* entry = &table->entries[table_index(virtual_address, l)];
+        if (!(*entry & PAGE_PRESENT) || is_leaf(*entry, l)) {
+            *level = l;
+            return entry;
+        }
+        table = entry_table(*entry);
+    }
+}
+
+static uintptr_t* lookup_entry(uintptr_t virtual_address, int* level) {
+    return lookup_entry_in(root_table(virtual_address), virtual_address, level);
+}
+
+// Replace a large leaf with a table of next-size-down leaves over the same
+// frames; interrupts must be off
+static void split_leaf(uintptr_t* entry, int level, PageTable* table, uintptr_t virtual_address) {
+    uintptr_t old = *entry;
+    uintptr_t child_span = level_span(level - 1);
+    uintptr_t base = old & PTE_ADDR_MASK & ~(level_span(level) - 1);
+    uintptr_t attrs = old & (PAGE_SIZE - 1);
+
+    if (level == 1) {
+        // 4 KB leaves keep PAT where the PS bit was
+        attrs &= ~(uintptr_t)PAGE_HUGE;
+        if (old & PTE_PAT_HUGE) attrs |= PTE_PAT;
+    } else {
+        attrs |= old & PTE_PAT_HUGE;
+    }
 
-PageTable* allocate_page_table() {
-    if (next_free_page_table >= MAX_PAGE_TABLES) {
-        kprintf(ERROR, "Not enough space for Page Table");
-        return 0;
+    for (size_t i = 0; i < PAGE_ENTRIES; i++) {
+        table->entries[i] = (base + i * child_span) | attrs;
     }
+    virt_to_page(table)->inuse = PAGE_ENTRIES;
 
-    PageTable* table = &page_tables[next_free_page_table];
-    next_free_page_table++;
+    *entry = virt_to_phys(table) | PAGE_PRESENT | PAGE_WRITABLE | (old & PAGE_USER);
+    invlpg(virtual_address);
+    huge_splits++;
+}
+
+// Copy a new kernel-half PML4 entry into every address space
+static void share_kernel_slot(size_t index) {
+    for (struct address_space* space = kernel_space.next; space != &kernel_space; space = space->next) {
+        ((PageTable*)phys_to_virt(space->pml4))->entries[index] = pml4.entries[index];
+    }
+}
+
+// Walk to the table holding the level-`target` entry for an address,
+// linking in *spare where a table is missing or a large leaf needs
+// splitting. Interrupts must be off. Returns NULL if another table is needed.
+static PageTable* walk_create(uintptr_t virtual_address, int target, PageTable** spare) {
+    PageTable* table = root_table(virtual_address);
+    for (int level = 3; level > target; level--) {
+        uintptr_t* entry = &table->entries[table_index(virtual_address, level)];
+        if ((*entry & PAGE_PRESENT) && !is_leaf(*entry, level)) {
+            table = entry_table(*entry);
+            continue;
+        }
+        if (!*spare) {
+            return NULL;
+        }
+        if (*entry & PAGE_PRESENT) {
+            split_leaf(entry, level, *spare, virtual_address);
+        } else {
+            *entry = virt_to_phys(*spare) | PAGE_PRESENT | PAGE_WRITABLE;
+            table_get(table);
+            if (level == 3 && !is_private(virtual_address)) {
+                share_kernel_slot(table_index(virtual_address, 3));
+            }
+        }
+        table = *spare;
+        *spare = NULL;
+    }
     return table;
 }
 
-uintptr_t virtual_to_physical(uintptr_t virtual_address) {
-    uint64_t pml4_index = (virtual_address >> 39) & 0x1FF;
-    uint64_t pdpt_index = (virtual_address >> 30) & 0x1FF;
-    uint64_t pd_index = (virtual_address >> 21) & 0x1FF;
-    uint64_t pt_index = (virtual_address >> 12) & 0x1FF;
+// Write a leaf entry, queueing a flush only if it replaces a live translation
+static void set_leaf(PageTable* table, size_t index, uintptr_t virtual_address, uintptr_t value,
+                     struct tlb_batch* batch) {
+    uintptr_t* entry = &table->entries[index];
+    if (*entry & PAGE_PRESENT) {
+        tlb_batch_add(batch, virtual_address);
+    } else {
+        // A swapped-out page is already counted; its slot is dropped
+        if (is_swap_entry(*entry)) {
+            swap_free(swap_slot(*entry));
+        } else {
+            table_get(table);
+        }
+        batch->invalidations++;
+    }
+    *entry = value;
+}
 
-    if (!(pml4.entries[pml4_index] & PAGE_PRESENT)) {
-        return 0; // Not mapped
+// Write `value` into the entry at level `target` for an address, creating
+// tables and splitting large leaves above it as needed
+static int install_entry(uintptr_t virtual_address, int target, uintptr_t value, struct tlb_batch* batch) {
+    PageTable* spare = NULL;
+    int result = MAP_OK;
+
+    // Tables are allocated with interrupts on and the walk restarted, since
+    // the allocator may run shrinkers that unmap pages and free tables
+    for (;;) {
+        uint64_t irq_flags = irq_save();
+        PageTable* table = walk_create(virtual_address, target, &spare);
+        if (table) {
+            size_t index = table_index(virtual_address, target);
+            uintptr_t entry = table->entries[index];
+            if ((entry & PAGE_PRESENT) && !is_leaf(entry, target)) {
+                result = MAP_BUSY;
+            } else {
+                set_leaf(table, index, virtual_address, value, batch);
+            }
+        }
+        irq_restore(irq_flags);
+
+        if (table) {
+            break;
+        }
+        spare = allocate_page_table();
+        if (!spare) {
+            result = MAP_NOMEM;
+            break;
+        }
     }
 
-    uint64_t* pdpt_entry = (uint64_t*) (pml4.entries[pml4_index] & ~0xFFF);
-    if (!(pdpt_entry[pdpt_index] & PAGE_PRESENT)) {
-        return 0; // Not mapped
+    if (spare) {
+        free_page_table(spare);
     }
+    return result;
+}
 
-    uint64_t* pd_entry = (uint64_t*) (pdpt_entry[pdpt_index] & ~0xFFF);
-    if (!(pd_entry[pd_index] & PAGE_PRESENT)) {
-        return 0; // Not mapped
+// Point the entry at `level` for an address at a physical range
+static int install_leaf(uintptr_t virtual_address, uintptr_t physical_address, int target, uintptr_t flags,
+                        struct tlb_batch* batch) {
+    int result = install_entry(virtual_address, target,
+                               physical_address | PAGE_PRESENT | flags | (target ? PAGE_HUGE : 0), batch);
+    if (result == MAP_OK && target) {
+        uint64_t irq_flags = irq_save();
+        huge_mappings++;
+        irq_restore(irq_flags);
     }
+    return result;
+}
 
-    uint64_t* pt_entry = (uint64_t*) (pd_entry[pd_index] & ~0xFFF);
-    if (!(pt_entry[pt_index] & PAGE_PRESENT)) {
+uintptr_t virtual_to_physical(uintptr_t virtual_address) {
+    int level;
+    uintptr_t entry = *lookup_entry(virtual_address, &level);
+    if (!(entry & PAGE_PRESENT)) {
         return 0; // Not mapped
     }
 
-    return pt_entry[pt_index] & ~0xFFF; // Return the physical address without flags
+    // Huge leaves keep PAT in bit 12, so mask down to the leaf's own alignment
+    uintptr_t offset_mask = level_span(level) - 1;
+    return (entry & PTE_ADDR_MASK & ~offset_mask) | (virtual_address & offset_mask);
+}
+
+bool map_virtual_to_physical(uintptr_t virtual_address, uintptr_t physical_address, uint8_t flags) {
+    struct tlb_batch batch;
+    tlb_batch_init(&batch);
+    int result = install_leaf(virtual_address, physical_address, 0, flags, &batch);
+    tlb_batch_finish(&batch);
+    return result == MAP_OK;
 }
 
-void map_virtual_to_physical(uintptr_t virtual_address, uintptr_t physical_address, uint8_t flags) {
-    uint64_t pml4_index = (virtual_address >> 39) & 0x1FF;
-    uint64_t pdpt_index = (virtual_address >> 30) & 0x1FF;
-    uint64_t pd_index = (virtual_address >> 21) & 0x1FF;
-    uint64_t pt_index = (virtual_address >> 12) & 0x1FF;
+bool map_frames(uintptr_t virtual_address, const uintptr_t* frames, size_t count, uint8_t flags) {
+    struct tlb_batch batch;
+    tlb_batch_init(&batch);
+    PageTable* spare = NULL;
+    size_t done = 0;
 
-    if (!(pml4.entries[pml4_index] & PAGE_PRESENT)) {
-        pml4.entries[pml4_index] = (uint64_t) allocate_page_table() | PAGE_PRESENT | PAGE_WRITABLE;
+    while (done < count) {
+        uintptr_t address = virtual_address + done * PAGE_SIZE;
+        uint64_t irq_flags = irq_save();
+        PageTable* table = walk_create(address, 0, &spare);
+        if (table) {
+            // Fill the rest of this page table without walking down again
+            for (size_t i = table_index(address, 0); i < PAGE_ENTRIES && done < count; i++) {
+                set_leaf(table, i, address, frames[done] | PAGE_PRESENT | flags, &batch);
+                address += PAGE_SIZE;
+                done++;
+            }
+        }
+        irq_restore(irq_flags);
+
+        if (!table) {
+            spare = allocate_page_table();
+            if (!spare) {
+                break;
+            }
+        }
     }
 
-    uint64_t* pdpt_entry = (uint64_t*) (pml4.entries[pml4_index] & ~0xFFF);
-    if (!(pdpt_entry[pdpt_index] & PAGE_PRESENT)) {
-        pdpt_entry[pdpt_index] = (uint64_t) allocate_page_table() | PAGE_PRESENT | PAGE_WRITABLE;
+    if (spare) {
+        free_page_table(spare);
     }
+    tlb_batch_finish(&batch);
 
-    uint64_t* pd_entry = (uint64_t*) (pdpt_entry[pdpt_index] & ~0xFFF);
-    if (!(pd_entry[pd_index] & PAGE_PRESENT)) {
-        pd_entry[pd_index] = (uint64_t) allocate_page_table() | PAGE_PRESENT | PAGE_WRITABLE;
+    if (done < count) {
+        unmap_range(virtual_address, done * PAGE_SIZE);
+        return false;
     }
+    return true;
+}
 
-    uint64_t* pt_entry = (uint64_t*) (pd_entry[pd_index] & ~0xFFF);
-    pt_entry[pt_index] = physical_address | PAGE_PRESENT | flags;
+bool map_range(uintptr_t virtual_address, uintptr_t physical_address, size_t size, uint8_t flags) {
+    uintptr_t start = virtual_address;
+    uintptr_t end = virtual_address + ((size + PAGE_SIZE - 1) & ~(uintptr_t)(PAGE_SIZE - 1));
+    int max_level = cpu_has_gb_pages() ? 2 : 1;
+    struct tlb_batch batch;
+    tlb_batch_init(&batch);
 
-    invlpg(virtual_address);
+    while (virtual_address < end) {
+        int level = max_level;
+        while (level > 0 && (((virtual_address | physical_address) & (level_span(level) - 1)) ||
+                             end - virtual_address < level_span(level))) {
+            level--;
+        }
+
+        int result;
+        while ((result = install_leaf(virtual_address, physical_address, level, flags, &batch)) == MAP_BUSY) {
+            level--;
+        }
+        if (result != MAP_OK) {
+            tlb_batch_finish(&batch);
+            unmap_range(start, virtual_address - start);
+            return false;
+        }
+
+        virtual_address += level_span(level);
+        physical_address += level_span(level);
+    }
+    tlb_batch_finish(&batch);
+    return true;
+}
+
+// Break up the large page covering an address so part of it can change
+static bool split_mapping(uintptr_t virtual_address) {
+    PageTable* spare = allocate_page_table();
+    if (!spare) {
+        return false;
+    }
+
+    uint64_t irq_flags = irq_save();
+    int level;
+    uintptr_t* entry = lookup_entry(virtual_address, &level);
+    bool used = (*entry & PAGE_PRESENT) && level > 0;
+    if (used) {
+        split_leaf(entry, level, spare, virtual_address);
+    }
+    irq_restore(irq_flags);
+
+    if (!used) {
+        free_page_table(spare);
+    }
+    return true;
+}
+
+// Clear the leaf mapping an address and queue every table it leaves empty
+// for freeing after the flush. Interrupts must be off. Returns the old
+// entry, or 0 if nothing was mapped; *leaf_level is the level of the leaf
+// or of the hole. A swapped-out page is cleared too, giving up its slot.
+static uintptr_t clear_leaf(uintptr_t virtual_address, int* leaf_level, struct tlb_batch* batch) {
+    PageTable* tables[4];
+    uintptr_t* entries[4];
+    PageTable* table = root_table(virtual_address);
+    int level;
+
+    for (level = 3; ; level--) {
+        uintptr_t* entry = &table->entries[table_index(virtual_address, level)];
+        if (!(*entry & PAGE_PRESENT) && !is_swap_entry(*entry)) {
+            *leaf_level = level;
+            return 0;
+        }
+        tables[level] = table;
+        entries[level] = entry;
+        if (is_leaf(*entry, level)) {
+            break;
+        }
+        table = entry_table(*entry);
+    }
+
+    uintptr_t old = *entries[level];
+    *entries[level] = 0;
+    tlb_batch_add(batch, virtual_address);
+    *leaf_level = level;
+    if (is_swap_entry(old)) {
+        swap_free(swap_slot(old));
+        old = 0;
+    }
+
+    // Walk back up; the leaf's invlpg also drops cached paging-structure entries
+    for (; level < 3 && table_put(tables[level]); level++) {
+        if (level == 2 && !is_private(virtual_address)) {
+            break;  // Every address space points at this PDPT
+        }
+        *entries[level + 1] = 0;
+        struct page* page = virt_to_page(tables[level]);
+        page->next = batch->tables;
+        batch->tables = page;
+        batch->invalidations++;
+    }
+    return old;
+}
+
+uintptr_t unmap_virtual(uintptr_t virtual_address) {
+    // A 4 KB hole in a large page needs the page split down to 4 KB leaves first
+    for (;;) {
+        int level;
+        uint64_t irq_flags = irq_save();
+        uintptr_t entry = *lookup_entry(virtual_address, &level);
+        irq_restore(irq_flags);
+        if (!(entry & PAGE_PRESENT) || level == 0) {
+            break;
+        }
+        if (!split_mapping(virtual_address)) {
+            kprintf(WARN, "[VMM] Could not split the large page at %p\n", (void*)virtual_address);
+            return 0;
+        }
+    }
+
+    struct tlb_batch batch;
+    tlb_batch_init(&batch);
+    int level = 0;
+    uint64_t irq_flags = irq_save();
+    uintptr_t old = clear_leaf(virtual_address, &level, &batch);
+    irq_restore(irq_flags);
+    tlb_batch_finish(&batch);
+    return level == 0 ? old & PTE_ADDR_MASK : 0;
+}
+
+uintptr_t unmap_leaf(uintptr_t virtual_address, size_t* size, struct tlb_batch* batch) {
+    int level = 0;
+    uint64_t irq_flags = irq_save();
+    uintptr_t old = clear_leaf(virtual_address, &level, batch);
+    irq_restore(irq_flags);
+
+    *size = level_span(level);
+    return old & PTE_ADDR_MASK & ~(*size - 1);
+}
+
+void unmap_range(uintptr_t start, size_t size) {
+    uintptr_t address = start & ~(uintptr_t)(PAGE_SIZE - 1);
+    uintptr_t end = (start + size + PAGE_SIZE - 1) & ~(uintptr_t)(PAGE_SIZE - 1);
+    struct tlb_batch batch;
+    tlb_batch_init(&batch);
+
+    while (address < end) {
+        uint64_t irq_flags = irq_save();
+        int level;
+        uintptr_t entry = *lookup_entry(address, &level);
+        uintptr_t span = level_span(level);
+        uintptr_t next = (address & ~(span - 1)) + span;
+        bool partial = (entry & PAGE_PRESENT) && level > 0 &&
+                       ((address & (span - 1)) || next > end);
+
+        if (((entry & PAGE_PRESENT) || is_swap_entry(entry)) && !partial) {
+            clear_leaf(address, &level, &batch);
+        }
+        irq_restore(irq_flags);
+
+        if (partial) {
+            // Split, then look the address up again one level down
+            if (split_mapping(address)) {
+                continue;
+            }
+            kprintf(WARN, "[VMM] Could not split the large page at %p\n", (void*)address);
+        }
+
+        // Holes in upper levels are skipped a whole table at a time
+        if (next <= address) {
+            break;  // Wrapped past the top of the address space
+        }
+        address = next;
+    }
+    tlb_batch_finish(&batch);
+}
+
+// Give the current space its own copy of a large leaf from another space.
+// Returns MAP_STALE if the allocation let the swap shrinker split the leaf.
+static int copy_leaf(struct address_space* source, uintptr_t virtual_address, uintptr_t entry, int level,
+                     struct tlb_batch* batch) {
+    uintptr_t span = level_span(level);
+    struct page* block = alloc_pages(9 * level);
+    if (!block) {
+        return MAP_NOMEM;
+    }
+
+    int now_level;
+    uint64_t irq_flags = irq_save();
+    uintptr_t now = *lookup_entry_in(phys_to_virt(source->pml4), virtual_address, &now_level);
+    irq_restore(irq_flags);
+    if (now_level != level || ((now ^ entry) & ~(PTE_ACCESSED | PTE_DIRTY))) {
+        free_pages(block);
+        return MAP_STALE;
+    }
+    memcpy(page_address(block), phys_to_virt(entry & PTE_ADDR_MASK & ~(span - 1)), span);
+
+    uintptr_t flags = entry & (PAGE_SIZE - 1) & ~(uintptr_t)PAGE_HUGE;
+    int result = install_leaf(virtual_address & ~(span - 1), page_to_phys(block), level, flags, batch);
+    if (result != MAP_OK) {
+        free_pages(block);
+    }
+    return result;
+}
+
+bool share_range_cow(struct address_space* source, uintptr_t start, size_t size) {
+    uintptr_t end = start + size;
+    if (source == current_space || !is_private(start) || (size && !is_private(end - 1))) {
+        kprintf(ERROR, "[VMM] Cannot share %p+%u copy-on-write\n", (void*)start, size);
+        return false;
+    }
+
+    struct tlb_batch batch;
+    tlb_batch_init(&batch);
+    bool ok = true;
+
+    for (uintptr_t address = start; ok && address < end;) {
+        int level;
+        uint64_t irq_flags = irq_save();
+        uintptr_t* entry = lookup_entry_in(phys_to_virt(source->pml4), address, &level);
+        uintptr_t value = *entry;
+        bool swapped = is_swap_entry(value) && swap_dup(swap_slot(value));
+        if ((value & PAGE_PRESENT) && level == 0) {
+            if (value & PAGE_WRITABLE) {
+                value = (value & ~(uintptr_t)PAGE_WRITABLE) | PTE_COW;
+                *entry = value;
+            }
+            get_page(phys_to_page(value & PTE_ADDR_MASK));
+        }
+        irq_restore(irq_flags);
+
+        if ((value & PAGE_PRESENT) && level == 0) {
+            ok = install_leaf(address, value & PTE_ADDR_MASK, 0, value & ~PTE_ADDR_MASK, &batch) == MAP_OK;
+            if (!ok) {
+                put_page_testzero(phys_to_page(value & PTE_ADDR_MASK));
+            }
+        } else if (value & PAGE_PRESENT) {
+            // Large leaves are copied whole rather than shared
+            int result = copy_leaf(source, address, value, level, &batch);
+            if (result == MAP_STALE) {
+                continue;  // Look the address up again
+            }
+            ok = result == MAP_OK;
+        } else if (is_swap_entry(value)) {
+            // Each side reads its own copy back from the shared slot
+            ok = swapped && install_entry(address, 0, value, &batch) == MAP_OK;
+            if (swapped && !ok) {
+                swap_free(swap_slot(value));
+            }
+        }
+
+        uintptr_t span = level_span(level);
+        address = (address & ~(span - 1)) + span;
+    }
+
+    tlb_batch_finish(&batch);
+
+    // The source's PCID may still cache its entries as writable
+    uint64_t irq_flags = irq_save();
+    source->tlb_gen = 0;
+    irq_restore(irq_flags);
+    return ok;
+}
+
+// Give the current space its own writable copy of a copy-on-write page, or
+// just write access back when no other mapping is left
+static bool handle_cow_fault(uintptr_t virtual_address) {
+    int level;
+    uint64_t irq_flags = irq_save();
+    uintptr_t* entry = lookup_entry(virtual_address, &level);
+    uintptr_t value = *entry;
+    bool ok = (value & PAGE_PRESENT) && level == 0 && (value & PTE_COW);
+
+    if (ok) {
+        struct page* page = phys_to_page(value & PTE_ADDR_MASK);
+        if (page->flags & PG_SHARED) {
+            struct page* copy = alloc_atomic_page();
+            ok = copy != NULL;
+            if (ok) {
+                memcpy(page_address(copy), page_address(page), PAGE_SIZE);
+                put_page_testzero(page);
+                value = page_to_phys(copy) | (value & ~PTE_ADDR_MASK);
+                cow_copies++;
+            }
+        }
+    }
+    if (ok) {
+        *entry = (value & ~PTE_COW) | PAGE_WRITABLE;
+        invlpg(virtual_address);
+        cow_faults++;
+    }
+    irq_restore(irq_flags);
+    return ok;
+}
+
+// Install the leaf for a not-present page, taking the page tables on the
+// way from the atomic reserve. Returns false if nothing was installed:
+// *present then says whether the page had been mapped meanwhile, as
+// opposed to the reserve running dry.
+static bool map_fault_page(uintptr_t virtual_address, uintptr_t value, bool* present) {
+    struct tlb_batch batch;
+    tlb_batch_init(&batch);
+    PageTable* spare = NULL;
+    bool mapped = false;
+    *present = false;
+
+    for (;;) {
+        uint64_t irq_flags = irq_save();
+        PageTable* table = walk_create(virtual_address, 0, &spare);
+        if (table) {
+            size_t index = table_index(virtual_address, 0);
+            *present = table->entries[index] & PAGE_PRESENT;
+            if (!*present) {
+                set_leaf(table, index, virtual_address, value, &batch);
+                mapped = true;
+            }
+        }
+        irq_restore(irq_flags);
+
+        if (table) {
+            break;
+        }
+        struct page* page = alloc_atomic_page();
+        if (!page) {
+            break;
+        }
+        spare = init_page_table(page);
+    }
+    tlb_batch_finish(&batch);
+
+    // Whatever was not used is still zeroed and goes back to the reserve
+    if (spare) {
+        struct page* page = virt_to_page(spare);
+        page->flags &= ~PG_PGTABLE;
+        uint64_t irq_flags = irq_save();
+        page_table_count--;
+        irq_restore(irq_flags);
+        free_atomic_page(page);
+    }
+    return mapped;
+}
+
+// Back a not-present page with a zeroed frame
+static bool handle_demand_fault(uintptr_t virtual_address) {
+    struct page* frame = alloc_atomic_page();
+    if (!frame) {
+        return false;
+    }
+
+    bool present;
+    if (map_fault_page(virtual_address, page_to_phys(frame) | PAGE_PRESENT | PAGE_WRITABLE, &present)) {
+        return true;
+    }
+    free_atomic_page(frame);
+    return present;
+}
+
+// Map a page cache frame read-only, handing it the reference filemap_fault
+// took. If that fails the cache keeps the frame, unless it was invalidated
+// meanwhile and this was the last reference.
+static bool handle_file_fault(uintptr_t virtual_address, struct page* page) {
+    bool present;
+    if (map_fault_page(virtual_address, page_to_phys(page) | PAGE_PRESENT, &present)) {
+        return true;
+    }
+    if (put_page_testzero(page)) {
+        free_pages(page);
+    }
+    return present;
+}
+
+static struct page* swap_out(size_t nr_pages, bool split_ok);
+
+// A frame for swap-in once the atomic reserve has run dry, which under
+// memory pressure it stays until the idle loop runs: an unmapped page cache
+// frame, or failing that a cold private page swapped out in its place.
+// Neither needs to allocate. The frame is not zeroed.
+static struct page* reclaim_fault_frame(void) {
+    struct page* frame = filemap_reclaim_page();
+    return frame ? frame : swap_out(1, false);
+}
+
+// Read a swapped-out page back into a frame from the atomic reserve, or
+// one reclaimed on the spot, giving up its slot. Interrupts must be off.
+static bool handle_swap_fault(uintptr_t* entry) {
+    uintptr_t value = *entry;
+    struct page* frame = alloc_atomic_page();
+    if (!frame) {
+        frame = reclaim_fault_frame();
+    }
+    if (!frame) {
+        return false;
+    }
+    if (!swap_read_page(swap_slot(value), page_address(frame))) {
+        // The reserve only takes back zeroed frames
+        memset(page_address(frame), 0, PAGE_SIZE);
+        free_atomic_page(frame);
+        return false;
+    }
+
+    // Not present before, so nothing to flush
+    *entry = page_to_phys(frame) | PAGE_PRESENT | (value & (PAGE_SIZE - 1) & ~PTE_SWAP);
+    swap_free(swap_slot(value));
+    return true;
+}
+
+enum fault_result vmm_handle_fault(uintptr_t address, uint64_t error_code) {
+    address &= ~(uintptr_t)(PAGE_SIZE - 1);
+    if (error_code & PF_PRESENT) {
+        return (error_code & PF_WRITE) && handle_cow_fault(address) ? FAULT_MINOR : FAULT_FATAL;
+    }
+
+    int level;
+    uint64_t irq_flags = irq_save();
+    uintptr_t* entry = lookup_entry(address, &level);
+    if (is_swap_entry(*entry)) {
+        bool ok = handle_swap_fault(entry);
+        irq_restore(irq_flags);
+        return ok ? FAULT_MAJOR : FAULT_FATAL;
+    }
+    irq_restore(irq_flags);
+
+    struct page* page;
+    bool major;
+    if (filemap_fault(address, &page, &major)) {
+        if (!page || !handle_file_fault(address, page)) {
+            return FAULT_FATAL;
+        }
+        return major ? FAULT_MAJOR : FAULT_MINOR;
+    }
+    // Only the private half is demand-zero; a missing page anywhere else,
+    // the vmalloc window and direct map included, is a bug
+    if (!is_private(address)) {
+        return FAULT_FATAL;
+    }
+    return handle_demand_fault(address) ? FAULT_MINOR : FAULT_FATAL;
+}
+
+// State of one migrate_range pass
+struct migration {
+    uintptr_t start;
+    uintptr_t end;
+    struct page* (*alloc)(void);
+    struct address_space* space;  // Owner of the tables being walked
+    struct page* spare;           // Target frame not used yet
+    struct page* old;             // Frames moved away from
+    size_t moved;
+};
+
+static void migrate_leaf(uintptr_t* entry, uintptr_t virtual_address, struct migration* m) {
+    uintptr_t phys = *entry & PTE_ADDR_MASK;
+    struct page* old = phys >= m->start && phys < m->end ? phys_to_page(phys) : NULL;
+    // Frames shared copy-on-write or held by the page cache have other users
+    if (!old || old->flags != PG_ALLOCATED || old->order != 0) {
+        return;
+    }
+    if (!m->spare && !(m->spare = m->alloc())) {
+        return;
+    }
+
+    // Nothing can write the frame between the copy and the flush
+    uint64_t irq_flags = irq_save();
+    if ((*entry & PTE_ADDR_MASK) == phys) {
+        struct page* page = m->spare;
+        memcpy(page_address(page), page_address(old), PAGE_SIZE);
+        page->private = old->private;  // vmalloc keeps an area's size here
+        page->freelist = old->freelist;
+
+        struct tlb_batch batch;
+        tlb_batch_init(&batch);
+        *entry = (*entry & ~PTE_ADDR_MASK) | page_to_phys(page);
+        if (!is_private(virtual_address) || m->space == current_space) {
+            tlb_batch_add(&batch, virtual_address);
+        } else {
+            m->space->tlb_gen = 0;  // Flush its PCID when it is next loaded
+        }
+        tlb_batch_finish(&batch);
+
+        old->next = m->old;
+        m->old = old;
+        m->moved++;
+        m->spare = NULL;
+    }
+    irq_restore(irq_flags);
+}
+
+static void migrate_table(PageTable* table, int level, uintptr_t base, struct migration* m) {
+    for (size_t i = 0; i < PAGE_ENTRIES; i++) {
+        uintptr_t entry = table->entries[i];
+        uintptr_t virtual_address = base + i * level_span(level);
+        if (!(entry & PAGE_PRESENT)) {
+            continue;
+        }
+        if (level == 0) {
+            migrate_leaf(&table->entries[i], virtual_address, m);
+        } else if (!is_leaf(entry, level)) {
+            migrate_table(entry_table(entry), level - 1, virtual_address, m);
+        }
+    }
+}
+
+// Walk PML4 slots [first, last] of a space
+static void migrate_slots(struct address_space* space, size_t first, size_t last, struct migration* m) {
+    PageTable* root = phys_to_virt(space->pml4);
+    m->space = space;
+    for (size_t slot = first; slot <= last; slot++) {
+        if (root->entries[slot] & PAGE_PRESENT) {
+            uintptr_t base = slot * level_span(3);
+            if (slot >= KERNEL_SLOTS_START) {
+                base |= 0xFFFF000000000000ull;  // Sign-extend into the upper half
+            }
+            migrate_table(entry_table(root->entries[slot]), 2, base, m);
+        }
+    }
+}
+
+struct page* migrate_range(uintptr_t start, uintptr_t end, struct page* (*alloc)(void), size_t* moved) {
+    struct migration m = { .start = start, .end = end, .alloc = alloc };
+
+    migrate_slots(&kernel_space, table_index(VMALLOC_START, 3),
+                  table_index(VMALLOC_START + VMALLOC_SIZE - 1, 3), &m);
+    struct address_space* space = &kernel_space;
+    do {
+        migrate_slots(space, table_index(USER_SPACE_START, 3), table_index(USER_SPACE_END - 1, 3), &m);
+        space = space->next;
+    } while (space != &kernel_space);
+
+    if (m.spare) {
+        free_pages(m.spare);
+    }
+    *moved = m.moved;
+    return m.old;
+}
+
+// Break a cold 2 MB private leaf into 4 KB leaves, and its block into
+// single frames, so its pages can be swapped out one by one. Returns false
+// if it stayed whole.
+static bool split_cold_leaf(struct address_space* space, uintptr_t virtual_address) {
+    struct page* page = try_alloc_pages(0);
+    if (!page) {
+        return false;
+    }
+    PageTable* table = init_page_table(page);
+
+    int level;
+    uint64_t irq_flags = irq_save();
+    uintptr_t* entry = lookup_entry_in(phys_to_virt(space->pml4), virtual_address, &level);
+    struct page* block = (*entry & PAGE_PRESENT) && level == 1 ? phys_to_page(*entry & PTE_ADDR_MASK) : NULL;
+    bool split = block && !(*entry & PTE_ACCESSED) && block->flags == PG_ALLOCATED && block->order == 9;
+    if (split) {
+        split_leaf(entry, level, table, virtual_address);
+        if (space != current_space) {
+            space->tlb_gen = 0;  // split_leaf's invlpg only reached the current PCID
+        }
+        for (size_t i = 0; i < PAGE_ENTRIES; i++) {
+            block[i].flags = PG_ALLOCATED;
+            block[i].order = 0;
+            block[i].private = NULL;
+        }
+    }
+    irq_restore(irq_flags);
+
+    if (!split) {
+        free_page_table(table);
+    }
+    return split;
+}
+
+// One clock sweep for swap_out_anonymous, returning the frames it swapped
+// out once they are flushed from the TLB. Cold 2 MB leaves are only split,
+// which allocates, if `split_ok`.
+static struct page* swap_out(size_t nr_pages, bool split_ok) {
+    struct tlb_batch batch;
+    tlb_batch_init(&batch);
+    struct page* frames = NULL;
+    size_t freed = 0;
+    size_t budget = nr_pages * SWAP_SCAN_RATIO + SWAP_SCAN_MIN;
+    uint32_t laps = 0;
+    bool full = false;
+
+    while (freed < nr_pages && budget && laps < SWAP_MAX_LAPS && !full) {
+        struct address_space* space = hand_space;
+        uintptr_t address = hand_address;
+        bool split = false;
+        int level;
+
+        uint64_t irq_flags = irq_save();
+        uintptr_t* entry = lookup_entry_in(phys_to_virt(space->pml4), address, &level);
+        uintptr_t value = *entry;
+        struct page* page = (value & PAGE_PRESENT) && level <= 1 ? phys_to_page(value & PTE_ADDR_MASK) : NULL;
+        if (page && (value & PTE_ACCESSED)) {
+            // Used since the hand last came by: another lap to prove it cold.
+            // A stale TLB entry only makes the page look colder.
+            *entry = value & ~PTE_ACCESSED;
+            budget--;
+        } else if (page && level == 1) {
+            split = split_ok && page->flags == PG_ALLOCATED && page->order == 9;
+        } else if (page && page->flags == PG_ALLOCATED && page->order == 0) {
+            // Frames shared copy-on-write, cached or owned elsewhere stay
+            uint32_t slot = swap_write_page(page_address(page));
+            full = slot == SWAP_NONE;
+            if (!full) {
+                *entry = ((uintptr_t)slot << PAGE_SHIFT) | PTE_SWAP |
+                         (value & (PAGE_SIZE - 1) & ~(uintptr_t)(PAGE_PRESENT | PTE_ACCESSED | PTE_DIRTY));
+                if (space == current_space) {
+                    tlb_batch_add(&batch, address);
+                } else {
+                    space->tlb_gen = 0;  // Flush its PCID when it is next loaded
+                }
+                page->next = frames;
+                frames = page;
+                freed++;
+            }
+            budget--;
+        }
+        irq_restore(irq_flags);
+
+        if (split && split_cold_leaf(space, address)) {
+            // Look at the same address again, now through 4 KB leaves
+            budget--;
+            continue;
+        }
+
+        uintptr_t span = level_span(level);
+        address = (address & ~(span - 1)) + span;
+        irq_flags = irq_save();
+        if (hand_space == space) {
+            hand_address = address;
+            if (address >= USER_SPACE_END) {
+                hand_space = space->next;
+                hand_address = USER_SPACE_START;
+                laps += hand_space == &kernel_space;
+            }
+        }
+        irq_restore(irq_flags);
+    }
+
+    // The frames may still be cached in the TLB until the flush
+    tlb_batch_finish(&batch);
+    return frames;
+}
+
+size_t swap_out_anonymous(size_t nr_pages) {
+    struct page* frames = swap_out(nr_pages, true);
+    size_t freed = 0;
+    while (frames) {
+        struct page* page = frames;
+        frames = page->next;
+        page->next = NULL;
+        free_pages(page);
+        freed++;
+    }
+    return freed;
+}
+
+// Pages under `table` that swap_out could take, counting a 2 MB leaf it
+// would split as all of its pages, stopping once `limit` is reached
+static size_t count_swappable(PageTable* table, int level, size_t limit) {
+    size_t count = 0;
+    for (size_t i = 0; i < PAGE_ENTRIES && count < limit; i++) {
+        uintptr_t entry = table->entries[i];
+        if (!(entry & PAGE_PRESENT)) {
+            continue;
+        }
+        if (!is_leaf(entry, level)) {
+            count += count_swappable(entry_table(entry), level - 1, limit - count);
+            continue;
+        }
+        struct page* page = level <= 1 ? phys_to_page(entry & PTE_ADDR_MASK) : NULL;
+        if (page && page->flags == PG_ALLOCATED && page->order == (level ? 9 : 0)) {
+            count += level ? PAGE_ENTRIES : 1;
+        }
+    }
+    return count;
+}
+
+size_t count_anonymous_pages(size_t limit) {
+    size_t count = 0;
+    struct address_space* space = &kernel_space;
+    do {
+        uint64_t irq_flags = irq_save();
+        PageTable* root = phys_to_virt(space->pml4);
+        for (size_t i = table_index(USER_SPACE_START, 3); i <= table_index(USER_SPACE_END - 1, 3) && count < limit; i++) {
+            if (root->entries[i] & PAGE_PRESENT) {
+                count += count_swappable(entry_table(root->entries[i]), 2, limit - count);
+            }
+        }
+        space = space->next;
+        irq_restore(irq_flags);
+    } while (space != &kernel_space && count < limit);
+    return count < limit ? count : limit;
+}
+
+size_t direct_map_tables_needed(uint64_t max_phys, uint32_t ranges) {
+    uint64_t pdpts = (max_phys + level_span(3) - 1) / level_span(3);
+    // With 1 GB leaves only a partial gigabyte at either end of a range
+    // needs a page directory
+    uint64_t pds = cpu_has_gb_pages() ? 2ull * ranges : (max_phys + level_span(2) - 1) / level_span(2);
+    return (pdpts + pds) * PAGE_SIZE;
+}
+
+// Follow an entry of the direct map under construction, linking in a
+// cleared table from the pool if it is empty. Pool frames lie in the
+// identity map, so their physical address is also their virtual one.
+static PageTable* direct_map_table(uintptr_t* entry, uintptr_t* pool, uintptr_t pool_end) {
+    if (!(*entry & PAGE_PRESENT)) {
+        if (*pool + PAGE_SIZE > pool_end) {
+            return NULL;
+        }
+        memset((void*)*pool, 0, PAGE_SIZE);
+        *entry = *pool | PAGE_PRESENT | PAGE_WRITABLE;
+        *pool += PAGE_SIZE;
+    }
+    return (PageTable*)(*entry & PTE_ADDR_MASK);
+}
+
+bool direct_map_range(uint64_t start, uint64_t end, uintptr_t* pool, uintptr_t pool_end) {
+    start &= ~(level_span(1) - 1);
+    end = (end + level_span(1) - 1) & ~(level_span(1) - 1);
+    if (end > DIRECT_MAP_SIZE) {
+        end = DIRECT_MAP_SIZE;
+    }
+
+    // Nothing maps these addresses yet, so no flushes are needed. The new
+    // PML4 slots are copied into each address space as it is created.
+    while (start < end) {
+        uintptr_t virtual_address = DIRECT_MAP_BASE + start;
+        PageTable* pdpt = direct_map_table(&pml4.entries[table_index(virtual_address, 3)], pool, pool_end);
+        if (!pdpt) {
+            return false;
+        }
+
+        uintptr_t* entry = &pdpt->entries[table_index(virtual_address, 2)];
+        int level = 1;
+        if (*entry & PAGE_HUGE) {
+            // A 1 GB leaf from an earlier range already covers this
+            start = (start & ~(level_span(2) - 1)) + level_span(2);
+            continue;
+        }
+        if (!(*entry & PAGE_PRESENT) && cpu_has_gb_pages() &&
+            !(start & (level_span(2) - 1)) && end - start >= level_span(2)) {
+            level = 2;
+        } else {
+            PageTable* pd = direct_map_table(entry, pool, pool_end);
+            if (!pd) {
+                return false;
+            }
+            entry = &pd->entries[table_index(virtual_address, 1)];
+        }
+
+        // Neighbouring ranges may share a 2 MB page after rounding
+        if (!(*entry & PAGE_PRESENT)) {
+            *entry = start | PAGE_PRESENT | PAGE_WRITABLE | PAGE_HUGE;
+            direct_map_bytes += level_span(level);
+            direct_leaves[level]++;
+        }
+        start += level_span(level);
+    }
+    return true;
+}
+
+void vmm_init(void) {
+    space_cache = kmem_cache_create("address_space", sizeof(struct address_space), NULL);
+    if (!space_cache) {
+        kprintf(ERROR, "[VMM] Failed to create the address_space cache\n");
+    }
+
+    uint32_t regs[4];
+    cpuid(1, regs);
+    if ((regs[2] >> 17) & 1) {
+        // CR3 still holds PCID 0 here, as turning PCIDE on requires
+        write_cr4(read_cr4() | CR4_PCIDE);
+        pcid_enabled = true;
+    }
+    kprintf(INFO, "[VMM] Address spaces %s PCID\n", pcid_enabled ? "with" : "without");
+}
+
+struct address_space* address_space_create(void) {
+    if (!space_cache) {
+        kprintf(ERROR, "[VMM] Called before vmm_init\n");
+        return NULL;
+    }
+    struct address_space* space = kmem_cache_alloc(space_cache);
+    if (!space) {
+        return NULL;
+    }
+    PageTable* table = allocate_page_table();
+    if (!table) {
+        kmem_cache_free(space_cache, space);
+        return NULL;
+    }
+    space->pml4 = virt_to_phys(table);
+
+    uint64_t irq_flags = irq_save();
+    table->entries[0] = pml4.entries[0];
+    for (size_t i = KERNEL_SLOTS_START; i < PAGE_ENTRIES; i++) {
+        table->entries[i] = pml4.entries[i];
+    }
+
+    // PCIDs are handed out round robin; one still owned by an older space
+    // is simply flushed when the new space first loads
+    space->pcid = next_pcid;
+    next_pcid = next_pcid + 1 < NR_PCIDS ? next_pcid + 1 : 1;
+    space->tlb_gen = 0;
+    space->next = &kernel_space;
+    space->prev = kernel_space.prev;
+    kernel_space.prev->next = space;
+    kernel_space.prev = space;
+    nr_spaces++;
+    irq_restore(irq_flags);
+    return space;
+}
+
+// Free a private table and everything below it; leaves are left alone,
+// but the slots of swapped-out pages are released
+static void free_tables(PageTable* table, int level) {
+    for (size_t i = 0; i < PAGE_ENTRIES; i++) {
+        uintptr_t entry = table->entries[i];
+        if (is_swap_entry(entry)) {
+            swap_free(swap_slot(entry));
+        } else if (level > 0 && (entry & PAGE_PRESENT) && !is_leaf(entry, level)) {
+            free_tables(entry_table(entry), level - 1);
+        }
+    }
+    free_page_table(table);
+}
+
+void address_space_destroy(struct address_space* space) {
+    if (!space || space == &kernel_space) return;
+
+    if (current_space == space) {
+        address_space_switch(&kernel_space);
+    }
+
+    uint64_t irq_flags = irq_save();
+    space->prev->next = space->next;
+    space->next->prev = space->prev;
+    if (pcid_owner[space->pcid] == space) {
+        pcid_owner[space->pcid] = NULL;
+    }
+    if (hand_space == space) {
+        hand_space = space->next;
+        hand_address = USER_SPACE_START;
+    }
+    nr_spaces--;
+    irq_restore(irq_flags);
+
+    // The PCID is flushed before anyone reuses it, so nothing can still
+    // walk these tables
+    PageTable* root = phys_to_virt(space->pml4);
+    for (size_t i = 1; i < KERNEL_SLOTS_START; i++) {
+        if (root->entries[i] & PAGE_PRESENT) {
+            free_tables(entry_table(root->entries[i]), 2);
+        }
+    }
+    free_page_table(root);
+    kmem_cache_free(space_cache, space);
+}
+
+struct address_space* address_space_switch(struct address_space* space) {
+    uint64_t irq_flags = irq_save();
+    struct address_space* prev = current_space;
+    if (space != prev) {
+        uintptr_t cr3 = space->pml4;
+        bool flush = true;
+        if (pcid_enabled) {
+            flush = pcid_owner[space->pcid] != space || space->tlb_gen != kernel_tlb_gen;
+            cr3 |= space->pcid | (flush ? 0 : CR3_NOFLUSH);
+            pcid_owner[space->pcid] = space;
+        }
+        space->tlb_gen = kernel_tlb_gen;
+        current_space = space;
+        write_cr3(cr3);
+
+        space_switches++;
+        if (flush) {
+            switch_flushes++;
+        }
+    }
+    irq_restore(irq_flags);
+    return prev;
+}
+
+struct address_space* current_address_space(void) {
+    return current_space;
+}
+
+void vmm_get_stats(struct vmm_stats* stats) {
+    uint64_t irq_flags = irq_save();
+    stats->page_tables = page_table_count;
+    stats->huge_mappings = huge_mappings;
+    stats->splits = huge_splits;
+    stats->tlb_page_flushes = tlb_page_flushes;
+    stats->tlb_full_flushes = tlb_full_flushes;
+    stats->tlb_flushes_avoided = tlb_flushes_avoided;
+    stats->address_spaces = nr_spaces;
+    stats->space_switches = space_switches;
+    stats->switch_flushes = switch_flushes;
+    stats->cow_faults = cow_faults;
+    stats->cow_copies = cow_copies;
+    stats->direct_map = direct_map_bytes;
+    stats->direct_gb_pages = direct_leaves[2];
+    stats->direct_2mb_pages = direct_leaves[1];
+    irq_restore(irq_flags);
+}
+
+#define TEST_ADDRESS USER_SPACE_START
+
+void address_space_test(void) {
+    kprintf(INFO, "[VMM] Starting address space tests...\n");
+
+    struct address_space* spaces[2] = { address_space_create(), address_space_create() };
+    struct page* frames[2] = { alloc_zeroed_page(), alloc_zeroed_page() };
+    if (!spaces[0] || !spaces[1] || !frames[0] || !frames[1]) {
+        kprintf(ERROR, "[VMM] Address space setup failed\n");
+        address_space_destroy(spaces[0]);
+        address_space_destroy(spaces[1]);
+        free_pages(frames[0]);
+        free_pages(frames[1]);
+        return;
+    }
+    struct address_space* prev = current_address_space();
+
+    // The same private address maps a different frame in each space
+    volatile uint64_t* value = (volatile uint64_t*)TEST_ADDRESS;
+    bool ok = true;
+    for (int i = 0; i < 2; i++) {
+        address_space_switch(spaces[i]);
+        ok = ok && map_virtual_to_physical(TEST_ADDRESS, page_to_phys(frames[i]), PAGE_PRESENT | PAGE_WRITABLE);
+        if (ok) {
+            *value = 0xA0 + i;
+        }
+    }
+    address_space_switch(spaces[0]);
+    if (ok && *value == 0xA0 && virtual_to_physical(TEST_ADDRESS) == page_to_phys(frames[0])) {
+        kprintf(INFO, "[VMM] Private mapping test passed\n");
+    } else {
+        kprintf(ERROR, "[VMM] Private mapping test failed\n");
+    }
+
+    // The frame behind it is reachable through the direct map as well
+    volatile uint64_t* direct = page_address(frames[0]);
+    if ((uintptr_t)direct - DIRECT_MAP_BASE < DIRECT_MAP_SIZE && *direct == 0xA0 &&
+        virtual_to_physical((uintptr_t)direct) == page_to_phys(frames[0])) {
+        kprintf(INFO, "[VMM] Direct map test passed\n");
+    } else {
+        kprintf(ERROR, "[VMM] Direct map test failed\n");
+    }
+
+    // Kernel-half changes made in one space show up in the others
+    volatile uint64_t* shared = vmalloc(PAGE_SIZE);
+    if (shared) {
+        *shared = 0xC0FFEE;
+        address_space_switch(spaces[1]);
+        if (*shared == 0xC0FFEE && *value == 0xA1) {
+            kprintf(INFO, "[VMM] Shared kernel half test passed\n");
+        } else {
+            kprintf(ERROR, "[VMM] Shared kernel half test failed\n");
+        }
+        vfree((void*)shared);
+    }
+
+    // Touching an unmapped private page faults in a zeroed frame
+    address_space_switch(spaces[1]);
+    volatile uint64_t* fresh = (volatile uint64_t*)(TEST_ADDRESS + PAGE_SIZE);
+    uintptr_t fresh_phys = 0;
+    if (*fresh == 0 && (fresh_phys = virtual_to_physical((uintptr_t)fresh)) != 0) {
+        kprintf(INFO, "[VMM] Demand fault test passed\n");
+    } else {
+        kprintf(ERROR, "[VMM] Demand fault test failed\n");
+    }
+    if (fresh_phys && unmap_virtual((uintptr_t)fresh)) {
+        free_pages(phys_to_page(fresh_phys));
+    }
+
+    // A copy-on-write clone reads the source's frame until it writes
+    struct address_space* clone = address_space_create();
+    if (clone) {
+        address_space_switch(clone);
+        bool shared_ok = share_range_cow(spaces[0], TEST_ADDRESS, PAGE_SIZE) && *value == 0xA0 &&
+                         virtual_to_physical(TEST_ADDRESS) == page_to_phys(frames[0]);
+        if (shared_ok) {
+            *value = 0xB0;
+        }
+        bool copied = shared_ok && virtual_to_physical(TEST_ADDRESS) != page_to_phys(frames[0]);
+
+        // The source now holds the only mapping and just gets write access back
+        address_space_switch(spaces[0]);
+        bool kept = *value == 0xA0;
+        if (copied) {
+            *value = 0xA2;
+        }
+        kept = kept && virtual_to_physical(TEST_ADDRESS) == page_to_phys(frames[0]);
+
+        if (copied && kept) {
+            kprintf(INFO, "[VMM] Copy-on-write test passed\n");
+        } else {
+            kprintf(ERROR, "[VMM] Copy-on-write test failed\n");
+        }
+
+        address_space_switch(clone);
+        uintptr_t phys = unmap_virtual(TEST_ADDRESS);
+        if (phys && put_page_testzero(phys_to_page(phys))) {
+            free_pages(phys_to_page(phys));
+        }
+        address_space_switch(spaces[0]);
+        address_space_destroy(clone);
+    }
+
+    for (int i = 0; i < 2; i++) {
+        address_space_switch(spaces[i]);
+        unmap_virtual(TEST_ADDRESS);
+    }
+    address_space_switch(prev);
+    for (int i = 0; i < 2; i++) {
+        address_space_destroy(spaces[i]);
+        free_pages(frames[i]);
+    }
+
+    kprintf(INFO, "[VMM] Address space tests completed\n");
 }
@@ -55,6 +55,21 @@ bool mutex_try_acquire(mutex_t* mutex) {
     return false;
 }
 
+// Interrupt state helpers
+#define RFLAGS_IF 0x200
+
+uint64_t irq_save(void) {
+    uint64_t flags;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+void irq_restore(uint64_t flags) {
+    if (flags & RFLAGS_IF) {
+        __asm__ volatile("sti" : : : "memory");
+    }
+}
+
 // Semaphore implementation
 void semaphore_init(semaphore_t* sem, int32_t initial_count, const char* name) {
     sem->count = initial_count;
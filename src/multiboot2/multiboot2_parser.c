@@ -5,12 +5,48 @@ extern struct multiboot_tag* multiboot_addr;
 
 static uint64_t total_ram = 0;
 
+static struct memory_region memory_map[MAX_MEMORY_REGIONS];
+static uint32_t memory_region_count = 0;
+
 uint64_t get_total_ram() {
     return total_ram;
 }
 
+const struct memory_region* multiboot2_get_memory_map(uint32_t* count) {
+    if (count) {
+        *count = memory_region_count;
+    }
+    return memory_map;
+}
+
+void multiboot2_get_info_range(uintptr_t* start, uintptr_t* end) {
+    uintptr_t info = (uintptr_t) multiboot_addr;
+    // The first field of the boot information is its total size
+    *start = info;
+    *end = info + *(multiboot_uint32_t*) info;
+}
+
+static void parse_mmap(struct multiboot_tag_mmap* mmap) {
+    for (multiboot_memory_map_t* entry = mmap->entries;
+            (multiboot_uint8_t*) entry < (multiboot_uint8_t*) mmap + mmap->size;
+            entry = (multiboot_memory_map_t*) ((multiboot_uint8_t*) entry + mmap->entry_size))
+    {
+        if (memory_region_count >= MAX_MEMORY_REGIONS) {
+            kprintf(WARN, "Memory map has more than %d entries, ignoring the rest\n", MAX_MEMORY_REGIONS);
+            break;
+        }
+
+        struct memory_region* region = &memory_map[memory_region_count++];
+        region->base = entry->addr;
+        region->length = entry->len;
+        region->type = entry->type;
+    }
+}
+
 void multiboot2_parse() {
-    
+    uint64_t meminfo_ram = 0;
+    uint64_t mmap_ram = 0;
+
     for (struct multiboot_tag* tag = (struct multiboot_tag*)((multiboot_uint8_t*) multiboot_addr + 8);
             tag->type != MULTIBOOT_TAG_TYPE_END;
             tag = (struct multiboot_tag*) ((multiboot_uint8_t*) tag + ((tag->size + 7) & ~7))) 
@@ -19,8 +55,22 @@ void multiboot2_parse() {
         switch (tag->type) {
             case MULTIBOOT_TAG_TYPE_BASIC_MEMINFO: {
                 struct multiboot_tag_basic_meminfo* basic_meminfo = (struct multiboot_tag_basic_meminfo*) tag;
-                total_ram = basic_meminfo->mem_upper - basic_meminfo->mem_lower;
+                meminfo_ram = basic_meminfo->mem_upper - basic_meminfo->mem_lower;
+                break;
+            }
+            case MULTIBOOT_TAG_TYPE_MMAP: {
+                parse_mmap((struct multiboot_tag_mmap*) tag);
+                break;
             }
         }
     }
+
+    for (uint32_t i = 0; i < memory_region_count; i++) {
+        if (memory_map[i].type == MULTIBOOT_MEMORY_AVAILABLE) {
+            mmap_ram += memory_map[i].length;
+        }
+    }
+
+    // Prefer the memory map; basic meminfo only covers the first hole
+    total_ram = memory_region_count ? mmap_ram / 1024 : meminfo_ram;
 }
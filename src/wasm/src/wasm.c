@@ -1,6 +1,8 @@
 #include "wasm/wasm.h"
 #include "kernel/mm/kmalloc.h"
+#include "kernel/mm/vmalloc.h"
 #include "kernel/kprintf.h"
+#include "fs/vfs.h"
 #include "wasm/wasm_parser.h"
 #include "wasm/wasm_exec.h"
 #include <string.h>
@@ -25,42 +27,37 @@ static bool validate_wasm_header(const uint8_t* bytes) {
 }
 
 // Create a new WebAssembly module
-wasm_module_t* wasm_module_new(const uint8_t* bytes, size_t size) {
-    if (!bytes || size < 8) {
-        kprintf(ERROR, "Invalid WebAssembly module data\n");
-        return NULL;
-    }
-    
-    // Validate WebAssembly header
-    if (!validate_wasm_header(bytes)) {
-        return NULL;
-    }
-    
+// Parse a module around bytes it then owns
+static wasm_module_t* module_create(uint8_t* bytes, size_t size, bool mapped) {
     // Allocate module structure
     wasm_module_t* module = kmalloc(sizeof(wasm_module_t));
     if (!module) {
         kprintf(ERROR, "Failed to allocate WebAssembly module structure\n");
+        if (mapped) {
+            vfs_munmap(bytes);
+        } else {
+            kfree(bytes);
+        }
         return NULL;
     }
     
     // Initialize module fields
-    module->bytes = kmalloc(size);
-    if (!module->bytes) {
-        kprintf(ERROR, "Failed to allocate %d bytes for module data\n", size);
-        kfree(module);
-        return NULL;
-    }
-    
-    memcpy(module->bytes, bytes, size);
+    module->bytes = bytes;
     module->size = size;
+    module->mapped = mapped;
     module->types = NULL;
     module->type_count = 0;
     module->functions = NULL;
     module->function_count = 0;
     module->exports = NULL;
     module->export_count = 0;
+    module->imports = NULL;
+    module->import_count = 0;
     module->memory_initial = 0;
     module->memory_max = 0;
+    module->globals = NULL;
+    module->global_count = 0;
+    arena_init(&module->arena, size);
     
     kprintf(INFO, "Initializing WebAssembly module with %d bytes\n", size);
     
@@ -75,58 +72,46 @@ wasm_module_t* wasm_module_new(const uint8_t* bytes, size_t size) {
     return module;
 }
 
-// Delete a WebAssembly module
-void wasm_module_delete(wasm_module_t* module) {
-    if (!module) return;
-    
-    // Free function types
-    if (module->types) {
-        for (uint32_t i = 0; i < module->type_count; i++) {
-            if (module->types[i].params) {
-                kfree(module->types[i].params);
-            }
-            if (module->types[i].results) {
-                kfree(module->types[i].results);
-            }
-        }
-        kfree(module->types);
+wasm_module_t* wasm_module_new(const uint8_t* bytes, size_t size) {
+    if (!bytes || size < 8) {
+        kprintf(ERROR, "Invalid WebAssembly module data\n");
+        return NULL;
     }
     
-    // Free imports
-    if (module->imports) {
-        for (uint32_t i = 0; i < module->import_count; i++) {
-            if (module->imports[i].module_name) {
-                kfree(module->imports[i].module_name);
-            }
-            if (module->imports[i].field_name) {
-                kfree(module->imports[i].field_name);
-            }
-        }
-        kfree(module->imports);
+    // Validate WebAssembly header
+    if (!validate_wasm_header(bytes)) {
+        return NULL;
     }
     
-    // Free functions
-    if (module->functions) {
-        for (uint32_t i = 0; i < module->function_count; i++) {
-            if (module->functions[i].code) {
-                kfree(module->functions[i].code);
-            }
-        }
-        kfree(module->functions);
+    uint8_t* copy = kmalloc_uninit(size);
+    if (!copy) {
+        kprintf(ERROR, "Failed to allocate %d bytes for module data\n", size);
+        return NULL;
     }
-    
-    // Free exports
-    if (module->exports) {
-        for (uint32_t i = 0; i < module->export_count; i++) {
-            if (module->exports[i].name) {
-                kfree(module->exports[i].name);
-            }
-        }
-        kfree(module->exports);
+    memcpy(copy, bytes, size);
+    return module_create(copy, size, false);
+}
+
+wasm_module_t* wasm_module_new_mapped(uint8_t* bytes, size_t size) {
+    if (!bytes || size < 8 || !validate_wasm_header(bytes)) {
+        kprintf(ERROR, "Invalid WebAssembly module data\n");
+        vfs_munmap(bytes);
+        return NULL;
     }
+    return module_create(bytes, size, true);
+}
+
+// Delete a WebAssembly module
+void wasm_module_delete(wasm_module_t* module) {
+    if (!module) return;
+    
+    // Types, imports, functions, exports and globals all live in the arena
+    arena_release(&module->arena);
     
     // Free module bytes
-    if (module->bytes) {
+    if (module->mapped) {
+        vfs_munmap(module->bytes);
+    } else if (module->bytes) {
         kfree(module->bytes);
     }
     
@@ -216,6 +201,16 @@ static bool host_print(wasm_instance_t* instance, wasm_value_t* args, uint32_t a
     return true;
 }
 
+// Free an instance's linear memory along with its address space
+static void release_memory(wasm_instance_t* instance) {
+    if (!instance->space) return;
+
+    struct address_space* prev = address_space_switch(instance->space);
+    unmap_anonymous(WASM_MEMORY_BASE, instance->memory_size);
+    address_space_switch(prev);
+    address_space_destroy(instance->space);
+}
+
 // Create a new WebAssembly instance
 wasm_instance_t* wasm_instance_new(wasm_module_t* module) {
     if (!module) {
@@ -235,29 +230,36 @@ wasm_instance_t* wasm_instance_new(wasm_module_t* module) {
     
     instance->module = module;
     
-    // Initialize memory if needed
-    if (module->memory_initial > 0) {
-        size_t memory_size = module->memory_initial * 65536;  // 64KB pages
-        instance->memory = kmalloc(memory_size);
-        if (!instance->memory) {
+    // Every instance gets a whole reservation in its own address space,
+    // even without a memory section, so loads and stores never need a
+    // bounds check
+    instance->space = address_space_create();
+    if (!instance->space) {
+        kprintf(ERROR, "Failed to create WebAssembly address space\n");
+        kfree(instance);
+        return NULL;
+    }
+    instance->memory = (void*)WASM_MEMORY_BASE;
+    instance->memory_size = (size_t)module->memory_initial * WASM_PAGE_SIZE;
+    if (instance->memory_size) {
+        struct address_space* prev = address_space_switch(instance->space);
+        bool mapped = map_anonymous(WASM_MEMORY_BASE, instance->memory_size, true);
+        address_space_switch(prev);
+        if (!mapped) {
             kprintf(ERROR, "Failed to allocate WebAssembly memory\n");
+            address_space_destroy(instance->space);
             kfree(instance);
             return NULL;
         }
-        instance->memory_size = memory_size;
-    } else {
-        instance->memory = NULL;
-        instance->memory_size = 0;
     }
+    wasm_exec_install_trap_handler();
     
     // Copy functions
     uint32_t total_functions = module->import_count + module->function_count;
     instance->functions = kmalloc(sizeof(wasm_function_t) * total_functions);
     if (!instance->functions) {
         kprintf(ERROR, "Failed to allocate function array\n");
-        if (instance->memory) {
-            kfree(instance->memory);
-        }
+        release_memory(instance);
         kfree(instance);
         return NULL;
     }
@@ -282,9 +284,7 @@ wasm_instance_t* wasm_instance_new(wasm_module_t* module) {
         instance->globals = kmalloc(sizeof(wasm_global_t) * module->global_count);
         if (!instance->globals) {
             kprintf(ERROR, "Failed to allocate globals array\n");
-            if (instance->memory) {
-                kfree(instance->memory);
-            }
+            release_memory(instance);
             if (instance->functions) {
                 kfree(instance->functions);
             }
@@ -392,9 +392,7 @@ wasm_instance_t* wasm_instance_new(wasm_module_t* module) {
 void wasm_instance_delete(wasm_instance_t* instance) {
     if (!instance) return;
     
-    if (instance->memory) {
-        kfree(instance->memory);
-    }
+    release_memory(instance);
     
     if (instance->functions) {
         kfree(instance->functions);
@@ -403,10 +401,80 @@ void wasm_instance_delete(wasm_instance_t* instance) {
     if (instance->globals) {
         kfree(instance->globals);
     }
+
+    if (instance->host_functions) {
+        kfree(instance->host_functions);
+    }
     
     kfree(instance);
 }
 
+// Clone an instance in its current state
+wasm_instance_t* wasm_instance_clone(wasm_instance_t* template) {
+    if (!template) {
+        kprintf(ERROR, "Invalid WebAssembly instance\n");
+        return NULL;
+    }
+
+    wasm_instance_t* instance = kmalloc(sizeof(wasm_instance_t));
+    if (!instance) {
+        kprintf(ERROR, "Failed to allocate WebAssembly instance\n");
+        return NULL;
+    }
+    memcpy(instance, template, sizeof(wasm_instance_t));
+    instance->functions = NULL;
+    instance->globals = NULL;
+    instance->host_functions = NULL;
+
+    // Linear memory is shared copy-on-write; pages are copied as either
+    // instance writes them
+    instance->space = address_space_create();
+    if (!instance->space) {
+        kprintf(ERROR, "Failed to create WebAssembly address space\n");
+        kfree(instance);
+        return NULL;
+    }
+    if (instance->memory_size) {
+        struct address_space* prev = address_space_switch(instance->space);
+        bool shared = share_range_cow(template->space, WASM_MEMORY_BASE, instance->memory_size);
+        address_space_switch(prev);
+        if (!shared) {
+            kprintf(ERROR, "Failed to share WebAssembly memory\n");
+            wasm_instance_delete(instance);
+            return NULL;
+        }
+    }
+
+    instance->functions = kmalloc(sizeof(wasm_function_t) * template->function_count);
+    if (template->global_count > 0) {
+        instance->globals = kmalloc(sizeof(wasm_global_t) * template->global_count);
+    }
+    if (template->host_function_count > 0) {
+        instance->host_functions = kmalloc(sizeof(wasm_host_function_t) * template->host_function_count);
+    }
+    if (!instance->functions || (template->global_count > 0 && !instance->globals) ||
+        (template->host_function_count > 0 && !instance->host_functions)) {
+        kprintf(ERROR, "Failed to allocate WebAssembly instance state\n");
+        wasm_instance_delete(instance);
+        return NULL;
+    }
+
+    memcpy(instance->functions, template->functions, sizeof(wasm_function_t) * template->function_count);
+    for (uint32_t i = 0; i < instance->function_count; i++) {
+        instance->functions[i].module = instance;
+    }
+    if (instance->globals) {
+        memcpy(instance->globals, template->globals, sizeof(wasm_global_t) * template->global_count);
+    }
+    if (instance->host_functions) {
+        memcpy(instance->host_functions, template->host_functions,
+               sizeof(wasm_host_function_t) * template->host_function_count);
+    }
+
+    instance->should_exit = false;
+    return instance;
+}
+
 // Call a WebAssembly function
 bool wasm_function_call(wasm_function_t* function, wasm_value_t* args, uint32_t arg_count, wasm_value_t* result) {
     if (!function || !function->code || !result) {
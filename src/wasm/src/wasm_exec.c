@@ -1,6 +1,8 @@
 #include "wasm/wasm_exec.h"
 #include "kernel/mm/kmalloc.h"
 #include "kernel/kprintf.h"
+#include "arch/x86_64/asm.h"
+#include "arch/x86_64/interrupt/isr.h"
 #include <string.h>
 #include <stdint.h>
 
@@ -9,6 +11,43 @@
 // Add function declaration at the top and other static function declarations
 static bool execute_i32_le_s(wasm_exec_context_t* ctx);
 
+// Recovery point for out-of-bounds memory accesses, one per executing function
+typedef struct wasm_trap {
+    jmp_buf env;
+    wasm_instance_t* instance;
+    uintptr_t address;        // Faulting address, filled in by the fault hook
+    struct wasm_trap* prev;   // Trap of the calling function
+} wasm_trap_t;
+
+static wasm_trap_t* current_trap = NULL;
+
+// Runs in place of the faulting access once the page fault handler returns
+__attribute__((noreturn))
+static void wasm_trap_resume(void) {
+    longjmp(current_trap->env, 1);
+}
+
+static bool wasm_page_fault(struct InterruptStackFrame* frame, uintptr_t address) {
+    wasm_trap_t* trap = current_trap;
+    if (!trap) {
+        return false;
+    }
+
+    // Inside the memory a page may just be swapped out
+    uintptr_t memory = (uintptr_t)trap->instance->memory;
+    if (address < memory + trap->instance->memory_size || address - memory >= WASM_MEMORY_RESERVE) {
+        return false;
+    }
+
+    trap->address = address;
+    frame->rip = (uintptr_t)wasm_trap_resume;
+    return true;
+}
+
+void wasm_exec_install_trap_handler(void) {
+    register_page_fault_hook(wasm_page_fault);
+}
+
 // Initialize execution context
 void wasm_exec_context_init(wasm_exec_context_t* ctx, wasm_instance_t* instance, uint32_t local_count) {
     if (!ctx || !instance) {
@@ -23,19 +62,18 @@ void wasm_exec_context_init(wasm_exec_context_t* ctx, wasm_instance_t* instance,
     ctx->instance = instance;
     ctx->local_count = local_count;
     if (local_count > 0) {
-        ctx->locals = kmalloc(sizeof(uint32_t) * local_count);
+        // Locals start out as 0
+        ctx->locals = kzalloc(sizeof(uint32_t) * local_count);
         if (!ctx->locals) {
             kprintf(ERROR, "Failed to allocate locals array\n");
             return;
         }
-        // Initialize locals to 0
-        memset(ctx->locals, 0, sizeof(uint32_t) * local_count);
     } else {
         ctx->locals = NULL;
     }
     
     ctx->stack_capacity = 1024;  // Initial stack size
-    ctx->stack = kmalloc(sizeof(wasm_value_t) * ctx->stack_capacity);
+    ctx->stack = kmalloc_uninit(sizeof(wasm_value_t) * ctx->stack_capacity);
     if (!ctx->stack) {
         kprintf(ERROR, "Failed to allocate stack\n");
         kfree(ctx->locals);
@@ -46,7 +84,7 @@ void wasm_exec_context_init(wasm_exec_context_t* ctx, wasm_instance_t* instance,
     
     // Initialize control flow stack
     ctx->block_stack_capacity = 32;
-    ctx->block_stack = kmalloc(sizeof(wasm_block_t) * ctx->block_stack_capacity);
+    ctx->block_stack = kmalloc_uninit(sizeof(wasm_block_t) * ctx->block_stack_capacity);
     if (!ctx->block_stack) {
         kprintf(ERROR, "Failed to allocate block stack\n");
         kfree(ctx->locals);
@@ -86,14 +124,12 @@ static bool stack_push(wasm_exec_context_t* ctx, wasm_value_t value) {
     if (ctx->stack_size >= ctx->stack_capacity) {
         // Grow stack
         uint32_t new_capacity = ctx->stack_capacity * 2;
-        wasm_value_t* new_stack = kmalloc(sizeof(wasm_value_t) * new_capacity);
+        wasm_value_t* new_stack = krealloc(ctx->stack, sizeof(wasm_value_t) * new_capacity);
         if (!new_stack) {
             kprintf(ERROR, "Failed to grow WebAssembly stack\n");
             return false;
         }
         
-        memcpy(new_stack, ctx->stack, sizeof(wasm_value_t) * ctx->stack_size);
-        kfree(ctx->stack);
         ctx->stack = new_stack;
         ctx->stack_capacity = new_capacity;
     }
@@ -125,13 +161,11 @@ static bool block_stack_push(wasm_exec_context_t* ctx, wasm_block_t block) {
     if (!ctx || !ctx->block_stack) return false;
     if (ctx->block_stack_size >= ctx->block_stack_capacity) {
         uint32_t new_capacity = ctx->block_stack_capacity * 2;
-        wasm_block_t* new_stack = kmalloc(sizeof(wasm_block_t) * new_capacity);
+        wasm_block_t* new_stack = krealloc(ctx->block_stack, sizeof(wasm_block_t) * new_capacity);
         if (!new_stack) {
             kprintf(ERROR, "Failed to grow WebAssembly block stack\n");
             return false;
         }
-        memcpy(new_stack, ctx->block_stack, sizeof(wasm_block_t) * ctx->block_stack_size);
-        kfree(ctx->block_stack);
         ctx->block_stack = new_stack;
         ctx->block_stack_capacity = new_capacity;
     }
@@ -210,124 +244,100 @@ static int32_t read_sleb128(const uint8_t** pc) {
     return result;
 }
 
+// Address of a linear memory access. base + offset is computed in 64 bits,
+// so it always lands inside the instance's WASM_MEMORY_RESERVE reservation;
+// anything past memory_size hits an unmapped page and traps instead of
+// being checked here. __builtin_memcpy keeps the access a single inline
+// load or store.
+static inline uint8_t* memory_address(wasm_exec_context_t* ctx, uint32_t base, uint32_t offset) {
+    return (uint8_t*)ctx->instance->memory + (uint64_t)base + offset;
+}
+
+// Immediate of a load or store: an alignment hint, which x86 can ignore,
+// then the offset
+static inline uint32_t read_memarg(const uint8_t** pc) {
+    read_uleb128(pc);
+    return read_uleb128(pc);
+}
+
 // Memory load operations
 static bool execute_i32_load(wasm_exec_context_t* ctx, const uint8_t** pc) {
-    uint32_t offset = read_uleb128(pc);
-    uint32_t addr = ctx->stack[ctx->stack_size - 1].i32 + offset;
-    
-    if (addr + sizeof(uint32_t) > ctx->instance->memory_size) {
-        kprintf(ERROR, "Memory access out of bounds\n");
-        return false;
-    }
+    uint32_t offset = read_memarg(pc);
+    uint8_t* addr = memory_address(ctx, ctx->stack[ctx->stack_size - 1].i32, offset);
     
     uint32_t value;
-    memcpy(&value, (uint8_t*)ctx->instance->memory + addr, sizeof(uint32_t));
+    __builtin_memcpy(&value, addr, sizeof(uint32_t));
     ctx->stack[ctx->stack_size - 1].i32 = value;
     return true;
 }
 
 static bool execute_i64_load(wasm_exec_context_t* ctx, const uint8_t** pc) {
-    uint32_t offset = read_uleb128(pc);
-    uint32_t addr = ctx->stack[ctx->stack_size - 1].i32 + offset;
-    
-    if (addr + sizeof(uint64_t) > ctx->instance->memory_size) {
-        kprintf(ERROR, "Memory access out of bounds\n");
-        return false;
-    }
+    uint32_t offset = read_memarg(pc);
+    uint8_t* addr = memory_address(ctx, ctx->stack[ctx->stack_size - 1].i32, offset);
     
     uint64_t value;
-    memcpy(&value, (uint8_t*)ctx->instance->memory + addr, sizeof(uint64_t));
+    __builtin_memcpy(&value, addr, sizeof(uint64_t));
     ctx->stack[ctx->stack_size - 1].i64 = value;
     return true;
 }
 
 static bool execute_f32_load(wasm_exec_context_t* ctx, const uint8_t** pc) {
-    uint32_t offset = read_uleb128(pc);
-    uint32_t addr = ctx->stack[ctx->stack_size - 1].i32 + offset;
-    
-    if (addr + sizeof(float) > ctx->instance->memory_size) {
-        kprintf(ERROR, "Memory access out of bounds\n");
-        return false;
-    }
+    uint32_t offset = read_memarg(pc);
+    uint8_t* addr = memory_address(ctx, ctx->stack[ctx->stack_size - 1].i32, offset);
     
     float value;
-    memcpy(&value, (uint8_t*)ctx->instance->memory + addr, sizeof(float));
+    __builtin_memcpy(&value, addr, sizeof(float));
     ctx->stack[ctx->stack_size - 1].f32 = value;
     return true;
 }
 
 static bool execute_f64_load(wasm_exec_context_t* ctx, const uint8_t** pc) {
-    uint32_t offset = read_uleb128(pc);
-    uint32_t addr = ctx->stack[ctx->stack_size - 1].i32 + offset;
-    
-    if (addr + sizeof(double) > ctx->instance->memory_size) {
-        kprintf(ERROR, "Memory access out of bounds\n");
-        return false;
-    }
+    uint32_t offset = read_memarg(pc);
+    uint8_t* addr = memory_address(ctx, ctx->stack[ctx->stack_size - 1].i32, offset);
     
     double value;
-    memcpy(&value, (uint8_t*)ctx->instance->memory + addr, sizeof(double));
+    __builtin_memcpy(&value, addr, sizeof(double));
     ctx->stack[ctx->stack_size - 1].f64 = value;
     return true;
 }
 
 // Memory store operations
 static bool execute_i32_store(wasm_exec_context_t* ctx, const uint8_t** pc) {
-    uint32_t offset = read_uleb128(pc);
-    uint32_t addr = ctx->stack[ctx->stack_size - 2].i32 + offset;
+    uint32_t offset = read_memarg(pc);
+    uint8_t* addr = memory_address(ctx, ctx->stack[ctx->stack_size - 2].i32, offset);
     uint32_t value = ctx->stack[ctx->stack_size - 1].i32;
     
-    if (addr + sizeof(uint32_t) > ctx->instance->memory_size) {
-        kprintf(ERROR, "Memory access out of bounds\n");
-        return false;
-    }
-    
-    memcpy((uint8_t*)ctx->instance->memory + addr, &value, sizeof(uint32_t));
+    __builtin_memcpy(addr, &value, sizeof(uint32_t));
     ctx->stack_size -= 2;
     return true;
 }
 
 static bool execute_i64_store(wasm_exec_context_t* ctx, const uint8_t** pc) {
-    uint32_t offset = read_uleb128(pc);
-    uint32_t addr = ctx->stack[ctx->stack_size - 2].i32 + offset;
+    uint32_t offset = read_memarg(pc);
+    uint8_t* addr = memory_address(ctx, ctx->stack[ctx->stack_size - 2].i32, offset);
     uint64_t value = ctx->stack[ctx->stack_size - 1].i64;
     
-    if (addr + sizeof(uint64_t) > ctx->instance->memory_size) {
-        kprintf(ERROR, "Memory access out of bounds\n");
-        return false;
-    }
-    
-    memcpy((uint8_t*)ctx->instance->memory + addr, &value, sizeof(uint64_t));
+    __builtin_memcpy(addr, &value, sizeof(uint64_t));
     ctx->stack_size -= 2;
     return true;
 }
 
 static bool execute_f32_store(wasm_exec_context_t* ctx, const uint8_t** pc) {
-    uint32_t offset = read_uleb128(pc);
-    uint32_t addr = ctx->stack[ctx->stack_size - 2].i32 + offset;
+    uint32_t offset = read_memarg(pc);
+    uint8_t* addr = memory_address(ctx, ctx->stack[ctx->stack_size - 2].i32, offset);
     float value = ctx->stack[ctx->stack_size - 1].f32;
     
-    if (addr + sizeof(float) > ctx->instance->memory_size) {
-        kprintf(ERROR, "Memory access out of bounds\n");
-        return false;
-    }
-    
-    memcpy((uint8_t*)ctx->instance->memory + addr, &value, sizeof(float));
+    __builtin_memcpy(addr, &value, sizeof(float));
     ctx->stack_size -= 2;
     return true;
 }
 
 static bool execute_f64_store(wasm_exec_context_t* ctx, const uint8_t** pc) {
-    uint32_t offset = read_uleb128(pc);
-    uint32_t addr = ctx->stack[ctx->stack_size - 2].i32 + offset;
+    uint32_t offset = read_memarg(pc);
+    uint8_t* addr = memory_address(ctx, ctx->stack[ctx->stack_size - 2].i32, offset);
     double value = ctx->stack[ctx->stack_size - 1].f64;
     
-    if (addr + sizeof(double) > ctx->instance->memory_size) {
-        kprintf(ERROR, "Memory access out of bounds\n");
-        return false;
-    }
-    
-    memcpy((uint8_t*)ctx->instance->memory + addr, &value, sizeof(double));
+    __builtin_memcpy(addr, &value, sizeof(double));
     ctx->stack_size -= 2;
     return true;
 }
@@ -1031,7 +1041,7 @@ bool wasm_execute_instruction(wasm_exec_context_t* ctx) {
                     return false;
                 }
                 
-                wasm_value_t* args = kmalloc(sizeof(wasm_value_t) * arg_count);
+                wasm_value_t* args = kmalloc_uninit(sizeof(wasm_value_t) * arg_count);
                 if (!args) {
                     kprintf(ERROR, "Failed to allocate arguments for host function call\n");
                     return false;
@@ -1104,7 +1114,7 @@ bool wasm_execute_instruction(wasm_exec_context_t* ctx) {
             // Prepare arguments from stack
             wasm_value_t* args = NULL;
             if (callee->type->param_count > 0) {
-                args = kmalloc(sizeof(wasm_value_t) * callee->type->param_count);
+                args = kmalloc_uninit(sizeof(wasm_value_t) * callee->type->param_count);
                 if (!args) {
                     kprintf(ERROR, "Failed to allocate arguments for function call\n");
                     return false;
@@ -1201,6 +1211,23 @@ bool wasm_execute_function(wasm_function_t* function, wasm_value_t* args, uint32
         kprintf(DEBUG, "[WASM] Set local %u to 0\n", i);
     }
     
+    // Linear memory lives in the instance's own address space
+    wasm_instance_t* instance = function->module;
+    struct address_space* prev_space = address_space_switch(instance->space);
+
+    // An out-of-bounds access anywhere below this point resumes here
+    wasm_trap_t trap = { .instance = instance, .prev = current_trap };
+    if (setjmp(trap.env)) {
+        current_trap = trap.prev;
+        address_space_switch(prev_space);
+        kprintf(ERROR, "[WASM] Trap: out of bounds memory access at 0x%x\n",
+                trap.address - (uintptr_t)trap.instance->memory);
+        result->i32 = 0;
+        wasm_exec_context_cleanup(&ctx);
+        return false;
+    }
+    current_trap = &trap;
+
     // Execute instructions until we hit an end or return
     bool success = true;
     while (success && ctx.pc) {
@@ -1229,6 +1256,9 @@ bool wasm_execute_function(wasm_function_t* function, wasm_value_t* args, uint32
         kprintf(DEBUG, "[WASM] Function returned default value: 0\n");
     }
     
+    current_trap = trap.prev;
+    address_space_switch(prev_space);
+
     // Clean up execution context
     wasm_exec_context_cleanup(&ctx);
     
@@ -1243,4 +1273,120 @@ static bool execute_i32_le_s(wasm_exec_context_t* ctx) {
     }
     wasm_value_t result = { .i32 = a.i32 <= b.i32 };
     return stack_push(ctx, result);
-} 
\ No newline at end of file
+} 
+
+// One page of memory and two exports:
+//   load(addr: i32) -> i32        i32.load at addr
+//   store(addr: i32, value: i32)  i32.store at addr
+static const uint8_t test_module[] = {
+    0x00, 0x61, 0x73, 0x6D, 0x01, 0x00, 0x00, 0x00,
+    0x01, 0x0B, 0x02, 0x60, 0x01, 0x7F, 0x01, 0x7F, 0x60, 0x02, 0x7F, 0x7F, 0x00,
+    0x03, 0x03, 0x02, 0x00, 0x01,
+    0x05, 0x03, 0x01, 0x00, 0x01,
+    0x07, 0x10, 0x02, 0x04, 'l', 'o', 'a', 'd', 0x00, 0x00, 0x05, 's', 't', 'o', 'r', 'e', 0x00, 0x01,
+    0x0A, 0x13, 0x02,
+    0x07, 0x00, 0x20, 0x00, 0x28, 0x02, 0x00, 0x0B,
+    0x09, 0x00, 0x20, 0x00, 0x20, 0x01, 0x36, 0x02, 0x00, 0x0B,
+};
+
+// Run load (0) or store (1) of the test module on `instance`
+static bool test_call(wasm_instance_t* instance, uint32_t index, uint32_t address, uint32_t value, uint32_t* result) {
+    wasm_function_t* function = &instance->functions[index];
+    wasm_value_t args[2] = { {.i32 = (int32_t)address}, {.i32 = (int32_t)value} };
+    wasm_value_t out = {0};
+    bool ok = wasm_execute_function(function, args, function->type->param_count, &out);
+    if (result) {
+        *result = (uint32_t)out.i32;
+    }
+    return ok;
+}
+
+// Run one export of the test module; true if it trapped and left the
+// caller's address space and trap chain as they were
+static bool trap_test_call(wasm_function_t* function, uint32_t address, bool* trapped) {
+    struct address_space* space = current_address_space();
+    wasm_trap_t* trap = current_trap;
+    wasm_value_t args[2] = { {.i32 = (int32_t)address}, {.i32 = 0x5A5A5A5A} };
+    wasm_value_t result;
+    *trapped = !wasm_execute_function(function, args, function->type->param_count, &result);
+    return current_address_space() == space && current_trap == trap;
+}
+
+void wasm_trap_test(void) {
+    kprintf(INFO, "[WASM] Starting trap tests...\n");
+
+    wasm_module_t* module = wasm_module_new(test_module, sizeof(test_module));
+    wasm_instance_t* instance = module ? wasm_instance_new(module) : NULL;
+    if (!instance) {
+        kprintf(ERROR, "[WASM] Trap test setup failed\n");
+        wasm_module_delete(module);
+        return;
+    }
+    wasm_function_t* load = &instance->functions[0];
+    wasm_function_t* store = &instance->functions[1];
+
+    // Past the end of memory, 4 GB out, and a store straddling the end
+    struct {
+        wasm_function_t* function;
+        uint32_t address;
+    } cases[] = {
+        { load, WASM_PAGE_SIZE },
+        { load, 0xFFFFFFFF },
+        { store, WASM_PAGE_SIZE },
+        { store, WASM_PAGE_SIZE - 2 },
+    };
+    bool ok = true;
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        bool trapped = false;
+        ok = trap_test_call(cases[i].function, cases[i].address, &trapped) && trapped && ok;
+    }
+
+    // The instance keeps working after a trap
+    bool trapped = true;
+    wasm_value_t args[1] = { {.i32 = 16} };
+    wasm_value_t result = {0};
+    ok = ok && trap_test_call(store, 16, &trapped) && !trapped;
+    ok = ok && wasm_execute_function(load, args, 1, &result) && (uint32_t)result.i32 == 0x5A5A5A5A;
+    if (ok) {
+        kprintf(INFO, "[WASM] Out-of-bounds trap test passed\n");
+    } else {
+        kprintf(ERROR, "[WASM] Out-of-bounds trap test failed\n");
+    }
+
+    wasm_instance_delete(instance);
+    wasm_module_delete(module);
+}
+
+void wasm_clone_test(void) {
+    kprintf(INFO, "[WASM] Starting clone tests...\n");
+
+    wasm_module_t* module = wasm_module_new(test_module, sizeof(test_module));
+    wasm_instance_t* template = module ? wasm_instance_new(module) : NULL;
+    if (!template) {
+        kprintf(ERROR, "[WASM] Clone test setup failed\n");
+        wasm_module_delete(module);
+        return;
+    }
+
+    // The clone starts from the template's memory, then each side's stores
+    // stay its own
+    uint32_t value = 0, other = 0;
+    bool ok = test_call(template, 1, 16, 0x1111, NULL);
+    wasm_instance_t* clone = ok ? wasm_instance_clone(template) : NULL;
+    ok = clone && test_call(clone, 0, 16, 0, &value) && value == 0x1111;
+    ok = ok && test_call(clone, 1, 16, 0x2222, NULL) &&
+         test_call(template, 0, 16, 0, &value) && test_call(clone, 0, 16, 0, &other) &&
+         value == 0x1111 && other == 0x2222;
+    ok = ok && test_call(template, 1, 32, 0x3333, NULL) &&
+         test_call(clone, 0, 32, 0, &value) && test_call(template, 0, 32, 0, &other) &&
+         value == 0 && other == 0x3333;
+    if (ok) {
+        kprintf(INFO, "[WASM] Clone memory isolation test passed\n");
+    } else {
+        kprintf(ERROR, "[WASM] Clone memory isolation test failed\n");
+    }
+
+    wasm_instance_delete(clone);
+    wasm_instance_delete(template);
+    wasm_module_delete(module);
+}
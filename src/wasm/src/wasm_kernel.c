@@ -8,6 +8,7 @@
 #include <string.h>
 
 #define O_RDONLY 0
+#define WASM_MAP_MAX (4u << 20)  // Largest module parsed straight from the page cache
 
 bool wasm_load_module(const char* filename, wasm_module_t** module) {
     // Open the file
@@ -25,29 +26,33 @@ bool wasm_load_module(const char* filename, wasm_module_t** module) {
         return false;
     }
 
-    // Allocate buffer for module
-    uint8_t* buffer = kmalloc(size);
-    if (!buffer) {
-        kprintf(ERROR, "Failed to allocate memory for module\n");
-        vfs_close(node);
-        return false;
+    // Map the file instead of copying it: the parser works on the page
+    // cache directly. Larger modules, or ones the page cache cannot hold,
+    // are read into the heap instead.
+    uint8_t* bytes = size <= WASM_MAP_MAX ? vfs_mmap(node, 0, size) : NULL;
+    if (bytes && !vfs_mmap_populate(bytes, size)) {
+        vfs_munmap(bytes);
+        bytes = NULL;
     }
-
-    // Read the file
-    uint32_t bytes_read = vfs_read(node, 0, size, buffer);
-    vfs_close(node);
-
-    if (bytes_read != size) {
-        kprintf(ERROR, "Failed to read entire module file\n");
-        kfree(buffer);
-        return false;
+    if (bytes) {
+        vfs_close(node);
+        *module = wasm_module_new_mapped(bytes, size);
+    } else {
+        bytes = kmalloc_uninit(size);
+        bool read = bytes && vfs_read(node, 0, size, bytes) == size;
+        vfs_close(node);
+        if (!read) {
+            kprintf(ERROR, "Failed to read module file\n");
+            kfree(bytes);
+            return false;
+        }
+        *module = wasm_module_new(bytes, size);
+        kfree(bytes);
     }
 
     // Parse the module
-    *module = wasm_module_new(buffer, size);
     if (!*module) {
         kprintf(ERROR, "Failed to parse WebAssembly module\n");
-        kfree(buffer);
         return false;
     }
 
@@ -132,6 +137,10 @@ bool wasm_execute_function_by_name_with_args(wasm_module_t* module, const char*
 void wasm_test(void) {
     kprintf(INFO, "Initializing WebAssembly runtime...\n");
 
+    // Built in, so it runs even without the test module on disk
+    wasm_trap_test();
+    wasm_clone_test();
+
     // Load test module
     wasm_module_t* module = NULL;
     if (!wasm_load_module("/WASM/TEST~1.WAS", &module)) {
@@ -169,6 +178,27 @@ void wasm_test(void) {
         kprintf(ERROR, "Failed to execute mul function\n");
     }
 
+    // Test that a clone of a template instance runs like a fresh one
+    wasm_instance_t* template = wasm_instance_new(module);
+    wasm_instance_t* clone = wasm_instance_clone(template);
+    wasm_value_t clone_result = {0};
+    bool cloned = false;
+    for (size_t i = 0; clone && i < module->export_count; i++) {
+        if (strcmp(module->exports[i].name, "add") == 0) {
+            cloned = wasm_execute_function(&clone->functions[module->exports[i].index],
+                                           add_args, 2, &clone_result);
+            break;
+        }
+    }
+    if (cloned && clone_result.i32 == 5) {
+        kprintf(INFO, "Cloned instance add(2, 3) = %d\n", clone_result.i32);
+    } else {
+        kprintf(ERROR, "Cloned instance test failed\n");
+        failed = true;
+    }
+    wasm_instance_delete(clone);
+    wasm_instance_delete(template);
+
     // Cleanup
     wasm_module_delete(module);
 
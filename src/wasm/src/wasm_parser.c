@@ -1,6 +1,6 @@
 #include "wasm/wasm_parser.h"
 #include "kernel/kprintf.h"
-#include "kernel/mm/kmalloc.h"
+#include "kernel/mm/arena.h"
 #include <string.h>
 
 // Helper function to read a LEB128-encoded unsigned integer
@@ -32,7 +32,7 @@ static bool read_leb128_u32(const uint8_t* bytes, size_t size, size_t* offset, u
 }
 
 // Parse a function type
-bool parse_functype(const uint8_t* bytes, size_t size, size_t* offset, wasm_functype_t* type) {
+bool parse_functype(arena_t* arena, const uint8_t* bytes, size_t size, size_t* offset, wasm_functype_t* type) {
     if (!bytes || !offset || !type || *offset >= size) {
         return false;
     }
@@ -52,7 +52,7 @@ bool parse_functype(const uint8_t* bytes, size_t size, size_t* offset, wasm_func
     
     // Allocate and read parameter types
     if (param_count > 0) {
-        type->params = kmalloc(sizeof(wasm_value_type_t) * param_count);
+        type->params = arena_alloc(arena, sizeof(wasm_value_type_t) * param_count);
         if (!type->params) {
             kprintf(ERROR, "Failed to allocate parameter types\n");
             return false;
@@ -64,7 +64,6 @@ bool parse_functype(const uint8_t* bytes, size_t size, size_t* offset, wasm_func
     for (uint32_t i = 0; i < param_count; i++) {
         if (*offset >= size) {
             kprintf(ERROR, "Unexpected end of data while reading parameter types\n");
-            kfree(type->params);
             return false;
         }
         type->params[i] = (wasm_value_type_t)bytes[(*offset)++];
@@ -75,16 +74,14 @@ bool parse_functype(const uint8_t* bytes, size_t size, size_t* offset, wasm_func
     uint32_t result_count;
     if (!read_leb128_u32(bytes, size, offset, &result_count)) {
         kprintf(ERROR, "Failed to read result count\n");
-        kfree(type->params);
         return false;
     }
     
     // Allocate and read result types
     if (result_count > 0) {
-        type->results = kmalloc(sizeof(wasm_value_type_t) * result_count);
+        type->results = arena_alloc(arena, sizeof(wasm_value_type_t) * result_count);
         if (!type->results) {
             kprintf(ERROR, "Failed to allocate result types\n");
-            kfree(type->params);
             return false;
         }
     } else {
@@ -118,7 +115,7 @@ bool wasm_parse_type_section(wasm_module_t* module, const uint8_t* bytes, size_t
     }
     
     // Allocate type array
-    module->types = kmalloc(sizeof(wasm_functype_t) * type_count);
+    module->types = arena_alloc(&module->arena, sizeof(wasm_functype_t) * type_count);
     if (!module->types) {
         kprintf(ERROR, "Failed to allocate type array\n");
         return false;
@@ -127,20 +124,7 @@ bool wasm_parse_type_section(wasm_module_t* module, const uint8_t* bytes, size_t
     
     // Parse each function type
     for (uint32_t i = 0; i < type_count; i++) {
-        if (!parse_functype(bytes, size, offset, &module->types[i])) {
-            // Cleanup on failure
-            if (module->types[i].params) {
-                kfree(module->types[i].params);
-            }
-            if (module->types[i].results) {
-                kfree(module->types[i].results);
-            }
-            // Clean up previously allocated types
-            for (uint32_t j = 0; j < i; j++) {
-                kfree(module->types[j].params);
-                kfree(module->types[j].results);
-            }
-            kfree(module->types);
+        if (!parse_functype(&module->arena, bytes, size, offset, &module->types[i])) {
             return false;
         }
     }
@@ -162,14 +146,12 @@ bool wasm_parse_function_section(wasm_module_t* module, const uint8_t* bytes, si
     }
     
     // Allocate function array
-    module->functions = kmalloc(sizeof(wasm_function_t) * function_count);
+    module->functions = arena_zalloc(&module->arena, sizeof(wasm_function_t) * function_count);
     if (!module->functions) {
         kprintf(ERROR, "Failed to allocate function array\n");
         return false;
     }
-    
-    // Initialize all functions to NULL/0
-    memset(module->functions, 0, sizeof(wasm_function_t) * function_count);
+
     module->function_count = function_count;
     
     // Read type indices for each function
@@ -177,13 +159,11 @@ bool wasm_parse_function_section(wasm_module_t* module, const uint8_t* bytes, si
         uint32_t type_index;
         if (!read_leb128_u32(bytes, size, offset, &type_index)) {
             kprintf(ERROR, "Failed to read type index for function %d\n", i);
-            kfree(module->functions);
             return false;
         }
         
         if (type_index >= module->type_count) {
             kprintf(ERROR, "Invalid type index %d for function %d\n", type_index, i);
-            kfree(module->functions);
             return false;
         }
         
@@ -266,7 +246,7 @@ bool wasm_parse_code_section(wasm_module_t* module, const uint8_t* bytes, size_t
             kprintf(ERROR, "Function code overruns section bounds for function %d\n", i);
             return false;
         }
-        uint8_t* code = kmalloc(code_size);
+        uint8_t* code = arena_alloc(&module->arena, code_size);
         if (!code) {
             kprintf(ERROR, "Failed to allocate %d bytes for function %d code\n", code_size, i);
             return false;
@@ -296,7 +276,7 @@ bool wasm_parse_export_section(wasm_module_t* module, const uint8_t* bytes, size
     }
     
     // Allocate export array
-    module->exports = kmalloc(sizeof(wasm_export_t) * export_count);
+    module->exports = arena_alloc(&module->arena, sizeof(wasm_export_t) * export_count);
     if (!module->exports) {
         kprintf(ERROR, "Failed to allocate export array\n");
         return false;
@@ -309,33 +289,26 @@ bool wasm_parse_export_section(wasm_module_t* module, const uint8_t* bytes, size
         uint32_t name_length;
         if (!read_leb128_u32(bytes, size, offset, &name_length)) {
             kprintf(ERROR, "Failed to read export name length\n");
-            kfree(module->exports);
             return false;
         }
         
         // Read name
         if (*offset + name_length > size) {
             kprintf(ERROR, "Export name exceeds section bounds\n");
-            kfree(module->exports);
             return false;
         }
         
-        module->exports[i].name = kmalloc(name_length + 1);
+        module->exports[i].name = arena_strndup(&module->arena, bytes + *offset, name_length);
         if (!module->exports[i].name) {
             kprintf(ERROR, "Failed to allocate export name\n");
-            kfree(module->exports);
             return false;
         }
         
-        memcpy(module->exports[i].name, bytes + *offset, name_length);
-        module->exports[i].name[name_length] = '\0';
         *offset += name_length;
         
         // Read export kind
         if (*offset >= size) {
             kprintf(ERROR, "Unexpected end of data while reading export kind\n");
-            kfree(module->exports[i].name);
-            kfree(module->exports);
             return false;
         }
         module->exports[i].kind = bytes[(*offset)++];
@@ -344,8 +317,6 @@ bool wasm_parse_export_section(wasm_module_t* module, const uint8_t* bytes, size
         uint32_t export_index;
         if (!read_leb128_u32(bytes, size, offset, &export_index)) {
             kprintf(ERROR, "Failed to read export index\n");
-            kfree(module->exports[i].name);
-            kfree(module->exports);
             return false;
         }
         module->exports[i].index = export_index;
@@ -419,7 +390,7 @@ bool wasm_parse_import_section(wasm_module_t* module, const uint8_t* bytes, size
     }
     
     // Allocate import array
-    module->imports = kmalloc(sizeof(wasm_import_t) * import_count);
+    module->imports = arena_alloc(&module->arena, sizeof(wasm_import_t) * import_count);
     if (!module->imports) {
         kprintf(ERROR, "Failed to allocate import array\n");
         return false;
@@ -432,63 +403,47 @@ bool wasm_parse_import_section(wasm_module_t* module, const uint8_t* bytes, size
         uint32_t module_name_len;
         if (!read_leb128_u32(bytes, size, offset, &module_name_len)) {
             kprintf(ERROR, "Failed to read module name length for import %d\n", i);
-            kfree(module->imports);
             return false;
         }
         
         // Read module name
         if (*offset + module_name_len > size) {
             kprintf(ERROR, "Module name exceeds section bounds for import %d\n", i);
-            kfree(module->imports);
             return false;
         }
         
-        module->imports[i].module_name = kmalloc(module_name_len + 1);
+        module->imports[i].module_name = arena_strndup(&module->arena, bytes + *offset, module_name_len);
         if (!module->imports[i].module_name) {
             kprintf(ERROR, "Failed to allocate module name for import %d\n", i);
-            kfree(module->imports);
             return false;
         }
         
-        memcpy(module->imports[i].module_name, bytes + *offset, module_name_len);
-        module->imports[i].module_name[module_name_len] = '\0';
         *offset += module_name_len;
         
         // Read field name length
         uint32_t field_name_len;
         if (!read_leb128_u32(bytes, size, offset, &field_name_len)) {
             kprintf(ERROR, "Failed to read field name length for import %d\n", i);
-            kfree(module->imports[i].module_name);
-            kfree(module->imports);
             return false;
         }
         
         // Read field name
         if (*offset + field_name_len > size) {
             kprintf(ERROR, "Field name exceeds section bounds for import %d\n", i);
-            kfree(module->imports[i].module_name);
-            kfree(module->imports);
             return false;
         }
         
-        module->imports[i].field_name = kmalloc(field_name_len + 1);
+        module->imports[i].field_name = arena_strndup(&module->arena, bytes + *offset, field_name_len);
         if (!module->imports[i].field_name) {
             kprintf(ERROR, "Failed to allocate field name for import %d\n", i);
-            kfree(module->imports[i].module_name);
-            kfree(module->imports);
             return false;
         }
         
-        memcpy(module->imports[i].field_name, bytes + *offset, field_name_len);
-        module->imports[i].field_name[field_name_len] = '\0';
         *offset += field_name_len;
         
         // Read import kind
         if (*offset >= size) {
             kprintf(ERROR, "Unexpected end of data while reading import kind\n");
-            kfree(module->imports[i].field_name);
-            kfree(module->imports[i].module_name);
-            kfree(module->imports);
             return false;
         }
         module->imports[i].kind = bytes[(*offset)++];
@@ -498,9 +453,6 @@ bool wasm_parse_import_section(wasm_module_t* module, const uint8_t* bytes, size
             uint32_t type_index;
             if (!read_leb128_u32(bytes, size, offset, &type_index)) {
                 kprintf(ERROR, "Failed to read type index for import %d\n", i);
-                kfree(module->imports[i].field_name);
-                kfree(module->imports[i].module_name);
-                kfree(module->imports);
                 return false;
             }
             module->imports[i].type_index = type_index;
@@ -524,7 +476,7 @@ bool wasm_parse_global_section(wasm_module_t* module, const uint8_t* bytes, size
     }
     
     // Allocate global array
-    module->globals = kmalloc(sizeof(wasm_global_t) * global_count);
+    module->globals = arena_alloc(&module->arena, sizeof(wasm_global_t) * global_count);
     if (!module->globals) {
         kprintf(ERROR, "Failed to allocate global array\n");
         return false;
@@ -536,21 +488,18 @@ bool wasm_parse_global_section(wasm_module_t* module, const uint8_t* bytes, size
         // Read global type
         if (*offset >= size) {
             kprintf(ERROR, "Unexpected end of data while reading global type\n");
-            kfree(module->globals);
             return false;
         }
         
         uint8_t type = bytes[(*offset)++];
         if (type != 0x7F) {  // Only support i32 for now
             kprintf(ERROR, "Unsupported global type: 0x%02X\n", type);
-            kfree(module->globals);
             return false;
         }
         
         // Read mutability flag
         if (*offset >= size) {
             kprintf(ERROR, "Unexpected end of data while reading global mutability\n");
-            kfree(module->globals);
             return false;
         }
         
@@ -560,14 +509,12 @@ bool wasm_parse_global_section(wasm_module_t* module, const uint8_t* bytes, size
         // Read initializer expression
         if (*offset >= size) {
             kprintf(ERROR, "Unexpected end of data while reading global initializer\n");
-            kfree(module->globals);
             return false;
         }
         
         uint8_t opcode = bytes[(*offset)++];
         if (opcode != 0x41) {  // i32.const
             kprintf(ERROR, "Unsupported global initializer opcode: 0x%02X\n", opcode);
-            kfree(module->globals);
             return false;
         }
         
@@ -579,7 +526,6 @@ bool wasm_parse_global_section(wasm_module_t* module, const uint8_t* bytes, size
         do {
             if (*offset >= size) {
                 kprintf(ERROR, "Unexpected end of data while reading global value\n");
-                kfree(module->globals);
                 return false;
             }
             byte = bytes[(*offset)++];
@@ -596,7 +542,6 @@ bool wasm_parse_global_section(wasm_module_t* module, const uint8_t* bytes, size
         // Read end opcode
         if (*offset >= size || bytes[(*offset)++] != 0x0B) {  // end
             kprintf(ERROR, "Missing end opcode in global initializer\n");
-            kfree(module->globals);
             return false;
         }
     }
@@ -691,9 +636,11 @@ void wasm_parser_test(const uint8_t* wasm_bytes, size_t wasm_size) {
     wasm_module_t module = {0};
     module.bytes = (uint8_t*)wasm_bytes;
     module.size = wasm_size;
+    arena_init(&module.arena, wasm_size);
 
     if (!wasm_parse_module(&module)) {
         kprintf(ERROR, "WASM parse failed\n");
+        arena_release(&module.arena);
         return;
     }
 
@@ -723,4 +670,6 @@ void wasm_parser_test(const uint8_t* wasm_bytes, size_t wasm_size) {
             kprintf(INFO, "[TEST] Code bytes: %s\n", buf);
         }
     }
+
+    arena_release(&module.arena);
 } 
\ No newline at end of file